@@ -5,6 +5,7 @@ from PySide2 import *
 from PySide2.QtCore import Qt
 
 from . import baseControlPanel
+from . import blackboard
 
 
 class ControlPanel(baseControlPanel.BaseControlPanel):
@@ -17,6 +18,19 @@ class ControlPanel(baseControlPanel.BaseControlPanel):
 
         self.addCheckbox("Converge", self.bbBool("converge"), initial = False)
 
+        self.addCheckbox("Reproject", self.bbBool("reproject"), initial = False)
+
+        self.addCheckbox("Adaptive Sampling", self.bbBool("adaptiveSampling"), initial = False)
+
+        self.addFloatInput(
+            "Adaptive Threshold",
+            self.bbFloat("adaptiveThreshold"),
+            low = 0.001,
+            high = 1,
+            initial = 0.02,
+            step = 0.005,
+            decimals = 3)
+
         self.addIntInput(
             "AO Rays per Frame",
             self.bbInt("aoRaysPerFrame"),
@@ -24,6 +38,46 @@ class ControlPanel(baseControlPanel.BaseControlPanel):
             high = 100,
             initial = 1)
 
+        self.addCheckbox(
+            "Low Discrepancy Sampling",
+            self.bbBool("lowDiscrepancySampling"),
+            initial = True)
+
+        self.addIntInput(
+            "AO Sampler (-1 Global, 0 Random, 1 Low Discrepancy)",
+            self.bbInt("sampler_ao"),
+            low = -1,
+            high = 1,
+            initial = -1)
+
+        self.addIntInput(
+            "Forward Sampler (-1 Global, 0 Random, 1 Low Discrepancy)",
+            self.bbInt("sampler_forward"),
+            low = -1,
+            high = 1,
+            initial = -1)
+
+        self.addIntInput(
+            "Path Tracing Sampler (-1 Global, 0 Random, 1 Low Discrepancy)",
+            self.bbInt("sampler_path"),
+            low = -1,
+            high = 1,
+            initial = -1)
+
+        self.addIntInput(
+            "AO Bake Sampler (-1 Global, 0 Random, 1 Low Discrepancy)",
+            self.bbInt("sampler_aoBake"),
+            low = -1,
+            high = 1,
+            initial = -1)
+
+        self.addIntInput(
+            "Sampler Stats Samples",
+            self.bbInt("samplerStatsSamples"),
+            low = 1,
+            high = 4096,
+            initial = 64)
+
         self.addFloatInput(
             "AO Max Distance",
             self.bbFloat("ao_maxdist"),
@@ -31,6 +85,178 @@ class ControlPanel(baseControlPanel.BaseControlPanel):
             high = 100,
             initial = 100)
 
+        self.addCheckbox("AS Cache", self.bbBool("asCache"), initial = True)
+
+        self.addIntInput(
+            "AS Cache Size (MB)",
+            self.bbInt("asCacheSizeMB"),
+            low = 0,
+            high = 1024 * 1024,
+            initial = 8192)
+
+        self.addIntInput(
+            "Scratch Budget (MB)",
+            self.bbInt("scratchBudgetMB"),
+            low = 1,
+            high = 64 * 1024,
+            initial = 256)
+
+        self.addCheckbox("Host AS Builds", self.bbBool("hostASBuilds"), initial = False)
+
+        self.addIntInput(
+            "Host AS Build Max Triangles",
+            self.bbInt("hostASBuildMaxTriangles"),
+            low = 0,
+            high = 1024 * 1024 * 1024,
+            initial = 64 * 1024)
+
+        self.addCheckbox("Frame Budget", self.bbBool("frameBudget"), initial = False)
+
+        self.addFloatInput(
+            "Frame Budget (ms)",
+            self.bbFloat("frameBudgetMs"),
+            low = 1,
+            high = 1000,
+            initial = 33.3,
+            step = 1,
+            decimals = 1)
+
+        self.addIntInput(
+            "Trace Rate (0 Full, 1 Checkerboard, 2 Quarter)",
+            self.bbInt("traceRate"),
+            low = 0,
+            high = 2,
+            initial = 0)
+
+        self.addCheckbox("Ray Query Backend", self.bbBool("rayQueryBackend"), initial = False)
+
+        self.addCheckbox("Forward Mode", self.bbBool("forward"), initial = False)
+
+        self.addCheckbox("Bake AO (Forward Mode)", self.bbBool("aoBake"), initial = False)
+
+        self.addIntInput(
+            "AO Bake Samples",
+            self.bbInt("aoBakeSamples"),
+            low = 1,
+            high = 65536,
+            initial = 256)
+
+        self.addIntInput(
+            "AO Bake Rays per Frame",
+            self.bbInt("aoBakeRaysPerFrame"),
+            low = 1,
+            high = 256,
+            initial = 16)
+
+        self.addCheckbox("Visibility Buffer", self.bbBool("visibilityBuffer"), initial = False)
+
+        self.addCheckbox("Path Tracing", self.bbBool("pathTracing"), initial = False)
+
+        self.addIntInput(
+            "Path Max Bounces",
+            self.bbInt("pathMaxBounces"),
+            low = 1,
+            high = 8,
+            initial = 4)
+
+        self.addCheckbox("Denoise", self.bbBool("denoise"), initial = False)
+
+        self.addIntInput(
+            "Denoise Iterations",
+            self.bbInt("denoiseIterations"),
+            low = 1,
+            high = 10,
+            initial = 5)
+
+        self.addFloatInput(
+            "Denoise Temporal Alpha",
+            self.bbFloat("denoiseAlpha"),
+            low = 0.01,
+            high = 1,
+            initial = 0.2,
+            step = 0.05,
+            decimals = 2)
+
+        with self.addGroup("Stats"):
+            self._gpuFrameTimeText = self.addText("GPU Frame (ms)")
+            self._renderScaleText = self.addText("Render Scale")
+            self._aoRaysPerFrameText = self.addText("AO Rays per Frame")
+            self._samplerRmseText = self.addText("Sampler RMSE (Random/Sobol/Lattice)")
+            self._rtPassTimeText = self.addText("RT Pass (ms)")
+            self._raysPerSecondText = self.addText("Rays/s (M)")
+            self._pathsPerSecondText = self.addText("Paths/s (M)")
+            self._pathBouncesText = self.addText("Path Bounces")
+            self._traceRateText = self.addText("Trace Rate")
+            self._numLocalLightsText = self.addText("Scene Local Lights")
+            self._radianceCacheCellsText = self.addText("Radiance Cache Cells")
+            self._environmentSizeText = self.addText("Environment Map Size")
+            self._aoBakeProgressText = self.addText("AO Bake (%)")
+            self._denoiseTemporalTimeText = self.addText("Denoise Temporal (ms)")
+            self._denoiseVarianceTimeText = self.addText("Denoise Variance (ms)")
+            self._denoiseFilterTimeText = self.addText("Denoise Filter (ms)")
+        self._statsTimer = QtCore.QTimer(self)
+        self._statsTimer.timeout.connect(self._updateStats)
+        self._statsTimer.start(500)
+
+        self.addIntInput(
+            "Local Light Samples",
+            self.bbInt("localLightSamples"),
+            low = 1,
+            high = 16,
+            initial = 1)
+
+        self.addCheckbox("ReSTIR Local Lights", self.bbBool("restir"), initial = False)
+
+        self.addIntInput(
+            "ReSTIR Candidates",
+            self.bbInt("restirCandidates"),
+            low = 1,
+            high = 64,
+            initial = 8)
+
+        self.addCheckbox("Environment Map", self.bbBool("environment"), initial = True)
+
+        self.addCheckbox("Environment MIS", self.bbBool("environmentMis"), initial = True)
+
+        self.addIntInput(
+            "Environment Map Max Width",
+            self.bbInt("environmentMaxWidth"),
+            low = 64,
+            high = 8192,
+            initial = 2048)
+
+        self.addCheckbox("Radiance Cache", self.bbBool("radianceCache"), initial = False)
+
+        self.addIntInput(
+            "Radiance Cache Update Interval (frames)",
+            self.bbInt("radianceCacheInterval"),
+            low = 1,
+            high = 256,
+            initial = 16)
+
+        self.addFloatInput(
+            "Radiance Cache Cell Scale",
+            self.bbFloat("radianceCacheScale"),
+            low = 0.001,
+            high = 0.5,
+            initial = 0.02,
+            step = 0.005,
+            decimals = 3)
+
+        self.addIntInput(
+            "Radiance Cache TTL (frames)",
+            self.bbInt("radianceCacheTTL"),
+            low = 1,
+            high = 10000,
+            initial = 60)
+
+        self.addIntInput(
+            "Radiance Cache Memory (MB)",
+            self.bbInt("radianceCacheMB"),
+            low = 1,
+            high = 1024,
+            initial = 32)
+
         self.addIntInput(
             "Lights",
             self._numLightsChanged,
@@ -45,6 +271,31 @@ class ControlPanel(baseControlPanel.BaseControlPanel):
             self._addLightGroup(i)
         self._numLightsChanged(0)
 
+    def _updateStats(self):
+        self._gpuFrameTimeText.setText("{:.2f}".format(blackboard.getFloat("stats_gpuFrameMs")))
+        self._renderScaleText.setText("{:.3f}".format(blackboard.getFloat("stats_renderScale")))
+        self._aoRaysPerFrameText.setText(str(blackboard.getInt("stats_aoRaysPerFrame")))
+        self._samplerRmseText.setText("/".join("{:.4f}".format(blackboard.getFloat("stats_samplerRmse" + name))
+            for name in ["Random", "Sobol", "Lattice"]))
+        self._rtPassTimeText.setText("{:.2f}".format(blackboard.getFloat("stats_rtPassMs")))
+        self._raysPerSecondText.setText("{:.1f}".format(blackboard.getFloat("stats_mraysPerSecond")))
+        self._pathsPerSecondText.setText("{:.1f}".format(blackboard.getFloat("stats_mpathsPerSecond")))
+        # How many paths ended after each number of bounces, as percentages.
+        pathBounces = [blackboard.getInt("stats_pathBounces_{}".format(i)) for i in range(9)]
+        totalPaths = max(sum(pathBounces), 1)
+        self._pathBouncesText.setText(" ".join("{:.0f}".format(100 * n / totalPaths) for n in pathBounces))
+        traceRateNames = ["Full", "Checkerboard", "Quarter"]
+        self._traceRateText.setText(traceRateNames[min(max(blackboard.getInt("stats_traceRate"), 0), 2)])
+        self._numLocalLightsText.setText(str(blackboard.getInt("stats_numLocalLights")))
+        self._radianceCacheCellsText.setText(str(blackboard.getInt("stats_radianceCacheCells")))
+        self._environmentSizeText.setText("{}x{}".format(
+            blackboard.getInt("stats_environmentWidth"),
+            blackboard.getInt("stats_environmentHeight")))
+        self._aoBakeProgressText.setText("{:.0f}".format(blackboard.getFloat("stats_aoBakeProgress")))
+        self._denoiseTemporalTimeText.setText("{:.2f}".format(blackboard.getFloat("stats_denoiseTemporalMs")))
+        self._denoiseVarianceTimeText.setText("{:.2f}".format(blackboard.getFloat("stats_denoiseVarianceMs")))
+        self._denoiseFilterTimeText.setText("{:.2f}".format(blackboard.getFloat("stats_denoiseFilterMs")))
+
     def _addLightColorChannel(self, channelName, lightI, channelI):
         self.addFloatInput(
             channelName,
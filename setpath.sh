@@ -1,3 +1,4 @@
 export PXR_PLUGINPATH_NAME="`pwd`/build/:`pwd`/build/usdview_plugin/:$PXR_PLUGINPATH_NAME"
 export PYTHONPATH="`pwd`/build/usdview_plugin/:$PYTHONPATH"
 export HVRT_RESOURCE_PATH="`pwd`/build/"
+export HVRT_AS_CACHE_PATH="`pwd`/build/as_cache/"
@@ -0,0 +1,71 @@
+// Shared by the denoiser's passes, an SVGF-style filter (Schied et al. 2017). It works on
+// illumination, i.e. color with the albedo divided out, so texture detail isn't blurred away.
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+layout(push_constant) uniform PushConstants {
+    vec3 cameraOrigin;
+    uint resetHistory;
+    float colorAlpha;
+    float momentsAlpha;
+    int stepSize;
+    uint flags;
+} pushConstants;
+
+// Must match the DENOISE_ flags in Denoiser.cpp.
+const uint DENOISE_WRITE_HISTORY = 1;
+const uint DENOISE_WRITE_OUTPUT = 2;
+const uint DENOISE_REPROJECT = 4;
+
+layout(set = 0, binding = 0, rgba32f) uniform image2D colorImage;
+layout(set = 0, binding = 1, rgba16f) uniform readonly image2D albedoImage;
+layout(set = 0, binding = 2, rgba32f) uniform readonly image2D worldPositionImage;
+layout(set = 0, binding = 3, rgba16f) uniform readonly image2D worldNormalImage;
+layout(set = 0, binding = 4, rgba32f) uniform image2D historyIlluminationImage;
+layout(set = 0, binding = 5, rgba32f) uniform image2D momentsImage;
+layout(set = 0, binding = 6, rgba32f) uniform readonly image2D illuminationInImage;
+layout(set = 0, binding = 7, rgba32f) uniform writeonly image2D illuminationOutImage;
+layout(set = 0, binding = 8, rg16f) uniform readonly image2D motionImage;
+layout(set = 0, binding = 9, rgba32f) uniform image2D historyMomentsImage;
+layout(set = 0, binding = 10, rgba32f) uniform readonly image2D historyWorldPositionImage;
+layout(set = 0, binding = 11, rgba16f) uniform readonly image2D historyWorldNormalImage;
+
+// How far a neighbor may sit off the center pixel's tangent plane, relative to the center's distance
+// from the camera, before it stops contributing.
+const float SIGMA_POSITION = 0.005f;
+
+// How sharply normals have to agree.
+const float SIGMA_NORMAL = 128.0f;
+
+float luminance(vec3 color) {
+    return dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+vec3 demodulate(vec3 color, vec3 albedo) {
+    return color / max(albedo, vec3(0.001f));
+}
+
+vec3 remodulate(vec3 illumination, vec3 albedo) {
+    return illumination * max(albedo, vec3(0.001f));
+}
+
+bool inImage(ivec2 imageCoords) {
+    return all(greaterThanEqual(imageCoords, ivec2(0)))
+        && all(lessThan(imageCoords, imageSize(colorImage)));
+}
+
+// Edge-stopping weight for the geometry of a neighboring pixel. The position tolerance grows with
+// the center's distance from the camera, so it roughly tracks the pixel footprint.
+float geometryWeight(
+    vec3 normal,
+    vec3 position,
+    vec3 sampleNormal,
+    vec3 samplePosition,
+    float positionScale)
+{
+    float normalWeight = pow(max(dot(normal, sampleNormal), 0.0f), SIGMA_NORMAL);
+    float planeDistance = abs(dot(normal, samplePosition - position));
+    float cameraDistance = max(length(position - pushConstants.cameraOrigin), 1e-4f);
+    float positionWeight = exp(-planeDistance / (SIGMA_POSITION * positionScale * cameraDistance));
+    return normalWeight * positionWeight;
+}
@@ -0,0 +1,48 @@
+#version 460
+#extension GL_EXT_ray_query : require
+#extension GL_GOOGLE_include_directive : require
+
+// Forward mode's fragment shader, which shades with inline ray queries as it rasterizes instead of
+// writing a G-buffer for a later ray tracing pass.
+
+#include "lighting.glsl"
+#include "rayquery.glsl"
+
+// These follow the vertex shader's push constants, see FORWARD_PUSH_CONSTANTS_OFFSET.
+layout(push_constant) uniform PushConstants {
+    layout(offset = 192) uint accumulateFrame;
+    int aoRaysPerFrame;
+    uint samplerType;
+} pushConstants;
+
+layout(location = 0) in vec3 fragNormal;
+layout(location = 1) in flat vec3 fragColor;
+layout(location = 2) in vec3 fragPosition;
+layout(location = 5) in float fragBakedAO;
+
+layout(location = 0) out vec4 outColor;
+
+void main() {
+
+    samplerInit(pushConstants.samplerType, uvec2(gl_FragCoord.xy));
+
+    // Meshes with a finished AO bake light their ambient light with it instead of tracing AO rays.
+    bool baked = fragBakedAO >= 0.0f;
+    int aoRays = baked ? 0 : pushConstants.aoRaysPerFrame;
+
+    // Blending averages this in with the previous frames.
+    vec3 color = shade(
+        fragColor,
+        fragPosition,
+        normalize(fragNormal),
+        pushConstants.accumulateFrame * uint(pushConstants.aoRaysPerFrame),
+        aoRays,
+        true);
+    // The bake only knows how much of the sky is visible, so an environment map is just looked up
+    // along the normal.
+    if (baked) {
+        vec3 ambientLight = environmentRadiance(normalize(fragNormal));
+        color += fragColor * ambientLight * clamp(fragBakedAO, 0.0f, 1.0f);
+    }
+    outColor = vec4(color, 1.0f);
+}
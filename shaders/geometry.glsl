@@ -0,0 +1,64 @@
+// Looks up the surface a ray hit in the path geometry table, for shaders which need more than the
+// hit distance and have no SBT records to find it with. Includers must enable
+// GL_EXT_buffer_reference and GL_EXT_buffer_reference_uvec2.
+
+layout(buffer_reference, std430, buffer_reference_align = 4) readonly buffer Vertices {
+    float vertices[];
+};
+layout(buffer_reference, std430, buffer_reference_align = 4) readonly buffer Triangles {
+    int indices[];
+};
+
+// Must match HVRTRenderPass::PathGeometry. Each TLAS instance's custom index is its first entry, and
+// its geometries follow in order. Triangle indices are relative to firstTriangle, as in the BLAS, and
+// modelToWorld holds the first three rows of the transform.
+struct PathGeometry {
+    uvec2 vertices;
+    uvec2 indices;
+    uint firstTriangle;
+    uint padding0;
+    uint padding1;
+    uint padding2;
+    vec4 modelToWorld[3];
+    vec4 color;
+};
+layout(set = 0, binding = 26, std430) readonly buffer PathGeometries {
+    PathGeometry geometries[];
+};
+
+vec3 loadWorldVertex(PathGeometry geometry, int index) {
+    Vertices vertices = Vertices(geometry.vertices);
+    vec4 v = vec4(
+        vertices.vertices[3 * index],
+        vertices.vertices[3 * index + 1],
+        vertices.vertices[3 * index + 2],
+        1.0f);
+    return vec3(
+        dot(geometry.modelToWorld[0], v),
+        dot(geometry.modelToWorld[1], v),
+        dot(geometry.modelToWorld[2], v));
+}
+
+// Gives the hit triangle's geometric normal, facing back along the ray since meshes can be seen
+// from either side, and its mesh's color.
+void hitSurface(
+    int instanceCustomIndex,
+    int geometryIndex,
+    int primitiveIndex,
+    vec3 rayDirection,
+    out vec3 normal,
+    out vec3 albedo)
+{
+    PathGeometry geometry = geometries[instanceCustomIndex + geometryIndex];
+    int triangle = int(geometry.firstTriangle) + primitiveIndex;
+    Triangles triangles = Triangles(geometry.indices);
+    vec3 v0 = loadWorldVertex(geometry, triangles.indices[3 * triangle]);
+    vec3 v1 = loadWorldVertex(geometry, triangles.indices[3 * triangle + 1]);
+    vec3 v2 = loadWorldVertex(geometry, triangles.indices[3 * triangle + 2]);
+
+    normal = cross(v1 - v0, v2 - v0);
+    normal = (normal == vec3(0.0f)) ? -rayDirection : normalize(normal);
+    if (dot(normal, rayDirection) > 0.0f) normal = -normal;
+
+    albedo = geometry.color.rgb;
+}
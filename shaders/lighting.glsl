@@ -0,0 +1,151 @@
+// Shading shared by every pass which lights surfaces with AO, directional lights and local lights
+// from the scene, which are picked stochastically in proportion to their power. AO rays which
+// escape see the dome light's environment, or the ambient light without one. Includers must define
+// occluded() using whichever kind of ray tracing they have available, and call samplerInit() before
+// shading. Includers which can find out what AO rays hit can define LIGHTING_INDIRECT and
+// indirectLight(), which gives the light arriving along an AO ray in place of the environment's
+// visibility.
+
+layout(set = 0, binding = 0) uniform accelerationStructureEXT as;
+
+#include "lights.glsl"
+
+const float inf = 1.0f / 0.0f;
+
+#include "sampler.glsl"
+
+vec3 sampleCosineHemisphere(vec2 u) {
+    float phi = TWO_PI * u.x;
+    float cosTheta = sqrt(u.y);
+    float sinTheta = sqrt(max(0.0f, 1.0f - cosTheta * cosTheta));
+    return vec3(
+        sinTheta * cos(phi),
+        sinTheta * sin(phi),
+        cosTheta);
+}
+
+mat3 makeBasis(vec3 normal) {
+    vec3 tangent1 = normalize(cross(normal, vec3(1, 2, 3)));
+    vec3 tangent2 = normalize(cross(tangent1, normal));
+    return mat3(tangent2, tangent1, normal);
+}
+
+bool occluded(vec3 position, vec3 direction, float maxDistance);
+
+#ifdef LIGHTING_INDIRECT
+vec3 indirectLight(vec3 position, vec3 direction, float maxDistance);
+#endif
+
+// Light arriving from one point sampled on a local light, already divided by the pdf of sampling
+// that point.
+vec3 shadeLocalLight(LocalLight light, vec3 position, vec3 normal, vec2 u) {
+
+    vec3 lightDir;
+    float dist;
+    float area;
+    vec3 integrand = localLightIntegrand(light, position, normal, u, lightDir, dist, area);
+    if (integrand == vec3(0.0f)) return vec3(0.0f);
+
+    // Stop short of the light so sphere lights don't shadow themselves.
+    if (light.raytraced != 0 && occluded(position, lightDir, dist * (1.0f - 1e-3f))) {
+        return vec3(0.0f);
+    }
+
+    return integrand * area;
+}
+
+// AO rays take consecutive sample indices starting from firstSampleIndex. Local lights can be left
+// out for passes which light them some other way, and ambient light with no AO rays.
+vec3 shade(
+    vec3 albedo,
+    vec3 position,
+    vec3 normal,
+    uint firstSampleIndex,
+    int aoRays,
+    bool sampleLocalLights)
+{
+
+    if (normal == vec3(0.0f)) return vec3(0.0f);
+
+    mat3 surfaceToWorld = makeBasis(normal);
+
+    vec3 lighting = vec3(0.0f);
+
+    // Ambient lighting, from the environment. With multiple importance sampling, AO rays alternate
+    // between sampling the cosine lobe and the environment map from one sample index to the next,
+    // and both are weighted with the balance heuristic, so small bright regions like the sun are
+    // found without losing the cosine lobe's low noise elsewhere. Otherwise cosine weighting leaves
+    // each ray with just the light arriving along it.
+    vec3 ambientLighting = vec3(0.0f);
+    const float ambientLightMaxDistance = lightData.ambientLightIntensity_maxDistance.w;
+    bool environmentMis = hasEnvironment() && lightData.environmentWidth_height_enabled_mis.w != 0;
+    for (int i = 0; i < aoRays; i++) {
+        uint sampleIndex = firstSampleIndex + uint(i);
+        samplerStart(sampleIndex);
+        vec2 u = sample2D();
+        vec3 sampleDirection;
+        float weight = 1.0f;
+        if (environmentMis) {
+            sampleDirection =
+                (sampleIndex % 2u == 0u)
+                ? surfaceToWorld * sampleCosineHemisphere(u)
+                : sampleEnvironment(u);
+            float cosinePdf = dot(normal, sampleDirection) / PI;
+            if (cosinePdf <= 0.0f) continue;
+            weight = cosinePdf / (0.5f * cosinePdf + 0.5f * environmentPdf(sampleDirection));
+        } else {
+            sampleDirection = surfaceToWorld * sampleCosineHemisphere(u);
+        }
+#ifdef LIGHTING_INDIRECT
+        ambientLighting += weight * indirectLight(position, sampleDirection, ambientLightMaxDistance);
+#else
+        if (!occluded(position, sampleDirection, ambientLightMaxDistance)) {
+            ambientLighting += weight * environmentRadiance(sampleDirection);
+        }
+#endif
+    }
+    if (aoRays > 0) lighting += ambientLighting / float(aoRays);
+
+    // Directional lighting.
+    for (int i = 0; i < lightData.numLights_numLocalLights_localLightSamples_padding.x; i++) {
+
+        vec3 lightDir = lightData.lights[i].v_directional.xyz;
+
+        float nDotL = dot(normal, lightDir);
+        if (nDotL <= 0.0f) continue;
+
+        bool raytraced = (lightData.lights[i].intensity_raytraced.w != 0.0f);
+        if (raytraced && occluded(position, lightDir, inf)) {
+            continue;
+        }
+
+        lighting += lightData.lights[i].intensity_raytraced.rgb * nDotL;
+    }
+
+    // Local lighting. With only a few lights, each gets a sample, and otherwise a few are picked so
+    // the cost stays the same however many lights there are. Light samples take the dimensions
+    // after the AO ray's in the same sample indices, wrapping to later dimensions if there are more
+    // light samples than AO rays.
+    int numLocalLights =
+        sampleLocalLights ? lightData.numLights_numLocalLights_localLightSamples_padding.y : 0;
+    int localLightSamples = lightData.numLights_numLocalLights_localLightSamples_padding.z;
+    int sampleIndices = max(aoRays, 1);
+    if (numLocalLights <= localLightSamples) {
+        for (int i = 0; i < numLocalLights; i++) {
+            samplerStart(firstSampleIndex + uint(i % sampleIndices));
+            for (int j = 0; j <= i / sampleIndices; j++) sample2D();
+            lighting += shadeLocalLight(localLights[i], position, normal, sample2D());
+        }
+    } else {
+        for (int i = 0; i < localLightSamples; i++) {
+            samplerStart(firstSampleIndex + uint(i % sampleIndices));
+            for (int j = 0; j <= 2 * (i / sampleIndices); j++) sample2D();
+            LocalLight light = localLights[sampleLocalLight(sample2D().x, numLocalLights)];
+            lighting +=
+                shadeLocalLight(light, position, normal, sample2D())
+                / (light.selectionPdf * float(localLightSamples));
+        }
+    }
+
+    return albedo * lighting;
+}
@@ -0,0 +1,201 @@
+// Scene light declarations and sampling, shared by everything that reads the lights with or without
+// tracing shadow rays.
+
+struct Light {
+    vec4 v_directional;
+    vec4 intensity_raytraced;
+};
+// Must match MAX_DIRECTIONAL_LIGHTS in RenderPass.h.
+const int MAX_DIRECTIONAL_LIGHTS = 16;
+layout(set = 0, binding = 5) uniform LightData {
+    ivec4 numLights_numLocalLights_localLightSamples_padding;
+    vec4 ambientLightIntensity_maxDistance;
+    ivec4 environmentWidth_height_enabled_mis;
+    vec4 environmentScale;
+    vec4 environmentAxes[3];
+    Light lights[MAX_DIRECTIONAL_LIGHTS];
+} lightData;
+
+// Must match the TYPE_ constants in Light.h.
+const uint LIGHT_SPHERE = 0;
+const uint LIGHT_RECT = 1;
+const uint LIGHT_DISK = 2;
+
+// Must match HVRTLight::Data. u and v are the half extents of rect lights and the radii of disk
+// lights. Each entry of the alias table keeps its own light with aliasProbability, and otherwise
+// gives the pick to aliasIndex.
+struct LocalLight {
+    vec3 position;
+    uint type;
+    vec3 radiance;
+    uint raytraced;
+    vec3 axis;
+    float cosConeOuter;
+    vec3 u;
+    float cosConeInner;
+    vec3 v;
+    float radius;
+    float aliasProbability;
+    uint aliasIndex;
+    float selectionPdf;
+    float padding;
+};
+layout(set = 0, binding = 16, std430) readonly buffer LocalLights {
+    LocalLight localLights[];
+};
+
+const float PI = 3.14159265359f;
+const float TWO_PI = 6.28318530718f;
+
+vec3 sampleSphere(vec2 u) {
+    float phi = TWO_PI * u.x;
+    float cosTheta = u.y;
+    float sinTheta = sqrt(max(0.0f, 1.0f - cosTheta * cosTheta));
+    return vec3(
+        sinTheta * cos(phi),
+        sinTheta * sin(phi),
+        cosTheta);
+}
+
+// Picks a local light in proportion to its power using the alias table.
+uint sampleLocalLight(float u, int numLocalLights) {
+    float scaled = u * float(numLocalLights);
+    uint i = min(uint(scaled), uint(numLocalLights - 1));
+    return (fract(scaled) < localLights[i].aliasProbability) ? i : localLights[i].aliasIndex;
+}
+
+// Unshadowed light arriving from the point u picks on a local light, per unit of the light's area,
+// so dividing by the pdf of picking that point over the light's area gives an estimate of all the
+// light arriving from it. Point lights have no area, so theirs is 1 and their radiance is taken as
+// their intensity. Also gives the direction and distance to the point, for shadow rays.
+vec3 localLightIntegrand(
+    LocalLight light,
+    vec3 position,
+    vec3 normal,
+    vec2 u,
+    out vec3 lightDir,
+    out float dist,
+    out float area)
+{
+    vec3 lightPosition = light.position;
+    vec3 lightNormal = vec3(0.0f);
+    area = 1.0f;
+    if (light.type == LIGHT_SPHERE) {
+        if (light.radius > 0.0f) {
+            lightNormal = sampleSphere(vec2(u.x, 2.0f * u.y - 1.0f));
+            lightPosition += light.radius * lightNormal;
+            area = 2.0f * TWO_PI * light.radius * light.radius;
+        }
+    } else if (light.type == LIGHT_RECT) {
+        lightPosition += (2.0f * u.x - 1.0f) * light.u + (2.0f * u.y - 1.0f) * light.v;
+        lightNormal = light.axis;
+        area = 4.0f * length(light.u) * length(light.v);
+    } else {
+        float r = sqrt(u.x);
+        float phi = TWO_PI * u.y;
+        lightPosition += r * cos(phi) * light.u + r * sin(phi) * light.v;
+        lightNormal = light.axis;
+        area = PI * length(light.u) * length(light.v);
+    }
+
+    vec3 toLight = lightPosition - position;
+    float distanceSquared = dot(toLight, toLight);
+    dist = sqrt(distanceSquared);
+    lightDir = toLight / max(dist, 1e-20f);
+    if (distanceSquared == 0.0f) return vec3(0.0f);
+
+    float nDotL = dot(normal, lightDir);
+    if (nDotL <= 0.0f) return vec3(0.0f);
+
+    float cosLight = (lightNormal == vec3(0.0f)) ? 1.0f : dot(lightNormal, -lightDir);
+    if (cosLight <= 0.0f) return vec3(0.0f);
+
+    float spot = 1.0f;
+    if (light.cosConeOuter > -1.0f) {
+        spot = smoothstep(light.cosConeOuter, light.cosConeInner, dot(light.axis, -lightDir));
+    }
+
+    return light.radiance * (spot * nDotL * cosLight / distanceSquared);
+}
+
+// Must match EnvironmentMap::Texel. The dome light's environment map, with an alias table over its
+// texels like local lights have, which picks them in proportion to the light arriving from them.
+struct EnvironmentTexel {
+    vec3 radiance;
+    float aliasProbability;
+    uint aliasIndex;
+    float selectionPdf;
+    float padding0;
+    float padding1;
+};
+layout(set = 0, binding = 29, std430) readonly buffer EnvironmentTexels {
+    EnvironmentTexel environmentTexels[];
+};
+
+bool hasEnvironment() {
+    return lightData.environmentWidth_height_enabled_mis.z != 0;
+}
+
+// The map is equirectangular, with its poles along the environment's Y axis and the image's center
+// looking down its -Z axis. Also gives the sine of the direction's angle from the pole, which the
+// texels' solid angles shrink with.
+uint environmentTexel(vec3 direction, out float sinTheta) {
+    vec3 d = normalize(vec3(
+        dot(lightData.environmentAxes[0].xyz, direction),
+        dot(lightData.environmentAxes[1].xyz, direction),
+        dot(lightData.environmentAxes[2].xyz, direction)));
+    uvec2 size = uvec2(lightData.environmentWidth_height_enabled_mis.xy);
+    float u = fract(0.5f + atan(d.x, -d.z) / TWO_PI);
+    float v = acos(clamp(d.y, -1.0f, 1.0f)) / PI;
+    sinTheta = sqrt(max(0.0f, 1.0f - d.y * d.y));
+    uvec2 texel = min(uvec2(vec2(u, v) * vec2(size)), size - uvec2(1));
+    return texel.y * size.x + texel.x;
+}
+
+// Light arriving from infinitely far away along direction, which is the ambient light without an
+// environment map.
+vec3 environmentRadiance(vec3 direction) {
+    if (!hasEnvironment()) return lightData.ambientLightIntensity_maxDistance.rgb;
+    float sinTheta;
+    uint i = environmentTexel(direction, sinTheta);
+    return lightData.environmentScale.rgb * environmentTexels[i].radiance;
+}
+
+// The solid angle pdf of sampleEnvironment() picking direction. Picking a texel and then a uniform
+// point in it has a constant pdf over the image, which is stretched over less solid angle near the
+// poles.
+float environmentPdf(vec3 direction) {
+    float sinTheta;
+    uint i = environmentTexel(direction, sinTheta);
+    if (sinTheta <= 0.0f) return 0.0f;
+    ivec2 size = lightData.environmentWidth_height_enabled_mis.xy;
+    return environmentTexels[i].selectionPdf * float(size.x * size.y) / (TWO_PI * PI * sinTheta);
+}
+
+// Picks a direction in proportion to the light arriving from it, using the alias table. u.x picks
+// the texel and where across it, and u.y whether to take its alias and where down it.
+vec3 sampleEnvironment(vec2 u) {
+
+    uvec2 size = uvec2(lightData.environmentWidth_height_enabled_mis.xy);
+    uint numTexels = size.x * size.y;
+    float scaled = u.x * float(numTexels);
+    uint i = min(uint(scaled), numTexels - 1);
+    float offsetX = fract(scaled);
+
+    float aliasProbability = environmentTexels[i].aliasProbability;
+    float offsetY;
+    if (u.y < aliasProbability) {
+        offsetY = u.y / aliasProbability;
+    } else {
+        i = environmentTexels[i].aliasIndex;
+        offsetY = (u.y - aliasProbability) / (1.0f - aliasProbability);
+    }
+
+    float phi = TWO_PI * ((float(i % size.x) + offsetX) / float(size.x) - 0.5f);
+    float theta = PI * (float(i / size.x) + offsetY) / float(size.y);
+    vec3 d = vec3(sin(theta) * sin(phi), cos(theta), -sin(theta) * cos(phi));
+    return normalize(
+        d.x * lightData.environmentAxes[0].xyz
+        + d.y * lightData.environmentAxes[1].xyz
+        + d.z * lightData.environmentAxes[2].xyz);
+}
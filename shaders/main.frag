@@ -3,13 +3,20 @@
 layout(location = 0) in vec3 fragNormal;
 layout(location = 1) in flat vec3 fragColor;
 layout(location = 2) in vec3 fragPosition;
+layout(location = 3) in vec4 fragNdcPosition;
+layout(location = 4) in vec4 fragPrevNdcPosition;
 
 layout(location = 0) out vec4 outAlbedo;
 layout(location = 1) out vec4 outWorldPosition;
 layout(location = 2) out vec4 outWorldNormal;
+layout(location = 3) out vec2 outMotion;
 
 void main() {
     outAlbedo = vec4(fragColor, 1.0f);
     outWorldPosition = vec4(fragPosition, 1.0f);
     outWorldNormal = vec4(normalize(fragNormal), 1.0f);
+
+    // Motion since last frame, in fractions of the image size.
+    outMotion =
+        0.5f * (fragNdcPosition.xy / fragNdcPosition.w - fragPrevNdcPosition.xy / fragPrevNdcPosition.w);
 }
@@ -1,23 +1,41 @@
 #version 460
 
 layout(push_constant) uniform PushConstants {
-    mat4 modelToNdc;
     mat4 modelToWorld;
+    mat4 prevModelToWorld;
     mat3 normalModelToWorld;
     vec3 color;
+    uint bakedAO;
 } pushConstants;
 
+layout(set = 0, binding = 9) uniform CameraData {
+    mat4 worldToNdc;
+    mat4 prevWorldToNdc;
+} cameraData;
+
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inNormal;
+layout(location = 2) in float inBakedAO;
 
 layout(location = 0) out vec3 fragNormal;
 layout(location = 1) out flat vec3 fragColor;
 layout(location = 2) out vec3 fragPosition;
+layout(location = 3) out vec4 fragNdcPosition;
+layout(location = 4) out vec4 fragPrevNdcPosition;
+layout(location = 5) out float fragBakedAO;
 
 void main() {
-    gl_Position = pushConstants.modelToNdc * vec4(inPosition, 1.0f);
+    vec4 fragPositionHomog = pushConstants.modelToWorld * vec4(inPosition, 1.0f);
+    gl_Position = cameraData.worldToNdc * fragPositionHomog;
     fragNormal = normalize(pushConstants.normalModelToWorld * inNormal);
     fragColor = pushConstants.color;
-    vec4 fragPositionHomog = pushConstants.modelToWorld * vec4(inPosition, 1.0f);
     fragPosition = fragPositionHomog.xyz / fragPositionHomog.w;
+
+    // Negative when the mesh has no finished AO bake, so AO rays have to be traced instead.
+    fragBakedAO = (pushConstants.bakedAO != 0) ? inBakedAO : -1.0f;
+
+    // Where this vertex was last frame, for motion vectors.
+    fragNdcPosition = gl_Position;
+    fragPrevNdcPosition =
+        cameraData.prevWorldToNdc * pushConstants.prevModelToWorld * vec4(inPosition, 1.0f);
 }
@@ -0,0 +1,131 @@
+// Shared state for the wavefront path tracer. Each pixel with a G-buffer surface traces one path per
+// frame, and the stages pass paths to each other through queues of path indices rather than
+// looping over bounces in one shader, so every dispatch only runs the paths which still need that
+// stage and its invocations all do the same work:
+//
+//  pathGenerate.comp: starts a path at each pixel's G-buffer surface, and queues it for shading.
+//  pathShade.comp: queues a shadow ray towards one light, and unless Russian roulette or the bounce
+//      limit ends the path, picks its next direction and queues the extension ray.
+//  pathShadow.comp: traces the shadow rays, adding the light of the unoccluded ones.
+//  pathSort.comp: compacts the extension rays into direction bins so rays traced together travel
+//      the same way.
+//  pathExtend.comp: traces the extension rays, queueing the hits for shading, and adding the
+//      environment for misses.
+//  pathAdvance.comp: turns the queues' lengths into indirect dispatch arguments between stages.
+//  pathResolve.comp: accumulates each pixel's path like main.rgen accumulates its frames.
+//
+// Includers must include lighting.glsl first.
+
+layout(push_constant) uniform PushConstants {
+    mat4 ndcToWorld;
+    vec3 cameraOrigin;
+    uint accumulateFrame;
+    int aoRaysPerFrame;
+    uint samplerType;
+    float adaptiveThreshold;
+    uint denoise;
+    uint traceRate;
+    uint restirCandidates;
+    uint frame;
+    uint radianceCacheInterval;
+    float radianceCacheScale;
+    uint radianceCacheTTL;
+} pushConstants;
+
+// Must match MAX_PATH_BOUNCES in RenderPass.h.
+const uint MAX_PATH_BOUNCES = 8;
+
+// Extension rays are sorted into one bin per octant of direction.
+const uint PATH_SORT_BINS = 8;
+
+// Paths can't be cut short by Russian roulette until this many bounces in.
+const uint RUSSIAN_ROULETTE_BOUNCES = 2;
+
+struct PathState {
+    vec3 throughput;
+    uint sampleIndex;
+    vec3 position;
+    uint bounce;
+    vec3 normal;
+    uint pixel;
+    vec3 albedo;
+    float padding0;
+    vec3 direction;
+    float padding1;
+};
+
+struct ShadowRay {
+    vec3 origin;
+    uint path;
+    vec3 direction;
+    float maxDistance;
+    vec3 contribution;
+    float padding;
+};
+
+// Must match HVRTRenderPass::PathCounters. Each stage appends to its queue with the counts, which
+// pathAdvance.comp copies into the dispatch arguments' w and resets. The dispatch arguments' xyz are
+// the indirect dispatch sizes.
+layout(set = 0, binding = 20, std430) buffer PathCounters {
+    uvec4 hitDispatch;
+    uvec4 shadowDispatch;
+    uvec4 rayDispatch;
+    uint hitCount;
+    uint shadowCount;
+    uint nextRayCount;
+    uint maxBounces;
+    uint binCounts[PATH_SORT_BINS];
+    uint binCursors[PATH_SORT_BINS];
+    uint paths;
+    uint rays;
+    uint padding0;
+    uint padding1;
+    uint bounceHistogram[MAX_PATH_BOUNCES + 1];
+} counters;
+
+layout(set = 0, binding = 21, std430) buffer PathStates {
+    PathState paths[];
+};
+layout(set = 0, binding = 22, std430) buffer HitQueue {
+    uint hitQueue[];
+};
+layout(set = 0, binding = 23, std430) buffer RayQueue {
+    uint rayQueue[];
+};
+layout(set = 0, binding = 24, std430) buffer NextRayQueue {
+    uint nextRayQueue[];
+};
+layout(set = 0, binding = 25, std430) buffer ShadowQueue {
+    ShadowRay shadowQueue[];
+};
+layout(set = 0, binding = 27, rgba32f) uniform image2D pathRadianceImage;
+
+// Queue stages run one invocation per entry.
+const uint PATH_GROUP_SIZE = 256;
+
+ivec2 unpackPixel(uint pixel) {
+    return ivec2(pixel & 0xffff, pixel >> 16);
+}
+
+uint packPixel(ivec2 pixel) {
+    return uint(pixel.x) | (uint(pixel.y) << 16);
+}
+
+void addPathRadiance(uint path, vec3 radiance) {
+    ivec2 pixel = unpackPixel(paths[path].pixel);
+    imageStore(pathRadianceImage, pixel, imageLoad(pathRadianceImage, pixel) + vec4(radiance, 0.0f));
+}
+
+// Each bounce draws its dimensions from its own range of the path's sample: the light pick and
+// Russian roulette, the point on the light, and the next direction.
+const uint PATH_BOUNCE_DIMENSIONS = 3;
+
+void pathSamplerStart(PathState path) {
+    samplerInit(pushConstants.samplerType, uvec2(unpackPixel(path.pixel)));
+    samplerStartAt(path.sampleIndex, PATH_BOUNCE_DIMENSIONS * path.bounce);
+}
+
+// Extension rays are binned by the octant their direction points into.
+uint pathSortBin(vec3 direction) {
+    return uint(direction.x < 0.0f) | (uint(direction.y < 0.0f) << 1) | (uint(direction.z < 0.0f) << 2);
+}
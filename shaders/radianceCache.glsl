@@ -0,0 +1,104 @@
+// World-space radiance cache: a hash grid of diffuse light leaving surfaces, which AO rays read at
+// their hits to light surfaces with bounced light rather than just the ambient light. Cells get
+// bigger further from the camera, so distant surfaces don't take up huge numbers of them, and are
+// keyed by the normal's dominant axis too, so both sides of thin walls keep their own light.
+//
+// main.rgen adds samples to cells with fixed-point atomics, and radianceCacheResolve.comp blends
+// each frame's samples into the cells' radiance afterwards, evicting cells which haven't been
+// updated in a while. Cells are claimed by linear probing from their hash, and marked by a second
+// hash, so colliding keys are rare rather than impossible. Includers must include sampler.glsl
+// first.
+
+// Must match HVRTRenderPass::RadianceCacheCell.
+struct RadianceCacheCell {
+    uint checksum;
+    uint lastUpdateFrame;
+    uint sampleCount;
+    uint padding;
+    uvec4 sampleSum;
+    vec4 radiance_frames;
+};
+layout(set = 0, binding = 28, std430) buffer RadianceCache {
+    RadianceCacheCell radianceCacheCells[];
+};
+
+// How far from its hash slot a cell can be.
+const uint RADIANCE_CACHE_PROBES = 8;
+
+// Samples are summed as fixed point, with each one clamped to RADIANCE_CACHE_MAX_SAMPLE. A cell
+// takes at most RADIANCE_CACHE_MAX_SAMPLES samples a frame and drops the rest, so its sums can't
+// overflow.
+const float RADIANCE_CACHE_FIXED_POINT = 256.0f;
+const float RADIANCE_CACHE_MAX_SAMPLE = 1024.0f;
+const uint RADIANCE_CACHE_MAX_SAMPLES = 0xffffffffu / uint(RADIANCE_CACHE_MAX_SAMPLE * RADIANCE_CACHE_FIXED_POINT);
+
+// Cells blend in new frames' samples with at least this weight, so they keep up with changes.
+const float RADIANCE_CACHE_MAX_FRAMES = 32.0f;
+
+// Gives the hash slot of the cell a surface point falls in, and the checksum marking it. Cell sizes
+// are powers of two, at about scale times the distance from the camera.
+uint radianceCacheKey(vec3 position, vec3 normal, vec3 cameraOrigin, float scale, out uint checksum) {
+
+    float cellSizeLog2 = clamp(floor(log2(scale * distance(position, cameraOrigin))), -16.0f, 16.0f);
+    ivec3 cell = ivec3(floor(position * exp2(-cellSizeLog2)));
+
+    vec3 absNormal = abs(normal);
+    uint axis = (absNormal.x > absNormal.y && absNormal.x > absNormal.z) ? 0 : (absNormal.y > absNormal.z ? 1 : 2);
+    uint side = normal[axis] < 0.0f ? 1 : 0;
+
+    uint key = hashu(uint(cell.x));
+    key = hashCombine(key, uint(cell.y));
+    key = hashCombine(key, uint(cell.z));
+    key = hashCombine(key, uint(int(cellSizeLog2) + 16) | (axis << 8) | (side << 10));
+
+    // Zero marks empty cells.
+    checksum = max(hashu(key ^ 0x5bd1e995u), 1u);
+    return key;
+}
+
+// Gives the cached light leaving the surface at a point, or nothing if its cell isn't cached yet.
+vec3 radianceCacheLookup(vec3 position, vec3 normal, vec3 cameraOrigin, float scale) {
+
+    uint checksum;
+    uint key = radianceCacheKey(position, normal, cameraOrigin, scale, checksum);
+    uint mask = uint(radianceCacheCells.length()) - 1;
+
+    // Evicted cells leave gaps, so the whole probe range is searched.
+    for (uint i = 0; i < RADIANCE_CACHE_PROBES; i++) {
+        uint slot = (key + i) & mask;
+        if (radianceCacheCells[slot].checksum == checksum) {
+            return radianceCacheCells[slot].radiance_frames.rgb;
+        }
+    }
+    return vec3(0.0f);
+}
+
+// Adds a sample of the light leaving the surface at a point, claiming a cell for it if needed. The
+// sample is dropped if every slot in its probe range belongs to other cells.
+void radianceCacheAddSample(vec3 position, vec3 normal, vec3 cameraOrigin, float scale, vec3 radiance) {
+
+    uint checksum;
+    uint key = radianceCacheKey(position, normal, cameraOrigin, scale, checksum);
+    uint mask = uint(radianceCacheCells.length()) - 1;
+
+    uint cellSlot = 0xffffffffu;
+    for (uint i = 0; i < RADIANCE_CACHE_PROBES && cellSlot == 0xffffffffu; i++) {
+        uint slot = (key + i) & mask;
+        if (radianceCacheCells[slot].checksum == checksum) cellSlot = slot;
+    }
+    for (uint i = 0; i < RADIANCE_CACHE_PROBES && cellSlot == 0xffffffffu; i++) {
+        uint slot = (key + i) & mask;
+        uint previous = atomicCompSwap(radianceCacheCells[slot].checksum, 0, checksum);
+        if (previous == 0 || previous == checksum) cellSlot = slot;
+    }
+    if (cellSlot == 0xffffffffu) return;
+
+    // The count keeps going past the limit, so radianceCacheResolve.comp clamps it to the number of
+    // samples actually summed.
+    if (atomicAdd(radianceCacheCells[cellSlot].sampleCount, 1) >= RADIANCE_CACHE_MAX_SAMPLES) return;
+
+    uvec3 fixedRadiance = uvec3(clamp(radiance, 0.0f, RADIANCE_CACHE_MAX_SAMPLE) * RADIANCE_CACHE_FIXED_POINT);
+    atomicAdd(radianceCacheCells[cellSlot].sampleSum.x, fixedRadiance.x);
+    atomicAdd(radianceCacheCells[cellSlot].sampleSum.y, fixedRadiance.y);
+    atomicAdd(radianceCacheCells[cellSlot].sampleSum.z, fixedRadiance.z);
+}
@@ -0,0 +1,20 @@
+// occluded() for passes which trace with inline ray queries rather than a ray tracing pipeline.
+
+bool occluded(vec3 position, vec3 direction, float maxDistance) {
+
+    rayQueryEXT rayQuery;
+    rayQueryInitializeEXT(
+        rayQuery,
+        as,
+        gl_RayFlagsOpaqueEXT | gl_RayFlagsTerminateOnFirstHitEXT,
+        0xff,
+        position,
+        0.0001f,
+        direction,
+        maxDistance);
+
+    // Everything is opaque, so there are no candidates to confirm and this only loops once.
+    while (rayQueryProceedEXT(rayQuery)) {}
+
+    return rayQueryGetIntersectionTypeEXT(rayQuery, true) != gl_RayQueryCommittedIntersectionNoneEXT;
+}
@@ -0,0 +1,30 @@
+// Helpers for reusing last frame's per-pixel history at wherever each pixel's surface was then.
+
+// Bilinear taps around the pixel's position last frame, given its motion in fractions of the image
+// size. Taps outside the image get no weight. Without motion, the only tap is the pixel itself.
+void historyTaps(ivec2 imageCoords, vec2 motion, ivec2 size, out ivec2 taps[4], out float weights[4]) {
+    vec2 prevCoords = vec2(imageCoords) - motion * vec2(size);
+    ivec2 base = ivec2(floor(prevCoords));
+    vec2 f = prevCoords - vec2(base);
+    taps = ivec2[](base, base + ivec2(1, 0), base + ivec2(0, 1), base + ivec2(1, 1));
+    weights = float[]((1.0f - f.x) * (1.0f - f.y), f.x * (1.0f - f.y), (1.0f - f.x) * f.y, f.x * f.y);
+    for (int i = 0; i < 4; i++) {
+        if (any(lessThan(taps[i], ivec2(0))) || any(greaterThanEqual(taps[i], size))) weights[i] = 0.0f;
+    }
+}
+
+// Whether history from a pixel last frame belongs to the same surface as this pixel, i.e. it wasn't
+// just disoccluded: the normals must agree, and last frame's position must lie on this pixel's
+// tangent plane, within a tolerance relative to the distance from the camera.
+bool isHistoryConsistent(
+    vec3 normal,
+    vec3 position,
+    vec3 historyNormal,
+    vec3 historyPosition,
+    vec3 cameraOrigin)
+{
+    if (dot(normal, historyNormal) < 0.9f) return false;
+    float planeDistance = abs(dot(normal, historyPosition - position));
+    float cameraDistance = max(length(position - cameraOrigin), 1e-4f);
+    return planeDistance < 0.01f * cameraDistance;
+}
@@ -0,0 +1,78 @@
+// Reservoir-based spatiotemporal importance resampling (ReSTIR, Bitterli et al. 2020) for local
+// lights. Each pixel keeps a reservoir holding one light sample, picked from many candidates in
+// proportion to how much unshadowed light it brings to the pixel's surface, along with the weight W
+// which turns that one sample into an estimate of all the local lighting. Reservoirs are merged
+// across neighboring pixels and frames, so each pixel effectively picks from far more candidates
+// than it drew itself, and only the winner needs a shadow ray. Includers must include lights.glsl
+// first.
+
+struct Reservoir {
+    uint light;
+    vec2 u;
+    float targetPdf;
+    float weightSum;
+    float M;
+    float W;
+};
+
+Reservoir emptyReservoir() {
+    return Reservoir(0u, vec2(0.0f), 0.0f, 0.0f, 0.0f, 0.0f);
+}
+
+// Reservoirs are stored in rgba32ui images, keeping only what merging them again needs: the sample,
+// W and the candidate count M.
+uvec4 packReservoir(Reservoir r) {
+    return uvec4(r.light, packUnorm2x16(r.u), floatBitsToUint(r.W), floatBitsToUint(r.M));
+}
+
+Reservoir unpackReservoir(uvec4 packed) {
+    Reservoir r = emptyReservoir();
+    r.light = packed.x;
+    r.u = unpackUnorm2x16(packed.y);
+    r.W = uintBitsToFloat(packed.z);
+    r.M = uintBitsToFloat(packed.w);
+    return r;
+}
+
+// How much a sample is wanted at a surface: the luminance of the unshadowed light it brings.
+float restirTargetPdf(vec3 integrand) {
+    return dot(integrand, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// Streams one weighted sample standing for M candidates into the reservoir.
+void reservoirUpdate(
+    inout Reservoir r,
+    uint light,
+    vec2 u,
+    float targetPdf,
+    float weight,
+    float M,
+    float rand)
+{
+    r.weightSum += weight;
+    r.M += M;
+    if (weight > 0.0f && rand * r.weightSum < weight) {
+        r.light = light;
+        r.u = u;
+        r.targetPdf = targetPdf;
+    }
+}
+
+// Merges another pixel's or frame's reservoir in, reweighting its sample for this surface. Its
+// light index is only trusted if it's still in range.
+void reservoirMerge(inout Reservoir r, Reservoir other, vec3 position, vec3 normal, float rand) {
+
+    int numLocalLights = lightData.numLights_numLocalLights_localLightSamples_padding.y;
+    if (other.M == 0.0f || other.light >= uint(numLocalLights)) return;
+
+    vec3 lightDir;
+    float dist;
+    float area;
+    float targetPdf = restirTargetPdf(
+        localLightIntegrand(localLights[other.light], position, normal, other.u, lightDir, dist, area));
+    reservoirUpdate(r, other.light, other.u, targetPdf, targetPdf * other.W * other.M, other.M, rand);
+}
+
+void reservoirFinalize(inout Reservoir r) {
+    r.W = (r.targetPdf > 0.0f) ? r.weightSum / (r.M * r.targetPdf) : 0.0f;
+}
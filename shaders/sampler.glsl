@@ -0,0 +1,125 @@
+// Per-pixel sample generation. Each pixel draws samples in order of their sample index, and each
+// sample takes as many 2D dimension pairs as it needs from sample2D().
+//
+// With SAMPLER_LOW_DISCREPANCY, the first dimension pair is a shuffled, Owen-scrambled 2D Sobol
+// sequence (Burley 2020), scrambled per pixel so pixels stay decorrelated. Later pairs are padded
+// with a rank-1 lattice (the R2 sequence), offset per pixel by an R2 dither mask, which spreads the
+// error out spatially like blue noise without needing a noise texture. SAMPLER_RANDOM is plain
+// PCG random numbers, for comparison.
+
+const uint SAMPLER_RANDOM = 0;
+const uint SAMPLER_LOW_DISCREPANCY = 1;
+
+uint samplerType;
+uvec2 samplerPixel;
+uint samplerPixelSeed;
+uint samplerIndex;
+uint samplerDimension;
+
+uint pcgState;
+
+uint hashu(uint x) {
+    x ^= x >> 16u;
+    x *= 0x7feb352du;
+    x ^= x >> 15u;
+    x *= 0x846ca68bu;
+    x ^= x >> 16u;
+    return x;
+}
+
+uint hashCombine(uint seed, uint value) {
+    return seed ^ (hashu(value) + 0x9e3779b9u + (seed << 6u) + (seed >> 2u));
+}
+
+void pcgStep() {
+    pcgState = pcgState * 747796405u + 2891336453u;
+}
+
+uint randu() {
+    uint oldState = pcgState;
+    pcgStep();
+    uint word = ((oldState >> ((oldState >> 28u) + 4u)) ^ oldState) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+float toUnitFloat(uint x) {
+    // Only keep as many bits as a float can hold so this never rounds up to 1.
+    return float(x >> 8u) * (1.0f / 16777216.0f);
+}
+
+float randf() {
+    return toUnitFloat(randu());
+}
+
+uint sobol0(uint index) {
+    return bitfieldReverse(index);
+}
+
+uint sobol1(uint index) {
+    uint x = 0u;
+    uint v = 0x80000000u;
+    for (; index != 0u; index >>= 1u) {
+        if ((index & 1u) != 0u) x ^= v;
+        v ^= v >> 1u;
+    }
+    return x;
+}
+
+uint laineKarrasPermutation(uint x, uint seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+uint nestedUniformScramble(uint x, uint seed) {
+    return bitfieldReverse(laineKarrasPermutation(bitfieldReverse(x), seed));
+}
+
+void samplerInit(uint type, uvec2 pixel) {
+    samplerType = type;
+    samplerPixel = pixel;
+    samplerPixelSeed = hashCombine(hashu(pixel.x), pixel.y);
+}
+
+// Starts drawing dimensions for the given sample.
+void samplerStart(uint sampleIndex) {
+    samplerIndex = sampleIndex;
+    samplerDimension = 0;
+    pcgState = hashCombine(samplerPixelSeed, sampleIndex);
+    pcgStep();
+}
+
+// Like samplerStart(), but skipping to a later dimension, for passes which split a sample's
+// dimensions between several shaders.
+void samplerStartAt(uint sampleIndex, uint dimension) {
+    samplerStart(sampleIndex);
+    samplerDimension = dimension;
+    pcgState = hashCombine(pcgState, dimension);
+    pcgStep();
+}
+
+vec2 sample2D() {
+
+    uint dimension = samplerDimension++;
+
+    if (samplerType == SAMPLER_RANDOM) return vec2(randf(), randf());
+
+    if (dimension == 0) {
+        uint index = nestedUniformScramble(samplerIndex, samplerPixelSeed);
+        return vec2(
+            toUnitFloat(nestedUniformScramble(sobol0(index), hashCombine(samplerPixelSeed, 1u))),
+            toUnitFloat(nestedUniformScramble(sobol1(index), hashCombine(samplerPixelSeed, 2u))));
+    }
+
+    // The lattice is computed in 0.32 fixed point, where wrapping arithmetic is exactly fract(), so
+    // it doesn't lose precision at high sample indices like it would in floating point.
+    const uvec2 R2 = uvec2(0xc13fa9a9u, 0x91e10da5u);
+    uvec2 offset = uvec2(
+        samplerPixel.x * R2.x + samplerPixel.y * R2.y,
+        samplerPixel.x * R2.y + samplerPixel.y * R2.x) + dimension * R2;
+    uvec2 lattice = offset + samplerIndex * R2;
+    return vec2(toUnitFloat(lattice.x), toUnitFloat(lattice.y));
+}
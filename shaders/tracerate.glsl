@@ -0,0 +1,30 @@
+// Reduced-rate tracing, where main.rgen only traces some of the pixels into a smaller sparse
+// lighting image and upsample.comp fills in the rest.
+
+// Must match the TRACE_RATE_ constants in RenderPass.cpp.
+const uint TRACE_RATE_FULL = 0;
+const uint TRACE_RATE_CHECKERBOARD = 1;
+const uint TRACE_RATE_QUARTER = 2;
+
+// The full resolution pixel traced for a sparse lighting pixel. The pattern shifts every frame,
+// so that every pixel gets traced in turn. It's keyed on the frame rather than the accumulated
+// frame, which starts over every frame when not converging and would never move the pattern.
+ivec2 traceRatePixel(ivec2 sparseCoords, uint rate, uint frame) {
+    if (rate == TRACE_RATE_CHECKERBOARD) {
+        return ivec2(2 * sparseCoords.x + int((uint(sparseCoords.y) + frame) & 1u), sparseCoords.y);
+    } else if (rate == TRACE_RATE_QUARTER) {
+        const ivec2 offsets[4] = ivec2[](ivec2(0, 0), ivec2(1, 1), ivec2(1, 0), ivec2(0, 1));
+        return 2 * sparseCoords + offsets[frame & 3u];
+    }
+    return sparseCoords;
+}
+
+// The sparse lighting pixel whose traced pixel is closest to a full resolution pixel.
+ivec2 traceRateSparseCoords(ivec2 imageCoords, uint rate) {
+    if (rate == TRACE_RATE_CHECKERBOARD) {
+        return ivec2(imageCoords.x / 2, imageCoords.y);
+    } else if (rate == TRACE_RATE_QUARTER) {
+        return imageCoords / 2;
+    }
+    return imageCoords;
+}
@@ -0,0 +1,14 @@
+#version 460
+
+// Visibility buffer mode's raster pass, which leaves just the draw and triangle covering each pixel.
+// main.rgen rebuilds the rest of the G-buffer from them.
+
+layout(push_constant) uniform PushConstants {
+    layout(offset = 192) uint drawIndex;
+} pushConstants;
+
+layout(location = 0) out uvec2 outTriangleId;
+
+void main() {
+    outTriangleId = uvec2(pushConstants.drawIndex, uint(gl_PrimitiveID));
+}
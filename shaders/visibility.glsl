@@ -0,0 +1,106 @@
+// Rebuilds a pixel's G-buffer surface in visibility buffer mode, where the raster pass only leaves
+// which draw and triangle cover it. Includers must enable GL_EXT_buffer_reference and
+// GL_EXT_buffer_reference_uvec2.
+
+// Must match VISIBILITY_BACKGROUND in RenderPass.cpp.
+const uint VISIBILITY_BACKGROUND = 0xffffffffu;
+
+layout(buffer_reference, std430, buffer_reference_align = 4) readonly buffer DrawVectors {
+    float components[];
+};
+layout(buffer_reference, std430, buffer_reference_align = 4) readonly buffer DrawIndices {
+    int indices[];
+};
+
+// Must match HVRTRenderPass::DrawGeometry. One per mesh, in the order the raster pass drew them, and
+// the transforms hold the first three rows of each matrix.
+struct DrawGeometry {
+    uvec2 vertices;
+    uvec2 normals;
+    uvec2 indices;
+    uint padding0;
+    uint padding1;
+    vec4 modelToWorld[3];
+    vec4 normalToWorld[3];
+    vec4 color;
+};
+layout(set = 0, binding = 30, std430) readonly buffer DrawGeometries {
+    DrawGeometry drawGeometries[];
+};
+
+layout(set = 0, binding = 31, rg32ui) uniform readonly uimage2D triangleIdImage;
+
+vec3 loadDrawVector(uvec2 address, int index) {
+    DrawVectors vectors = DrawVectors(address);
+    return vec3(
+        vectors.components[3 * index],
+        vectors.components[3 * index + 1],
+        vectors.components[3 * index + 2]);
+}
+
+vec3 loadWorldPosition(DrawGeometry geometry, int index) {
+    vec4 v = vec4(loadDrawVector(geometry.vertices, index), 1.0f);
+    return vec3(
+        dot(geometry.modelToWorld[0], v),
+        dot(geometry.modelToWorld[1], v),
+        dot(geometry.modelToWorld[2], v));
+}
+
+vec3 loadWorldNormal(DrawGeometry geometry, int index) {
+    vec3 n = loadDrawVector(geometry.normals, index);
+    return normalize(vec3(
+        dot(geometry.normalToWorld[0].xyz, n),
+        dot(geometry.normalToWorld[1].xyz, n),
+        dot(geometry.normalToWorld[2].xyz, n)));
+}
+
+// Finds where the ray through the pixel's center crosses its triangle, which is where the raster
+// pass sampled it, and interpolates the vertex normals there like main.vert and main.frag do. Like
+// the G-buffer, the background has a zero normal.
+void loadVisibilitySurface(
+    ivec2 imageCoords,
+    vec3 rayOrigin,
+    vec3 rayDirection,
+    out vec3 albedo,
+    out vec3 position,
+    out vec3 normal)
+{
+    uvec2 triangleId = imageLoad(triangleIdImage, imageCoords).xy;
+    if (triangleId.x == VISIBILITY_BACKGROUND) {
+        albedo = vec3(0.1f);
+        position = vec3(0.0f);
+        normal = vec3(0.0f);
+        return;
+    }
+
+    DrawGeometry geometry = drawGeometries[triangleId.x];
+    DrawIndices indices = DrawIndices(geometry.indices);
+    int triangle = int(triangleId.y);
+    ivec3 i = ivec3(
+        indices.indices[3 * triangle],
+        indices.indices[3 * triangle + 1],
+        indices.indices[3 * triangle + 2]);
+
+    vec3 v0 = loadWorldPosition(geometry, i.x);
+    vec3 v1 = loadWorldPosition(geometry, i.y);
+    vec3 v2 = loadWorldPosition(geometry, i.z);
+
+    // Moller-Trumbore without the bounds tests, since the pixel center is known to be on the
+    // triangle up to rounding. Triangles seen edge on fall back to their centroid.
+    vec3 e1 = v1 - v0;
+    vec3 e2 = v2 - v0;
+    vec3 p = cross(rayDirection, e2);
+    float det = dot(e1, p);
+    vec2 uv = vec2(1.0f / 3.0f);
+    if (det != 0.0f) {
+        vec3 t = rayOrigin - v0;
+        uv = vec2(dot(t, p), dot(rayDirection, cross(t, e1))) / det;
+    }
+
+    albedo = geometry.color.rgb;
+    position = v0 + uv.x * e1 + uv.y * e2;
+    normal = normalize(
+        (1.0f - uv.x - uv.y) * loadWorldNormal(geometry, i.x)
+        + uv.x * loadWorldNormal(geometry, i.y)
+        + uv.y * loadWorldNormal(geometry, i.z));
+}
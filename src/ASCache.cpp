@@ -0,0 +1,415 @@
+#include <Common.h>
+
+#include <Blackboard.h>
+#include <EnvironmentMap.h>
+#include <VulkanAccelerationStructure.h>
+
+#include <ASCache.h>
+
+
+const char AS_CACHE_MAGIC[8] = { 'H', 'V', 'R', 'T', 'A', 'S', '0', '1' };
+const char* AS_CACHE_EXTENSION = ".hvrtas";
+
+// Serialized ASes are copied back through host-visible staging buffers, so limit how much of that
+// is allocated at once.
+const uint64_t AS_CACHE_MAX_STAGING_SIZE = 256 * 1024 * 1024;
+
+// Every serialized AS starts with the driver and compatibility UUIDs, then three 64-bit sizes.
+const uint64_t SERIALIZED_HEADER_SIZE = 2 * VK_UUID_SIZE + 3 * sizeof(uint64_t);
+
+
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+
+ASCache::ASCache(const VulkanBasicInfo& vkbi) : _vkbi(vkbi) {
+
+    vk::PhysicalDeviceProperties2 properties;
+    vk::PhysicalDeviceIDProperties idProperties;
+    properties.pNext = &idProperties;
+    _vkbi.physicalDevice.getProperties2(&properties);
+    std::memcpy(_deviceUUID, idProperties.deviceUUID.data(), VK_UUID_SIZE);
+    std::memcpy(_driverUUID, idProperties.driverUUID.data(), VK_UUID_SIZE);
+    _deviceKey = hash(_driverUUID, VK_UUID_SIZE, hash(_deviceUUID, VK_UUID_SIZE));
+
+    _commandPool = _vkbi.device.createCommandPoolUnique(vk::CommandPoolCreateInfo(
+        vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+        _vkbi.computeQueueFamilyIndex));
+    _commandBuffer = std::move(_vkbi.device.allocateCommandBuffersUnique(vk::CommandBufferAllocateInfo(
+        _commandPool.get(),
+        vk::CommandBufferLevel::ePrimary,
+        1))[0]);
+    _fence = createFence(_vkbi);
+
+    // The cache is entirely optional, so just leave it disabled if it isn't configured.
+
+    const char* cachePath = getenv("HVRT_AS_CACHE_PATH");
+    if (cachePath == nullptr) return;
+
+    std::error_code error;
+    _directory = std::filesystem::path(cachePath);
+    std::filesystem::create_directories(_directory, error);
+    if (!std::filesystem::is_directory(_directory, error)) {
+        std::cerr << "Failed to create AS cache directory '" << _directory.string() << "'.\n";
+        return;
+    }
+    _hasDirectory = true;
+
+    for (const std::filesystem::directory_entry& file : std::filesystem::directory_iterator(_directory, error)) {
+
+        // Leftovers from an interrupted write.
+        if (file.path().extension() == ".tmp") {
+            std::filesystem::remove(file.path(), error);
+            continue;
+        }
+
+        std::string extension = file.path().extension().string();
+        if (extension != AS_CACHE_EXTENSION && extension != ENVIRONMENT_CACHE_EXTENSION) continue;
+
+        uint64_t key = std::strtoull(file.path().stem().c_str(), nullptr, 16);
+        uint64_t size = std::filesystem::file_size(file.path(), error);
+        if (error) continue;
+
+        _entries[key] = {
+            .size = size,
+            .lastUsed = std::filesystem::last_write_time(file.path(), error),
+            .extension = extension,
+        };
+        _totalSize += size;
+    }
+}
+
+ASCache::~ASCache() {
+    for (PendingStore& pendingStore : _pendingStores) {
+        pendingStore.as->_pendingStoreCache = nullptr;
+    }
+}
+
+bool ASCache::isEnabled() {
+    return _hasDirectory && getInt("asCache", 1) != 0;
+}
+
+uint64_t ASCache::hash(const void* data, size_t size, uint64_t seed) {
+
+    // Cache keys hash entire meshes, which can be gigabytes, so this works a word at a time.
+
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    uint64_t h = seed ^ (size * 0x9e3779b97f4a7c15ull);
+
+    size_t numWords = size / sizeof(uint64_t);
+    for (size_t i = 0; i < numWords; i++) {
+        uint64_t word;
+        std::memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(uint64_t));
+        h ^= rotl(word * 0x87c37b91114253d5ull, 31) * 0x4cf5ad432745937full;
+        h = rotl(h, 27) * 5 + 0x52dce729;
+    }
+
+    uint64_t tail = 0;
+    std::memcpy(&tail, bytes + numWords * sizeof(uint64_t), size % sizeof(uint64_t));
+    h ^= rotl(tail * 0x87c37b91114253d5ull, 31) * 0x4cf5ad432745937full;
+
+    return fmix(h);
+}
+
+std::filesystem::path ASCache::_getPath(uint64_t fileKey, const std::string& extension) {
+    char fileName[17];
+    std::snprintf(fileName, sizeof(fileName), "%016llx", (unsigned long long) fileKey);
+    return _directory / (std::string(fileName) + extension);
+}
+
+std::filesystem::path ASCache::getFilePath(uint64_t key, const char* extension) {
+    if (!isEnabled()) return std::filesystem::path();
+    return _getPath(key, extension);
+}
+
+void ASCache::touchFile(uint64_t key, const char* extension) {
+
+    if (!isEnabled()) return;
+
+    auto it = _entries.find(key);
+    if (it != _entries.end()) _totalSize -= it->second.size;
+
+    std::error_code error;
+    std::filesystem::path path = _getPath(key, extension);
+    uint64_t size = std::filesystem::file_size(path, error);
+    if (error) {
+        if (it != _entries.end()) _entries.erase(it);
+        return;
+    }
+
+    Entry& entry = _entries[key];
+    entry = {
+        .size = size,
+        .lastUsed = std::filesystem::file_time_type::clock::now(),
+        .extension = extension,
+    };
+    std::filesystem::last_write_time(path, entry.lastUsed, error);
+    _totalSize += size;
+
+    _evict();
+}
+
+std::unique_ptr<VulkanBuffer> ASCache::load(uint64_t key) {
+
+    if (!isEnabled()) return nullptr;
+
+    uint64_t fileKey = hash(&key, sizeof(key), _deviceKey);
+    auto it = _entries.find(fileKey);
+    if (it == _entries.end() || it->second.extension != AS_CACHE_EXTENSION) return nullptr;
+
+    std::filesystem::path path = _getPath(fileKey, AS_CACHE_EXTENSION);
+    std::ifstream file(path, std::ios::binary);
+    FileHeader header;
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!file
+        || std::memcmp(header.magic, AS_CACHE_MAGIC, sizeof(AS_CACHE_MAGIC)) != 0
+        || std::memcmp(header.deviceUUID, _deviceUUID, VK_UUID_SIZE) != 0
+        || std::memcmp(header.driverUUID, _driverUUID, VK_UUID_SIZE) != 0
+        || header.dataSize < SERIALIZED_HEADER_SIZE
+        || header.dataSize != it->second.size - sizeof(header))
+    {
+        _removeEntry(fileKey);
+        return nullptr;
+    }
+
+    std::unique_ptr<VulkanBuffer> buffer = std::make_unique<VulkanBuffer>(_vkbi);
+    buffer->allocate(
+        header.dataSize,
+        true,
+        vk::BufferUsageFlagBits::eRayTracingKHR
+        | vk::BufferUsageFlagBits::eShaderDeviceAddress);
+    file.read(reinterpret_cast<char*>(buffer->data()), header.dataSize);
+    if (!file) {
+        _removeEntry(fileKey);
+        return nullptr;
+    }
+    file.close();
+
+    // Our own header only says which device and driver wrote the entry. Ask the driver whether it
+    // can actually deserialize it too.
+    try {
+        _vkbi.device.getAccelerationStructureCompatibilityKHR(
+            { .versionData = reinterpret_cast<const uint8_t*>(buffer->data()) },
+            _vkbi.dispatchLoader);
+    } catch (vk::SystemError& e) {
+        _removeEntry(fileKey);
+        return nullptr;
+    }
+
+    std::error_code error;
+    it->second.lastUsed = std::filesystem::file_time_type::clock::now();
+    std::filesystem::last_write_time(path, it->second.lastUsed, error);
+
+    return buffer;
+}
+
+void ASCache::queueStore(VulkanAccelerationStructure& as, uint64_t key) {
+
+    if (!isEnabled()) return;
+
+    cancelStore(as);
+    _pendingStores.push_back({ &as, key });
+    as._pendingStoreCache = this;
+}
+
+void ASCache::cancelStore(VulkanAccelerationStructure& as) {
+
+    if (as._pendingStoreCache != this) return;
+
+    _pendingStores.erase(
+        std::remove_if(
+            _pendingStores.begin(),
+            _pendingStores.end(),
+            [&as](const PendingStore& pendingStore) { return pendingStore.as == &as; }),
+        _pendingStores.end());
+    as._pendingStoreCache = nullptr;
+}
+
+void ASCache::retireBuffer(std::unique_ptr<VulkanBuffer> buffer) {
+    _retiredBuffers.push_back(std::move(buffer));
+}
+
+void ASCache::_submitAndWait() {
+
+    vk::SubmitInfo submitInfo(
+        0, nullptr, nullptr,
+        1, &_commandBuffer.get(),
+        0, nullptr);
+    _vkbi.computeQueues[0].submit(1, &submitInfo, _fence.get());
+
+    _vkbi.device.waitForFences(1, &_fence.get(), true, std::numeric_limits<uint64_t>::max());
+    _vkbi.device.resetFences(1, &_fence.get());
+}
+
+void ASCache::update() {
+
+    // Everything recorded last frame has finished by now.
+    _retiredBuffers.clear();
+
+    if (_pendingStores.empty()) return;
+
+    std::vector<PendingStore> pendingStores;
+    std::swap(pendingStores, _pendingStores);
+
+    std::vector<vk::AccelerationStructureKHR> accelerationStructures;
+    for (PendingStore& pendingStore : pendingStores) {
+        pendingStore.as->_pendingStoreCache = nullptr;
+        accelerationStructures.push_back(pendingStore.as->getAccelerationStructure());
+    }
+    uint32_t numStores = pendingStores.size();
+
+    // Stores are rare (only after a BLAS is first built) so just block on the GPU here, which means
+    // nothing can touch the ASes while they're being serialized.
+
+    if (_queryPoolSize < numStores) {
+        _queryPoolSize = numStores;
+        _queryPool = _vkbi.device.createQueryPoolUnique({
+            .queryType = vk::QueryType::eAccelerationStructureSerializationSizeKHR,
+            .queryCount = _queryPoolSize,
+        });
+    }
+
+    _commandBuffer->begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr });
+    _commandBuffer->resetQueryPool(_queryPool.get(), 0, numStores);
+    _commandBuffer->writeAccelerationStructuresPropertiesKHR(
+        numStores,
+        accelerationStructures.data(),
+        vk::QueryType::eAccelerationStructureSerializationSizeKHR,
+        _queryPool.get(),
+        0,
+        _vkbi.dispatchLoader);
+    _commandBuffer->end();
+    _submitAndWait();
+
+    std::vector<uint64_t> serializedSizes(numStores);
+    _vkbi.device.getQueryPoolResults(
+        _queryPool.get(),
+        0,
+        numStores,
+        numStores * sizeof(uint64_t),
+        serializedSizes.data(),
+        sizeof(uint64_t),
+        vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait);
+
+    size_t storeI = 0;
+    while (storeI < numStores) {
+
+        std::vector<std::unique_ptr<VulkanBuffer>> stagingBuffers;
+        uint64_t stagingSize = 0;
+        size_t firstStoreI = storeI;
+
+        _commandBuffer->begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr });
+        for (; storeI < numStores; storeI++) {
+            if (storeI > firstStoreI
+                && stagingSize + serializedSizes[storeI] > AS_CACHE_MAX_STAGING_SIZE)
+            {
+                break;
+            }
+
+            stagingBuffers.push_back(std::make_unique<VulkanBuffer>(_vkbi));
+            stagingBuffers.back()->allocate(
+                serializedSizes[storeI],
+                true,
+                vk::BufferUsageFlagBits::eRayTracingKHR
+                | vk::BufferUsageFlagBits::eShaderDeviceAddress);
+            stagingSize += serializedSizes[storeI];
+
+            _commandBuffer->copyAccelerationStructureToMemoryKHR(
+                {
+                    .src = accelerationStructures[storeI],
+                    .dst = vk::DeviceOrHostAddressKHR(stagingBuffers.back()->getDeviceAddress()),
+                    .mode = vk::CopyAccelerationStructureModeKHR::eSerialize,
+                },
+                _vkbi.dispatchLoader);
+        }
+        _commandBuffer->end();
+        _submitAndWait();
+
+        for (size_t i = 0; i < stagingBuffers.size(); i++) {
+            _writeEntry(
+                pendingStores[firstStoreI + i].key,
+                stagingBuffers[i]->data(),
+                serializedSizes[firstStoreI + i]);
+        }
+    }
+
+    _evict();
+}
+
+void ASCache::_removeEntry(uint64_t fileKey) {
+
+    auto it = _entries.find(fileKey);
+    if (it == _entries.end()) return;
+
+    std::error_code error;
+    std::filesystem::remove(_getPath(fileKey, it->second.extension), error);
+    _totalSize -= it->second.size;
+    _entries.erase(it);
+}
+
+void ASCache::_writeEntry(uint64_t key, const void* data, uint64_t size) {
+
+    uint64_t fileKey = hash(&key, sizeof(key), _deviceKey);
+    _removeEntry(fileKey);
+
+    FileHeader header;
+    std::memcpy(header.magic, AS_CACHE_MAGIC, sizeof(AS_CACHE_MAGIC));
+    std::memcpy(header.deviceUUID, _deviceUUID, VK_UUID_SIZE);
+    std::memcpy(header.driverUUID, _driverUUID, VK_UUID_SIZE);
+    header.dataSize = size;
+
+    // Write to a temporary file first so a half-written entry can never be loaded.
+    std::filesystem::path path = _getPath(fileKey, AS_CACHE_EXTENSION);
+    std::filesystem::path tempPath = path;
+    tempPath += ".tmp";
+
+    std::error_code error;
+    std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(data), size);
+    file.close();
+    if (!file) {
+        std::filesystem::remove(tempPath, error);
+        return;
+    }
+
+    std::filesystem::rename(tempPath, path, error);
+    if (error) {
+        std::filesystem::remove(tempPath, error);
+        return;
+    }
+
+    _entries[fileKey] = {
+        .size = sizeof(header) + size,
+        .lastUsed = std::filesystem::file_time_type::clock::now(),
+        .extension = AS_CACHE_EXTENSION,
+    };
+    _totalSize += sizeof(header) + size;
+}
+
+void ASCache::_evict() {
+
+    uint64_t maxSize = uint64_t(std::max(getInt("asCacheSizeMB", 8192), 0)) * 1024 * 1024;
+    if (_totalSize <= maxSize) return;
+
+    std::vector<std::pair<std::filesystem::file_time_type, uint64_t>> entriesByAge;
+    for (auto& [fileKey, entry] : _entries) {
+        entriesByAge.emplace_back(entry.lastUsed, fileKey);
+    }
+    std::sort(entriesByAge.begin(), entriesByAge.end());
+
+    for (auto& [lastUsed, fileKey] : entriesByAge) {
+        if (_totalSize <= maxSize) break;
+        _removeEntry(fileKey);
+    }
+}
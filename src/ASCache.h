@@ -0,0 +1,101 @@
+#pragma once
+
+#include <Common.h>
+
+#include <VulkanUtils.h>
+#include <VulkanBuffer.h>
+
+
+class VulkanAccelerationStructure;
+
+
+// On-disk cache of serialized BLASes, so static geometry doesn't have to be rebuilt from scratch
+// every session. Entries are keyed by a hash of the geometry, and are only valid for the device and
+// driver which wrote them; anything incompatible is treated as a miss and the BLAS is rebuilt. The
+// cache lives in the directory given by the HVRT_AS_CACHE_PATH environment variable, and is kept
+// under a size limit by evicting the least recently used entries. Other caches can keep their own
+// files there too, which count towards the same limit.
+class ASCache {
+
+public:
+
+    ASCache(const VulkanBasicInfo& vkbi);
+
+    ~ASCache();
+
+    bool isEnabled();
+
+    static uint64_t hash(const void* data, size_t size, uint64_t seed = 0);
+
+    // Returns a host-visible buffer holding the serialized AS, or null on a miss.
+    std::unique_ptr<VulkanBuffer> load(uint64_t key);
+
+    void queueStore(VulkanAccelerationStructure& as, uint64_t key);
+
+    void cancelStore(VulkanAccelerationStructure& as);
+
+    // Returns where another cache's file for key belongs, or an empty path if the cache is disabled.
+    std::filesystem::path getFilePath(uint64_t key, const char* extension);
+
+    // Records that a file from getFilePath() was just read or written, so it's evicted along with
+    // the serialized ASes.
+    void touchFile(uint64_t key, const char* extension);
+
+    // Keeps a buffer alive until the commands recorded this frame which use it have finished.
+    void retireBuffer(std::unique_ptr<VulkanBuffer> buffer);
+
+    // Serializes queued ASes into the cache. Must be called once per frame, at a point where every
+    // AS build submitted so far has finished.
+    void update();
+
+private:
+
+    struct Entry {
+        uint64_t size;
+        std::filesystem::file_time_type lastUsed;
+        std::string extension;
+    };
+
+    struct FileHeader {
+        char magic[8];
+        uint8_t deviceUUID[VK_UUID_SIZE];
+        uint8_t driverUUID[VK_UUID_SIZE];
+        uint64_t dataSize;
+    };
+
+    struct PendingStore {
+        VulkanAccelerationStructure* as;
+        uint64_t key;
+    };
+
+    std::filesystem::path _getPath(uint64_t fileKey, const std::string& extension);
+
+    void _removeEntry(uint64_t key);
+
+    void _writeEntry(uint64_t key, const void* data, uint64_t size);
+
+    void _evict();
+
+    void _submitAndWait();
+
+    const VulkanBasicInfo& _vkbi;
+
+    bool _hasDirectory = false;
+    std::filesystem::path _directory;
+    uint8_t _deviceUUID[VK_UUID_SIZE];
+    uint8_t _driverUUID[VK_UUID_SIZE];
+    uint64_t _deviceKey;
+
+    std::unordered_map<uint64_t, Entry> _entries;
+    uint64_t _totalSize = 0;
+
+    std::vector<PendingStore> _pendingStores;
+    std::vector<std::unique_ptr<VulkanBuffer>> _retiredBuffers;
+
+    vk::UniqueCommandPool _commandPool;
+    vk::UniqueCommandBuffer _commandBuffer;
+    vk::UniqueFence _fence;
+    vk::UniqueQueryPool _queryPool;
+    uint32_t _queryPoolSize = 0;
+
+};
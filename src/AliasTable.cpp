@@ -0,0 +1,43 @@
+#include <Common.h>
+
+#include <AliasTable.h>
+
+
+std::vector<AliasTableEntry> buildAliasTable(const std::vector<double>& weights) {
+
+    double totalWeight = 0.0;
+    for (double weight : weights) {
+        totalWeight += weight;
+    }
+
+    size_t numItems = weights.size();
+    std::vector<AliasTableEntry> table(numItems);
+    std::vector<size_t> small, large;
+    std::vector<double> scaledWeights(numItems);
+    for (size_t i = 0; i < numItems; i++) {
+        table[i].selectionPdf = float(weights[i] / totalWeight);
+        scaledWeights[i] = weights[i] / totalWeight * numItems;
+        (scaledWeights[i] < 1.0 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        size_t s = small.back();
+        small.pop_back();
+        size_t l = large.back();
+        table[s].aliasProbability = float(scaledWeights[s]);
+        table[s].aliasIndex = l;
+        scaledWeights[l] += scaledWeights[s] - 1.0;
+        if (scaledWeights[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Whatever is left over only differs from 1 by rounding error.
+    for (std::vector<size_t>* remaining : { &small, &large }) {
+        for (size_t i : *remaining) {
+            table[i].aliasProbability = 1.0f;
+            table[i].aliasIndex = i;
+        }
+    }
+
+    return table;
+}
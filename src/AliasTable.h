@@ -0,0 +1,16 @@
+#pragma once
+
+#include <Common.h>
+
+
+// One entry of an alias table. The entry keeps its own item with aliasProbability, and otherwise
+// gives the pick to aliasIndex. selectionPdf is the chance of picking the item at all.
+struct AliasTableEntry {
+    float aliasProbability;
+    uint32_t aliasIndex;
+    float selectionPdf;
+};
+
+// Builds an alias table (Vose's method) so shaders can pick items in proportion to their weights in
+// constant time. The weights don't need to be normalized, but their total must be positive.
+std::vector<AliasTableEntry> buildAliasTable(const std::vector<double>& weights);
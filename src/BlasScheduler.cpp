@@ -0,0 +1,77 @@
+#include <Common.h>
+
+#include <BlasScheduler.h>
+
+
+// Builds in a batch run concurrently and each needs its own scratch range. The KHR ray tracing
+// extension doesn't expose a scratch alignment requirement, so use a conservative one.
+const uint64_t SCRATCH_ALIGNMENT = 256;
+
+
+void BlasScheduler::clear() {
+    _jobs.clear();
+    for (std::vector<Job>& queueJobs : _queueJobs) {
+        queueJobs.clear();
+    }
+    std::fill(_queueCosts.begin(), _queueCosts.end(), 0);
+    _scratchMemorySize = 0;
+}
+
+void BlasScheduler::addJob(const BlasInstance& blasInstance, uint64_t cost, uint64_t scratchMemorySize) {
+    _jobs.push_back({
+        .blasInstance = blasInstance,
+        .cost = cost,
+        .scratchMemorySize = scratchMemorySize,
+        .scratchOffset = 0,
+        .wave = 0,
+    });
+}
+
+void BlasScheduler::schedule(size_t numQueues, uint64_t scratchBudget) {
+
+    _queueJobs.resize(numQueues);
+    _queueCosts.assign(numQueues, 0);
+    _scratchMemorySize = 0;
+
+    std::sort(_jobs.begin(), _jobs.end(), [](const Job& a, const Job& b) {
+        return a.cost > b.cost;
+    });
+
+    for (Job& job : _jobs) {
+
+        // There are only ever a handful of queues, so a linear search beats a heap here.
+        size_t queueI = std::min_element(_queueCosts.begin(), _queueCosts.end()) - _queueCosts.begin();
+
+        // Count every job as at least some work so empty meshes still get spread out.
+        _queueCosts[queueI] += std::max(job.cost, uint64_t(1));
+        _queueJobs[queueI].push_back(job);
+    }
+
+    // Lay out each queue's waves after the previous queue's largest wave.
+
+    uint64_t queueScratchBudget = scratchBudget / numQueues;
+    for (std::vector<Job>& queueJobs : _queueJobs) {
+
+        uint32_t wave = 0;
+        uint64_t waveScratchMemorySize = 0;
+        uint64_t maxWaveScratchMemorySize = 0;
+        for (Job& job : queueJobs) {
+
+            uint64_t jobScratchMemorySize =
+                (job.scratchMemorySize + SCRATCH_ALIGNMENT - 1) / SCRATCH_ALIGNMENT * SCRATCH_ALIGNMENT;
+            if (waveScratchMemorySize > 0
+                && waveScratchMemorySize + jobScratchMemorySize > queueScratchBudget)
+            {
+                wave++;
+                waveScratchMemorySize = 0;
+            }
+
+            job.wave = wave;
+            job.scratchOffset = _scratchMemorySize + waveScratchMemorySize;
+            waveScratchMemorySize += jobScratchMemorySize;
+            maxWaveScratchMemorySize = std::max(maxWaveScratchMemorySize, waveScratchMemorySize);
+        }
+
+        _scratchMemorySize += maxWaveScratchMemorySize;
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <Common.h>
+
+#include <StaticBatcher.h>
+
+
+// Distributes BLAS builds over the available compute queues. Build cost is estimated from the
+// triangle count, and jobs are assigned longest-processing-time-first to whichever queue currently
+// has the least work, so one huge mesh doesn't leave the other queues idle behind it. Every build
+// gets its own range of one shared scratch pool, so builds never have to wait on each other unless
+// the pool would exceed its budget.
+class BlasScheduler {
+
+public:
+
+    struct Job {
+        BlasInstance blasInstance;
+        uint64_t cost;
+        uint64_t scratchMemorySize;
+        uint64_t scratchOffset;
+        uint32_t wave;
+    };
+
+    void clear();
+
+    void addJob(const BlasInstance& blasInstance, uint64_t cost, uint64_t scratchMemorySize);
+
+    bool empty() {
+        return _jobs.empty();
+    }
+
+    // Assigns all added jobs to queues and lays out the scratch pool. Each queue gets an equal share
+    // of the scratch budget, and a queue's jobs are split into waves which each fit in its share.
+    // All builds in a wave can run concurrently, but the next wave re-uses the same scratch memory
+    // so must wait for the previous one to finish. A single job which doesn't fit in a queue's
+    // share gets a wave to itself anyway, which is the only way the budget can be exceeded.
+    void schedule(size_t numQueues, uint64_t scratchBudget);
+
+    // A queue's jobs, ordered by wave.
+    const std::vector<Job>& getQueueJobs(size_t queueI) {
+        return _queueJobs[queueI];
+    }
+
+    uint64_t getScratchMemorySize() {
+        return _scratchMemorySize;
+    }
+
+private:
+
+    std::vector<Job> _jobs;
+    std::vector<std::vector<Job>> _queueJobs;
+    std::vector<uint64_t> _queueCosts;
+    uint64_t _scratchMemorySize = 0;
+
+};
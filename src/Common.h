@@ -6,11 +6,14 @@
 #include <algorithm>
 #include <memory>
 #include <vector>
+#include <deque>
+#include <list>
 #include <cstring>
 #include <cstdlib>
 #include <cstdint>
 #include <cmath>
 #include <optional>
+#include <tuple>
 #include <set>
 #include <map>
 #include <unordered_set>
@@ -18,6 +21,7 @@
 #include <chrono>
 #include <thread>
 #include <limits>
+#include <atomic>
 
 #include <experimental/filesystem>
 namespace std::filesystem {
@@ -31,14 +35,19 @@ namespace std::filesystem {
 #include <vulkan/vulkan_beta.h>
 #include <vulkan/vulkan.hpp>
 
+#include <tbb/task_group.h>
+
 #include <pxr/base/gf/matrix3f.h>
 #include <pxr/base/gf/matrix4f.h>
+#include <pxr/base/gf/range3f.h>
+#include <pxr/usd/sdf/assetPath.h>
 #include <pxr/imaging/hd/mesh.h>
 #include <pxr/imaging/hd/vertexAdjacency.h>
 #include <pxr/imaging/hd/meshUtil.h>
 #include <pxr/imaging/hd/smoothNormals.h>
 #include <pxr/imaging/hd/material.h>
 #include <pxr/imaging/hd/camera.h>
+#include <pxr/imaging/hd/light.h>
 #include <pxr/imaging/hd/extComputation.h>
 #include <pxr/imaging/hd/resourceRegistry.h>
 #include <pxr/imaging/hd/renderDelegate.h>
@@ -0,0 +1,314 @@
+#include <Common.h>
+
+#include <Blackboard.h>
+
+#include <Denoiser.h>
+
+
+// Must match the DENOISE_ flags in denoise.glsl.
+const uint32_t DENOISE_WRITE_HISTORY = 1;
+const uint32_t DENOISE_WRITE_OUTPUT = 2;
+const uint32_t DENOISE_REPROJECT = 4;
+
+// Must match local_size in denoise.glsl.
+const uint32_t DENOISE_TILE_SIZE = 8;
+
+const uint32_t NUM_BINDINGS = 12;
+
+// Timestamps before the first pass and after each of the three stages.
+const uint32_t NUM_TIMESTAMPS = 4;
+
+
+Denoiser::Denoiser(const VulkanBasicInfo& vkbi)
+    : _vkbi(vkbi),
+      _mustTransitionImages(false),
+      _timestampsWritten(false),
+      _historyIlluminationImg(_vkbi),
+      _momentsImg(_vkbi),
+      _historyMomentsImg(_vkbi),
+      _illuminationImgs{ VulkanImage(_vkbi), VulkanImage(_vkbi) }
+{
+    // Two descriptor sets which only differ in which illumination image is read and which is
+    // written, so the filter iterations can ping-pong between them.
+
+    vk::DescriptorPoolSize descriptorPoolSize = {
+        .type = vk::DescriptorType::eStorageImage,
+        .descriptorCount = 2 * NUM_BINDINGS,
+    };
+    _descriptorPool = _vkbi.device.createDescriptorPoolUnique({
+        vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet,
+        2,
+        1,
+        &descriptorPoolSize,
+    });
+
+    std::vector<vk::DescriptorSetLayoutBinding> bindings;
+    for (uint32_t i = 0; i < NUM_BINDINGS; i++) {
+        bindings.push_back({ i, vk::DescriptorType::eStorageImage, 1, vk::ShaderStageFlagBits::eCompute });
+    }
+    _descriptorSetLayout = _vkbi.device.createDescriptorSetLayoutUnique(vk::DescriptorSetLayoutCreateInfo({}, bindings));
+
+    vk::DescriptorSetLayout descriptorSetLayouts[] = { _descriptorSetLayout.get(), _descriptorSetLayout.get() };
+    _descriptorSets = _vkbi.device.allocateDescriptorSetsUnique({
+        _descriptorPool.get(),
+        2,
+        descriptorSetLayouts,
+    });
+
+    vk::PushConstantRange pushConstantRange = {
+        vk::ShaderStageFlagBits::eCompute,
+        0,
+        sizeof(PushConstants),
+    };
+    _pipelineLayout = _vkbi.device.createPipelineLayoutUnique({
+        {},
+        1,
+        &_descriptorSetLayout.get(),
+        1,
+        &pushConstantRange,
+    });
+
+    _temporalShaderModule = loadShaderModule(_vkbi, "denoiseTemporal.comp");
+    _varianceShaderModule = loadShaderModule(_vkbi, "denoiseVariance.comp");
+    _filterShaderModule = loadShaderModule(_vkbi, "denoiseFilter.comp");
+
+    auto createPipeline = [&](vk::ShaderModule shaderModule) {
+        return _vkbi.device.createComputePipelineUnique(
+            {},
+            vk::ComputePipelineCreateInfo(
+                {},
+                { {}, vk::ShaderStageFlagBits::eCompute, shaderModule, "main" },
+                _pipelineLayout.get()));
+    };
+    _temporalPipeline = createPipeline(_temporalShaderModule.get());
+    _variancePipeline = createPipeline(_varianceShaderModule.get());
+    _filterPipeline = createPipeline(_filterShaderModule.get());
+
+    _timestampQueryPool = _vkbi.device.createQueryPoolUnique({
+        .queryType = vk::QueryType::eTimestamp,
+        .queryCount = NUM_TIMESTAMPS,
+    });
+    _timestampPeriod = _vkbi.physicalDevice.getProperties().limits.timestampPeriod;
+}
+
+void Denoiser::setImages(
+    vk::Extent2D extent,
+    VulkanImage& colorImg,
+    VulkanImage& albedoImg,
+    VulkanImage& worldPositionImg,
+    VulkanImage& worldNormalImg,
+    VulkanImage& motionImg,
+    VulkanImage& historyWorldPositionImg,
+    VulkanImage& historyWorldNormalImg)
+{
+    _extent = extent;
+
+    for (VulkanImage* image : {
+        &_historyIlluminationImg,
+        &_momentsImg,
+        &_historyMomentsImg,
+        &_illuminationImgs[0],
+        &_illuminationImgs[1]})
+    {
+        image->allocate(
+            vk::Format::eR32G32B32A32Sfloat,
+            _extent,
+            vk::ImageUsageFlagBits::eStorage,
+            vk::ImageAspectFlagBits::eColor);
+    }
+    _mustTransitionImages = true;
+
+    for (uint32_t setI = 0; setI < 2; setI++) {
+
+        vk::ImageView imageViews[NUM_BINDINGS] = {
+            colorImg.getImageView(),
+            albedoImg.getImageView(),
+            worldPositionImg.getImageView(),
+            worldNormalImg.getImageView(),
+            _historyIlluminationImg.getImageView(),
+            _momentsImg.getImageView(),
+            _illuminationImgs[setI].getImageView(),
+            _illuminationImgs[1 - setI].getImageView(),
+            motionImg.getImageView(),
+            _historyMomentsImg.getImageView(),
+            historyWorldPositionImg.getImageView(),
+            historyWorldNormalImg.getImageView(),
+        };
+
+        vk::DescriptorImageInfo imageInfos[NUM_BINDINGS];
+        vk::WriteDescriptorSet writeDescriptorSets[NUM_BINDINGS];
+        for (uint32_t i = 0; i < NUM_BINDINGS; i++) {
+            imageInfos[i] = { {}, imageViews[i], vk::ImageLayout::eGeneral };
+            writeDescriptorSets[i] = {
+                _descriptorSets[setI].get(),
+                i,
+                0,
+                1,
+                vk::DescriptorType::eStorageImage,
+                &imageInfos[i],
+                nullptr,
+                nullptr,
+            };
+        }
+        _vkbi.device.updateDescriptorSets(NUM_BINDINGS, writeDescriptorSets, 0, nullptr);
+    }
+}
+
+void Denoiser::freeImages() {
+    _historyIlluminationImg.free();
+    _momentsImg.free();
+    _historyMomentsImg.free();
+    _illuminationImgs[0].free();
+    _illuminationImgs[1].free();
+}
+
+void Denoiser::denoise(
+    vk::UniqueCommandBuffer& commandBuffer,
+    pxr::GfVec3f cameraOrigin,
+    bool resetHistory,
+    bool converge,
+    bool reproject)
+{
+    if (_mustTransitionImages) {
+
+        // Transition the denoiser's own images from eUndefined to eGeneral so we can store to them.
+        std::vector<vk::ImageMemoryBarrier> barriers;
+        for (VulkanImage* image : {
+            &_historyIlluminationImg,
+            &_momentsImg,
+            &_historyMomentsImg,
+            &_illuminationImgs[0],
+            &_illuminationImgs[1]})
+        {
+            barriers.push_back({
+                .srcAccessMask = vk::AccessFlags(),
+                .dstAccessMask = vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+                .oldLayout = vk::ImageLayout::eUndefined,
+                .newLayout = vk::ImageLayout::eGeneral,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image = image->getImage(),
+                .subresourceRange = { vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 },
+            });
+        }
+        commandBuffer->pipelineBarrier(
+            vk::PipelineStageFlagBits::eTopOfPipe,
+            vk::PipelineStageFlagBits::eComputeShader,
+            vk::DependencyFlags(),
+            0, nullptr,
+            0, nullptr,
+            barriers.size(), barriers.data());
+
+        // There's nothing in the history yet.
+        resetHistory = true;
+        _mustTransitionImages = false;
+    }
+
+    // Wait for the noisy frame.
+    vk::MemoryBarrier inputBarrier = {
+        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+        .dstAccessMask = vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+    };
+    commandBuffer->pipelineBarrier(
+        vk::PipelineStageFlagBits::eRayTracingShaderKHR | vk::PipelineStageFlagBits::eComputeShader,
+        vk::PipelineStageFlagBits::eComputeShader,
+        vk::DependencyFlags(),
+        1, &inputBarrier,
+        0, nullptr,
+        0, nullptr);
+
+    commandBuffer->resetQueryPool(_timestampQueryPool.get(), 0, NUM_TIMESTAMPS);
+    commandBuffer->writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, _timestampQueryPool.get(), 0);
+
+    float alpha = converge ? 0.0f : getFloat("denoiseAlpha", 0.2f);
+    PushConstants pushConstants = {
+        cameraOrigin,
+        resetHistory ? 1u : 0u,
+        alpha,
+        alpha,
+        1,
+        reproject ? DENOISE_REPROJECT : 0,
+    };
+
+    // Temporal accumulation writes to the first illumination image, which is the one the second
+    // descriptor set writes to.
+    _dispatch(commandBuffer, _temporalPipeline.get(), _descriptorSets[1].get(), pushConstants);
+    commandBuffer->writeTimestamp(vk::PipelineStageFlagBits::eComputeShader, _timestampQueryPool.get(), 1);
+
+    pushConstants.flags = converge ? DENOISE_WRITE_HISTORY : 0;
+    _dispatch(commandBuffer, _variancePipeline.get(), _descriptorSets[0].get(), pushConstants);
+    commandBuffer->writeTimestamp(vk::PipelineStageFlagBits::eComputeShader, _timestampQueryPool.get(), 2);
+
+    int32_t numIterations = std::clamp(getInt("denoiseIterations", 5), 1, 10);
+    for (int32_t i = 0; i < numIterations; i++) {
+        pushConstants.stepSize = 1 << i;
+        pushConstants.flags = 0;
+        if (i == 0 && !converge) pushConstants.flags |= DENOISE_WRITE_HISTORY;
+        if (i == numIterations - 1) pushConstants.flags |= DENOISE_WRITE_OUTPUT;
+        _dispatch(commandBuffer, _filterPipeline.get(), _descriptorSets[(i + 1) % 2].get(), pushConstants);
+    }
+    commandBuffer->writeTimestamp(vk::PipelineStageFlagBits::eComputeShader, _timestampQueryPool.get(), 3);
+
+    _timestampsWritten = true;
+}
+
+void Denoiser::_dispatch(
+    vk::UniqueCommandBuffer& commandBuffer,
+    vk::Pipeline pipeline,
+    vk::DescriptorSet descriptorSet,
+    const PushConstants& pushConstants)
+{
+    commandBuffer->bindPipeline(vk::PipelineBindPoint::eCompute, pipeline);
+    commandBuffer->bindDescriptorSets(
+        vk::PipelineBindPoint::eCompute,
+        _pipelineLayout.get(),
+        0,
+        { descriptorSet },
+        {});
+    commandBuffer->pushConstants(
+        _pipelineLayout.get(),
+        vk::ShaderStageFlagBits::eCompute,
+        0,
+        sizeof(PushConstants),
+        &pushConstants);
+    commandBuffer->dispatch(
+        (_extent.width + DENOISE_TILE_SIZE - 1) / DENOISE_TILE_SIZE,
+        (_extent.height + DENOISE_TILE_SIZE - 1) / DENOISE_TILE_SIZE,
+        1);
+
+    // Each pass reads what the last one wrote, including neighboring pixels.
+    vk::MemoryBarrier barrier = {
+        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+        .dstAccessMask = vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+    };
+    commandBuffer->pipelineBarrier(
+        vk::PipelineStageFlagBits::eComputeShader,
+        vk::PipelineStageFlagBits::eComputeShader,
+        vk::DependencyFlags(),
+        1, &barrier,
+        0, nullptr,
+        0, nullptr);
+}
+
+void Denoiser::updateStats() {
+
+    if (!_timestampsWritten) return;
+
+    uint64_t timestamps[NUM_TIMESTAMPS];
+    _vkbi.device.getQueryPoolResults(
+        _timestampQueryPool.get(),
+        0,
+        NUM_TIMESTAMPS,
+        sizeof(timestamps),
+        timestamps,
+        sizeof(uint64_t),
+        vk::QueryResultFlagBits::e64);
+
+    auto toMs = [&](uint32_t i) {
+        return float(double(timestamps[i + 1] - timestamps[i]) * _timestampPeriod * 1e-6);
+    };
+    setFloat("stats_denoiseTemporalMs", toMs(0));
+    setFloat("stats_denoiseVarianceMs", toMs(1));
+    setFloat("stats_denoiseFilterMs", toMs(2));
+    _timestampsWritten = false;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <Common.h>
+
+#include <VulkanUtils.h>
+#include <VulkanImage.h>
+
+
+// SVGF-style denoiser for the RT pass's output, made of compute passes guided by the G-buffer:
+// temporal accumulation of illumination and its luminance moments, reprojected along the raster
+// pass's motion vectors and rejected at disocclusions, a spatial variance estimate for pixels with
+// little history, and several iterations of an edge-aware à-trous wavelet filter. It replaces the
+// noisy frame in the color image with the denoised one.
+class Denoiser {
+
+public:
+
+    Denoiser(const VulkanBasicInfo& vkbi);
+
+    // The images must stay alive until the next call to setImages() or freeImages(). The history
+    // images hold last frame's world positions and normals.
+    void setImages(
+        vk::Extent2D extent,
+        VulkanImage& colorImg,
+        VulkanImage& albedoImg,
+        VulkanImage& worldPositionImg,
+        VulkanImage& worldNormalImg,
+        VulkanImage& motionImg,
+        VulkanImage& historyWorldPositionImg,
+        VulkanImage& historyWorldNormalImg);
+
+    void freeImages();
+
+    // Records the passes. The color image must hold this frame's noisy color, written by the
+    // ray tracing or compute shader stages. When converging, every frame is averaged in evenly and
+    // the history isn't filtered, so the result still converges to the unfiltered image. Without
+    // reprojection the history is only reused at the same pixel, and the history images are unused.
+    void denoise(
+        vk::UniqueCommandBuffer& commandBuffer,
+        pxr::GfVec3f cameraOrigin,
+        bool resetHistory,
+        bool converge,
+        bool reproject);
+
+    // Reads back the last denoise() call's per-pass timings into the blackboard. Its commands must
+    // have finished.
+    void updateStats();
+
+private:
+
+    struct PushConstants {
+        pxr::GfVec3f cameraOrigin;
+        uint32_t resetHistory;
+        float colorAlpha;
+        float momentsAlpha;
+        int32_t stepSize;
+        uint32_t flags;
+    };
+
+    void _dispatch(
+        vk::UniqueCommandBuffer& commandBuffer,
+        vk::Pipeline pipeline,
+        vk::DescriptorSet descriptorSet,
+        const PushConstants& pushConstants);
+
+    const VulkanBasicInfo& _vkbi;
+
+    vk::Extent2D _extent;
+    bool _mustTransitionImages;
+    bool _timestampsWritten;
+
+    VulkanImage _historyIlluminationImg;
+    VulkanImage _momentsImg;
+    VulkanImage _historyMomentsImg;
+    VulkanImage _illuminationImgs[2];
+
+    vk::UniqueDescriptorPool _descriptorPool;
+    vk::UniqueDescriptorSetLayout _descriptorSetLayout;
+    std::vector<vk::UniqueDescriptorSet> _descriptorSets;
+    vk::UniquePipelineLayout _pipelineLayout;
+    vk::UniqueShaderModule _temporalShaderModule;
+    vk::UniqueShaderModule _varianceShaderModule;
+    vk::UniqueShaderModule _filterShaderModule;
+    vk::UniquePipeline _temporalPipeline;
+    vk::UniquePipeline _variancePipeline;
+    vk::UniquePipeline _filterPipeline;
+    vk::UniqueQueryPool _timestampQueryPool;
+    float _timestampPeriod;
+
+};
@@ -0,0 +1,237 @@
+#include <Common.h>
+
+#include <AliasTable.h>
+#include <ASCache.h>
+
+#include <EnvironmentMap.h>
+
+
+const char ENVIRONMENT_CACHE_MAGIC[8] = { 'H', 'V', 'R', 'T', 'E', 'N', '0', '1' };
+const char* ENVIRONMENT_CACHE_EXTENSION = ".hvrtenv";
+
+
+struct EnvironmentCacheHeader {
+    char magic[8];
+    uint32_t width;
+    uint32_t height;
+};
+
+static float luminance(pxr::GfVec3f color) {
+    return 0.2126f * color[0] + 0.7152f * color[1] + 0.0722f * color[2];
+}
+
+
+EnvironmentMap::EnvironmentMap(ASCache& asCache, const std::string& path, uint32_t maxWidth) {
+
+    std::error_code error;
+    uint64_t fileSize = std::filesystem::file_size(path, error);
+    if (error) throw std::runtime_error("Could not open environment map '" + path + "'.");
+    int64_t modifiedTime = std::filesystem::last_write_time(path, error).time_since_epoch().count();
+
+    // The cache is entirely optional, like the AS cache it shares a directory and size limit with.
+    uint64_t key = ASCache::hash(&fileSize, sizeof(fileSize));
+    key = ASCache::hash(&modifiedTime, sizeof(modifiedTime), key);
+    key = ASCache::hash(&maxWidth, sizeof(maxWidth), key);
+    key = ASCache::hash(path.data(), path.size(), key);
+    std::filesystem::path cachePath = asCache.getFilePath(key, ENVIRONMENT_CACHE_EXTENSION);
+    if (!cachePath.empty() && _loadCache(cachePath)) {
+        asCache.touchFile(key, ENVIRONMENT_CACHE_EXTENSION);
+        return;
+    }
+
+    std::vector<pxr::GfVec3f> radiance;
+    _readHdr(path, &radiance);
+    _downsample(maxWidth, &radiance);
+    _buildAliasTable(radiance);
+
+    if (!cachePath.empty()) {
+        _storeCache(cachePath);
+        asCache.touchFile(key, ENVIRONMENT_CACHE_EXTENSION);
+    }
+}
+
+void EnvironmentMap::_readHdr(const std::string& path, std::vector<pxr::GfVec3f>* radiance) {
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file) throw std::runtime_error("Could not open environment map '" + path + "'.");
+
+    // The header is text lines up to a blank one, followed by the resolution line. Only the usual
+    // top-to-bottom, left-to-right orientation is supported.
+    std::string line;
+    std::getline(file, line);
+    if (line.rfind("#?", 0) != 0) {
+        throw std::runtime_error("Environment map '" + path + "' is not a Radiance .hdr file.");
+    }
+    while (std::getline(file, line) && !line.empty()) {
+        if (line.rfind("FORMAT=", 0) == 0 && line != "FORMAT=32-bit_rle_rgbe") {
+            throw std::runtime_error("Environment map '" + path + "' is not in RGBE format.");
+        }
+    }
+    std::getline(file, line);
+    int width = 0;
+    int height = 0;
+    if (std::sscanf(line.c_str(), "-Y %d +X %d", &height, &width) != 2 || width <= 0 || height <= 0) {
+        throw std::runtime_error("Environment map '" + path + "' has an unsupported orientation.");
+    }
+    _width = width;
+    _height = height;
+
+    // Each scanline is either run-length encoded one channel at a time, or just raw RGBE pixels.
+    radiance->resize(size_t(_width) * _height);
+    std::vector<uint8_t> scanline(4 * _width);
+    for (uint32_t y = 0; y < _height; y++) {
+
+        uint8_t start[4];
+        file.read(reinterpret_cast<char*>(start), 4);
+        bool rle =
+            start[0] == 2 && start[1] == 2
+            && ((uint32_t(start[2]) << 8) | start[3]) == _width
+            && _width >= 8 && _width < 0x8000;
+
+        if (rle) {
+            for (uint32_t channel = 0; channel < 4; channel++) {
+                uint32_t x = 0;
+                while (x < _width && file) {
+                    uint32_t count = uint8_t(file.get());
+                    if (count == 0) {
+                        file.setstate(std::ios::failbit);
+                    } else if (count > 128) {
+                        uint8_t value = file.get();
+                        for (uint32_t i = 0; i < count - 128 && x < _width; i++) {
+                            scanline[4 * x++ + channel] = value;
+                        }
+                    } else {
+                        for (uint32_t i = 0; i < count && x < _width; i++) {
+                            scanline[4 * x++ + channel] = file.get();
+                        }
+                    }
+                }
+            }
+        } else {
+            std::memcpy(scanline.data(), start, 4);
+            file.read(reinterpret_cast<char*>(scanline.data() + 4), 4 * (_width - 1));
+        }
+        if (!file) throw std::runtime_error("Environment map '" + path + "' is truncated.");
+
+        for (uint32_t x = 0; x < _width; x++) {
+            const uint8_t* rgbe = &scanline[4 * x];
+            float scale = (rgbe[3] == 0) ? 0.0f : std::ldexp(1.0f, int(rgbe[3]) - (128 + 8));
+            (*radiance)[size_t(y) * _width + x] = pxr::GfVec3f(rgbe[0], rgbe[1], rgbe[2]) * scale;
+        }
+    }
+}
+
+void EnvironmentMap::_downsample(uint32_t maxWidth, std::vector<pxr::GfVec3f>* radiance) {
+
+    uint32_t factor = (_width + maxWidth - 1) / maxWidth;
+    if (factor <= 1) return;
+
+    uint32_t width = std::max(_width / factor, 1u);
+    uint32_t height = std::max(_height / factor, 1u);
+    std::vector<pxr::GfVec3f> filtered(size_t(width) * height, pxr::GfVec3f(0.0f));
+    for (uint32_t y = 0; y < height * factor && y < _height; y++) {
+        for (uint32_t x = 0; x < width * factor && x < _width; x++) {
+            filtered[size_t(y / factor) * width + x / factor] += (*radiance)[size_t(y) * _width + x];
+        }
+    }
+    for (pxr::GfVec3f& texel : filtered) {
+        texel /= float(factor * factor);
+    }
+
+    _width = width;
+    _height = height;
+    *radiance = std::move(filtered);
+}
+
+void EnvironmentMap::_buildAliasTable(const std::vector<pxr::GfVec3f>& radiance) {
+
+    // Texels near the poles cover less of the sphere, so they're weighted by the solid angle they
+    // subtend as well as their brightness. An entirely black map falls back to picking by solid
+    // angle alone.
+    size_t numTexels = radiance.size();
+    std::vector<double> weights(numTexels);
+    double totalWeight = 0.0;
+    for (bool solidAngleOnly : { false, true }) {
+        totalWeight = 0.0;
+        for (uint32_t y = 0; y < _height; y++) {
+            double sinTheta = std::sin(PI * (y + 0.5) / _height);
+            for (uint32_t x = 0; x < _width; x++) {
+                size_t i = size_t(y) * _width + x;
+                weights[i] = sinTheta * (solidAngleOnly ? 1.0 : luminance(radiance[i]));
+                totalWeight += weights[i];
+            }
+        }
+        if (totalWeight > 0.0) break;
+    }
+
+    std::vector<AliasTableEntry> table = buildAliasTable(weights);
+    _texels.resize(numTexels);
+    for (size_t i = 0; i < numTexels; i++) {
+        _texels[i].radiance = radiance[i];
+        _texels[i].aliasProbability = table[i].aliasProbability;
+        _texels[i].aliasIndex = table[i].aliasIndex;
+        _texels[i].selectionPdf = table[i].selectionPdf;
+        _texels[i].padding[0] = 0.0f;
+        _texels[i].padding[1] = 0.0f;
+    }
+}
+
+bool EnvironmentMap::_loadCache(const std::filesystem::path& cachePath) {
+
+    std::ifstream file(cachePath, std::ios::binary);
+    if (!file) return false;
+
+    EnvironmentCacheHeader header;
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!file
+        || std::memcmp(header.magic, ENVIRONMENT_CACHE_MAGIC, sizeof(ENVIRONMENT_CACHE_MAGIC)) != 0)
+    {
+        return false;
+    }
+
+    // Check the size before allocating anything, so a corrupt header can't ask for gigabytes.
+    std::error_code error;
+    uint64_t fileSize = std::filesystem::file_size(cachePath, error);
+    uint64_t numTexels = uint64_t(header.width) * header.height;
+    if (error
+        || numTexels == 0
+        || numTexels > (fileSize - sizeof(header)) / sizeof(Texel)
+        || numTexels * sizeof(Texel) + sizeof(header) != fileSize)
+    {
+        return false;
+    }
+
+    _texels.resize(numTexels);
+    file.read(reinterpret_cast<char*>(_texels.data()), _texels.size() * sizeof(Texel));
+    if (!file || _texels.empty()) {
+        _texels.clear();
+        return false;
+    }
+
+    _width = header.width;
+    _height = header.height;
+    return true;
+}
+
+void EnvironmentMap::_storeCache(const std::filesystem::path& cachePath) {
+
+    // Write to a temporary file first so an interrupted write never leaves a partial entry. The AS
+    // cache cleans up leftover temporary files along with its own.
+    std::error_code error;
+    std::filesystem::create_directories(cachePath.parent_path(), error);
+    std::filesystem::path tempPath = cachePath;
+    tempPath += ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::binary);
+        EnvironmentCacheHeader header = { {}, _width, _height };
+        std::memcpy(header.magic, ENVIRONMENT_CACHE_MAGIC, sizeof(ENVIRONMENT_CACHE_MAGIC));
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(_texels.data()), _texels.size() * sizeof(Texel));
+        if (!file) {
+            file.close();
+            std::filesystem::remove(tempPath, error);
+            return;
+        }
+    }
+    std::filesystem::rename(tempPath, cachePath, error);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <Common.h>
+
+
+class ASCache;
+
+
+extern const char* ENVIRONMENT_CACHE_EXTENSION;
+
+
+// A dome light's equirectangular environment, with an alias table over its texels so shaders can
+// pick directions in proportion to how much light arrives from them. Reading a big HDRI and building
+// its table takes a while, so the results are kept in the AS cache's directory along with serialized
+// ASes, keyed by the file's path, size and modification time.
+class EnvironmentMap {
+
+public:
+
+    // Must match EnvironmentTexel in lights.glsl. Each entry of the alias table keeps its own
+    // texel with aliasProbability, and otherwise gives the pick to aliasIndex. selectionPdf is the
+    // chance of picking the texel at all.
+    struct Texel {
+        pxr::GfVec3f radiance;
+        float aliasProbability;
+        uint32_t aliasIndex;
+        float selectionPdf;
+        float padding[2];
+    };
+
+    // Loads a Radiance .hdr file, box filtered down to at most maxWidth texels wide. Throws
+    // std::runtime_error if the file can't be read.
+    EnvironmentMap(ASCache& asCache, const std::string& path, uint32_t maxWidth);
+
+    uint32_t getWidth() const {
+        return _width;
+    }
+
+    uint32_t getHeight() const {
+        return _height;
+    }
+
+    const std::vector<Texel>& getTexels() const {
+        return _texels;
+    }
+
+private:
+
+    void _readHdr(const std::string& path, std::vector<pxr::GfVec3f>* radiance);
+
+    void _downsample(uint32_t maxWidth, std::vector<pxr::GfVec3f>* radiance);
+
+    void _buildAliasTable(const std::vector<pxr::GfVec3f>& radiance);
+
+    bool _loadCache(const std::filesystem::path& cachePath);
+
+    void _storeCache(const std::filesystem::path& cachePath);
+
+    uint32_t _width = 0;
+    uint32_t _height = 0;
+    std::vector<Texel> _texels;
+
+};
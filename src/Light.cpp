@@ -0,0 +1,154 @@
+#include <Common.h>
+
+#include <Light.h>
+
+
+std::atomic<uint64_t> HVRTLight::_globalVersion = 0;
+
+
+template <typename T>
+static T getLightParam(
+    pxr::HdSceneDelegate* sceneDelegate,
+    pxr::SdfPath const& id,
+    pxr::TfToken const& name,
+    T defaultValue)
+{
+    pxr::VtValue value = sceneDelegate->GetLightParamValue(id, name);
+    return value.IsHolding<T>() ? value.Get<T>() : defaultValue;
+}
+
+static float luminance(pxr::GfVec3f color) {
+    return 0.2126f * color[0] + 0.7152f * color[1] + 0.0722f * color[2];
+}
+
+
+HVRTLight::HVRTLight(pxr::SdfPath const& id, pxr::TfToken const& typeId)
+    : pxr::HdLight(id),
+      _typeId(typeId),
+      _data(),
+      _power(0.0f),
+      _direction(0.0f, 0.0f, 1.0f),
+      _irradiance(0.0f),
+      _domeAxes{ pxr::GfVec3f::XAxis(), pxr::GfVec3f::YAxis(), pxr::GfVec3f::ZAxis() },
+      _domeRadiance(0.0f)
+{
+}
+
+HVRTLight::~HVRTLight() {
+    _globalVersion++;
+}
+
+void HVRTLight::Sync(
+    pxr::HdSceneDelegate* sceneDelegate,
+    pxr::HdRenderParam* renderParam,
+    pxr::HdDirtyBits* dirtyBits)
+{
+    (void) renderParam;
+
+    if (!(*dirtyBits & (DirtyTransform | DirtyParams | DirtyShadowParams))) {
+        *dirtyBits = Clean;
+        return;
+    }
+
+    const pxr::SdfPath& id = GetId();
+
+    pxr::GfMatrix4d lightToWorld = sceneDelegate->GetTransform(id);
+
+    pxr::GfVec3f color = getLightParam(sceneDelegate, id, pxr::HdLightTokens->color, pxr::GfVec3f(1.0f));
+    float intensity = getLightParam(sceneDelegate, id, pxr::HdLightTokens->intensity, 1.0f);
+    float exposure = getLightParam(sceneDelegate, id, pxr::HdLightTokens->exposure, 0.0f);
+    bool normalize = getLightParam(sceneDelegate, id, pxr::HdLightTokens->normalize, false);
+    bool shadowEnable = getLightParam(sceneDelegate, id, pxr::HdLightTokens->shadowEnable, true);
+    pxr::GfVec3f radiance = color * intensity * std::exp2(exposure);
+
+    // Lights emit along their -Z axis, and rect and disk lights lie in their XY plane.
+    pxr::GfVec3f xAxis(lightToWorld.TransformDir(pxr::GfVec3d(1.0, 0.0, 0.0)));
+    pxr::GfVec3f yAxis(lightToWorld.TransformDir(pxr::GfVec3d(0.0, 1.0, 0.0)));
+    pxr::GfVec3f zAxis(lightToWorld.TransformDir(pxr::GfVec3d(0.0, 0.0, 1.0)));
+
+    if (isDome()) {
+
+        _domeRadiance = radiance;
+        _domeAxes[0] = xAxis.GetNormalized();
+        _domeAxes[1] = yAxis.GetNormalized();
+        _domeAxes[2] = zAxis.GetNormalized();
+
+        pxr::SdfAssetPath textureFile = getLightParam(
+            sceneDelegate, id, pxr::HdLightTokens->textureFile, pxr::SdfAssetPath());
+        _textureFile = textureFile.GetResolvedPath().empty()
+            ? textureFile.GetAssetPath()
+            : textureFile.GetResolvedPath();
+
+    } else if (isDistant()) {
+
+        // Distant lights are treated like the control panel's directional lights, so the angle they
+        // subtend is ignored.
+        _direction = zAxis.GetNormalized();
+        _irradiance = radiance;
+        _data.raytraced = shadowEnable ? 1 : 0;
+
+    } else {
+
+        _data.position = pxr::GfVec3f(lightToWorld.Transform(pxr::GfVec3d(0.0)));
+        _data.raytraced = shadowEnable ? 1 : 0;
+        _data.axis = -zAxis.GetNormalized();
+        _data.cosConeOuter = -1.0f;
+        _data.cosConeInner = -1.0f;
+        _data.radius = 0.0f;
+
+        // Emitted power relative to the radiance, over the whole sphere or hemisphere.
+        float area = 0.0f;
+        float powerScale = 0.0f;
+
+        if (_typeId == pxr::HdPrimTypeTokens->rectLight) {
+
+            float width = getLightParam(sceneDelegate, id, pxr::HdLightTokens->width, 1.0f);
+            float height = getLightParam(sceneDelegate, id, pxr::HdLightTokens->height, 1.0f);
+            _data.type = TYPE_RECT;
+            _data.u = 0.5f * width * xAxis;
+            _data.v = 0.5f * height * yAxis;
+            area = 4.0f * _data.u.GetLength() * _data.v.GetLength();
+            powerScale = PI * area;
+
+        } else if (_typeId == pxr::HdPrimTypeTokens->diskLight) {
+
+            float radius = getLightParam(sceneDelegate, id, pxr::HdLightTokens->radius, 0.5f);
+            _data.type = TYPE_DISK;
+            _data.u = radius * xAxis;
+            _data.v = radius * yAxis;
+            area = PI * _data.u.GetLength() * _data.v.GetLength();
+            powerScale = PI * area;
+
+        } else {
+
+            // Sphere lights without a radius are point lights, whose radiance is taken as their
+            // intensity instead.
+            float radius = getLightParam(sceneDelegate, id, pxr::HdLightTokens->radius, 0.5f);
+            _data.type = TYPE_SPHERE;
+            _data.radius = radius * xAxis.GetLength();
+            area = FOUR_PI * _data.radius * _data.radius;
+            powerScale = area > 0.0f ? PI * area : FOUR_PI;
+
+            // A shaping cone makes it a spot light.
+            float coneAngle = getLightParam(sceneDelegate, id, pxr::HdLightTokens->shapingConeAngle, 180.0f);
+            float coneSoftness = getLightParam(sceneDelegate, id, pxr::HdLightTokens->shapingConeSoftness, 0.0f);
+            if (coneAngle < 180.0f) {
+                float outerAngle = std::clamp(coneAngle, 0.0f, 180.0f) * PI / 180.0f;
+                float innerAngle = outerAngle * (1.0f - std::clamp(coneSoftness, 0.0f, 1.0f));
+                _data.cosConeOuter = std::cos(outerAngle);
+                _data.cosConeInner = std::max(std::cos(innerAngle), _data.cosConeOuter + 1e-4f);
+                powerScale *= 0.5f * (1.0f - _data.cosConeOuter);
+            }
+        }
+
+        if (normalize && area > 0.0f) {
+            radiance /= area;
+            powerScale /= area;
+        }
+        _data.radiance = radiance;
+        _power = luminance(radiance) * powerScale;
+    }
+
+    _globalVersion++;
+    *dirtyBits = Clean;
+}
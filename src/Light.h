@@ -0,0 +1,118 @@
+#pragma once
+
+#include <Common.h>
+
+
+// A Hydra light sprim. Distant lights light the scene like the control panel's directional lights,
+// and sphere, rect and disk lights become local lights, which are sampled stochastically so that
+// shading cost doesn't grow with the number of lights. Sphere lights with a shaping cone are spot
+// lights, and sphere lights without a radius are point lights. Dome lights replace the ambient
+// light with their environment map, or their color without one.
+class HVRTLight : public pxr::HdLight {
+
+public:
+
+    // Must match the LIGHT_ constants in lights.glsl.
+    static const uint32_t TYPE_SPHERE = 0;
+    static const uint32_t TYPE_RECT = 1;
+    static const uint32_t TYPE_DISK = 2;
+
+    // Must match LocalLight in lights.glsl. The alias table fields are filled in by the render
+    // pass, which builds the table over every local light.
+    struct Data {
+        pxr::GfVec3f position;
+        uint32_t type;
+        pxr::GfVec3f radiance;
+        uint32_t raytraced;
+        pxr::GfVec3f axis;
+        float cosConeOuter;
+        pxr::GfVec3f u;
+        float cosConeInner;
+        pxr::GfVec3f v;
+        float radius;
+        float aliasProbability;
+        uint32_t aliasIndex;
+        float selectionPdf;
+        float padding;
+    };
+
+    HVRTLight(pxr::SdfPath const& id, pxr::TfToken const& typeId);
+
+    virtual ~HVRTLight();
+
+    virtual void Sync(
+        pxr::HdSceneDelegate* sceneDelegate,
+        pxr::HdRenderParam* renderParam,
+        pxr::HdDirtyBits* dirtyBits) override;
+
+    virtual pxr::HdDirtyBits GetInitialDirtyBitsMask() const override {
+        return AllDirty;
+    }
+
+    // Changes whenever any light is synced or destroyed.
+    static uint64_t getGlobalVersion() {
+        return _globalVersion;
+    }
+
+    bool isDistant() const {
+        return _typeId == pxr::HdPrimTypeTokens->distantLight;
+    }
+
+    bool isDome() const {
+        return _typeId == pxr::HdPrimTypeTokens->domeLight;
+    }
+
+    // For local lights.
+    const Data& getData() const {
+        return _data;
+    }
+
+    // Total emitted power as luminance, which local lights are picked in proportion to.
+    float getPower() const {
+        return _power;
+    }
+
+    // For distant lights, the direction towards the light.
+    const pxr::GfVec3f& getDirection() const {
+        return _direction;
+    }
+
+    // For distant lights.
+    const pxr::GfVec3f& getIrradiance() const {
+        return _irradiance;
+    }
+
+    bool isRaytraced() const {
+        return _data.raytraced != 0;
+    }
+
+    // For dome lights, the resolved path of the environment map, or empty for a uniform dome.
+    const std::string& getTextureFile() const {
+        return _textureFile;
+    }
+
+    // For dome lights, the environment's axes in world space. Its poles are along the Y axis.
+    const pxr::GfVec3f* getDomeAxes() const {
+        return _domeAxes;
+    }
+
+    // For dome lights, what the environment map is scaled by, or the radiance if there's no map.
+    const pxr::GfVec3f& getDomeRadiance() const {
+        return _domeRadiance;
+    }
+
+private:
+
+    static std::atomic<uint64_t> _globalVersion;
+
+    pxr::TfToken _typeId;
+
+    Data _data;
+    float _power;
+    pxr::GfVec3f _direction;
+    pxr::GfVec3f _irradiance;
+    std::string _textureFile;
+    pxr::GfVec3f _domeAxes[3];
+    pxr::GfVec3f _domeRadiance;
+
+};
@@ -5,18 +5,96 @@
 #include <Mesh.h>
 
 
+// Meshes with more triangles than this are split spatially into clusters of at most this many
+// triangles. Each cluster gets its own BLAS, so they can be built in parallel and refit
+// independently, and long thin meshes get much tighter instance bounds.
+const size_t CLUSTER_MAX_TRIANGLES = 256 * 1024;
+
+// Smaller clusters build faster than they can be loaded from the AS cache.
+const size_t AS_CACHE_MIN_TRIANGLES = 16 * 1024;
+
+// Must match local_size_x in aoBake.comp.
+const uint32_t AO_BAKE_GROUP_SIZE = 64;
+
+// Versions are unique across all meshes, so a new mesh can never be mistaken for a deleted one
+// which happened to live at the same address.
+static uint64_t nextMeshVersion = 1;
+
+
+// Recursively splits triangles at the median centroid along the longest axis of their centroid
+// bounds until each range is small enough to be a cluster.
+static void partitionTriangles(
+    const pxr::VtVec3fArray& vertices,
+    const pxr::VtVec3iArray& indices,
+    size_t maxTriangles,
+    std::vector<uint32_t>* triangleOrder,
+    std::vector<std::pair<uint32_t, uint32_t>>* clusterRanges)
+{
+    size_t numTriangles = indices.size();
+
+    std::vector<pxr::GfVec3f> centroids(numTriangles);
+    for (size_t i = 0; i < numTriangles; i++) {
+        const pxr::GfVec3i& triangle = indices[i];
+        centroids[i] = (vertices[triangle[0]] + vertices[triangle[1]] + vertices[triangle[2]]) / 3.0f;
+    }
+
+    triangleOrder->resize(numTriangles);
+    for (size_t i = 0; i < numTriangles; i++) {
+        (*triangleOrder)[i] = i;
+    }
+
+    clusterRanges->clear();
+    std::vector<std::pair<uint32_t, uint32_t>> stack = { { 0, uint32_t(numTriangles) } };
+    while (!stack.empty()) {
+
+        auto [begin, end] = stack.back();
+        stack.pop_back();
+
+        if (end - begin <= maxTriangles) {
+            clusterRanges->emplace_back(begin, end - begin);
+            continue;
+        }
+
+        pxr::GfRange3f bounds;
+        for (uint32_t i = begin; i < end; i++) {
+            bounds.UnionWith(centroids[(*triangleOrder)[i]]);
+        }
+        pxr::GfVec3f size = bounds.GetSize();
+        int axis =
+            (size[0] > size[1])
+            ? ((size[0] > size[2]) ? 0 : 2)
+            : ((size[1] > size[2]) ? 1 : 2);
+
+        uint32_t mid = begin + (end - begin) / 2;
+        std::nth_element(
+            triangleOrder->begin() + begin,
+            triangleOrder->begin() + mid,
+            triangleOrder->begin() + end,
+            [&centroids, axis](uint32_t a, uint32_t b) {
+                return centroids[a][axis] < centroids[b][axis];
+            });
+
+        stack.emplace_back(mid, end);
+        stack.emplace_back(begin, mid);
+    }
+}
+
+
 HVRTMesh::HVRTMesh(
     pxr::SdfPath const& id,
     pxr::SdfPath const& instancerId,
     const VulkanBasicInfo& vkbi,
-    const std::unordered_map<std::string, HVRTMaterial*>& materials)
+    const std::unordered_map<std::string, HVRTMaterial*>& materials,
+    ASCache& asCache)
     : HdMesh(id, instancerId),
       _vkbi(vkbi),
+      _asCache(asCache),
       _materials(materials),
       _vertexBuffer(_vkbi),
       _indexBuffer(_vkbi),
       _normalBuffer(_vkbi),
-      _as(_vkbi)
+      _bakedAOBuffer(_vkbi),
+      _clusterIndexBuffer(_vkbi)
 {
 }
 
@@ -82,7 +160,19 @@ void HVRTMesh::Sync(
     if (*dirtyBits & pxr::HdChangeTracker::DirtyPoints) {
 
         pxr::VtValue value = sceneDelegate->Get(id, pxr::HdTokens->points);
-        _vertices = value.Get<pxr::VtVec3fArray>();
+        pxr::VtVec3fArray vertices = value.Get<pxr::VtVec3fArray>();
+
+        // When a clustered mesh deforms, remember which vertices actually moved so only the
+        // clusters containing them have to be refit.
+        _movedVertices.clear();
+        if (_clusters.size() > 1 && vertices.size() == _vertices.size()) {
+            _movedVertices.resize(vertices.size());
+            for (size_t i = 0; i < vertices.size(); i++) {
+                _movedVertices[i] = (vertices[i] != _vertices[i]);
+            }
+        }
+
+        _vertices = vertices;
         _verticesChanged = true;
 
         recomputeNormals = true;
@@ -126,8 +216,16 @@ void HVRTMesh::commitResources() {
 
     // TODO: Vulkan can handle multithreaded uploads, so move these back into Sync().
 
+    bool geometryChanged = _verticesChanged || _indicesChanged || _transformChanged;
+
     if (_verticesChanged) {
         _verticesChanged = false;
+        _verticesHash.reset();
+
+        _localBounds = pxr::GfRange3f();
+        for (const pxr::GfVec3f& vertex : _vertices) {
+            _localBounds.UnionWith(vertex);
+        }
 
         size_t newVertexBufferSize = _vertices.size() * sizeof(pxr::GfVec3f);
         if (_vertexBuffer.size() != newVertexBufferSize) {
@@ -144,7 +242,16 @@ void HVRTMesh::commitResources() {
             _vertices.data(),
             _vertexBuffer.size());
 
-        _needsRefit = true;
+        size_t newBakedAOBufferSize = _vertices.size() * sizeof(float);
+        if (_bakedAOBuffer.size() != newBakedAOBufferSize) {
+            _bakedAOBuffer.allocate(
+                newBakedAOBufferSize,
+                false,
+                vk::BufferUsageFlagBits::eVertexBuffer
+                | vk::BufferUsageFlagBits::eShaderDeviceAddress);
+        }
+
+        _markMovedClusters();
     }
 
     if (_indicesChanged) {
@@ -165,7 +272,7 @@ void HVRTMesh::commitResources() {
             _indices.data(),
             _indexBuffer.size());
 
-        _needsRebuild = true;
+        _buildClusters();
     }
 
     if (_normalsChanged) {
@@ -173,7 +280,11 @@ void HVRTMesh::commitResources() {
 
         size_t newNormalBufferSize = _normals.size() * sizeof(pxr::GfVec3f);
         if (_normalBuffer.size() != newNormalBufferSize) {
-            _normalBuffer.allocate(newNormalBufferSize, true, vk::BufferUsageFlagBits::eVertexBuffer);
+            _normalBuffer.allocate(
+                newNormalBufferSize,
+                true,
+                vk::BufferUsageFlagBits::eVertexBuffer
+                | vk::BufferUsageFlagBits::eShaderDeviceAddress);
         }
 
         std::memcpy(
@@ -182,23 +293,171 @@ void HVRTMesh::commitResources() {
             _normalBuffer.size());
     }
 
-    if (_maxAsVertices < _vertices.size() || _maxAsTriangles < _indices.size()) {
+    bool reallocateClusters = false;
+    if (_maxAsVertices < _vertices.size()) {
         _maxAsVertices = _vertices.size();
-        _maxAsTriangles = _indices.size();
+        reallocateClusters = true;
+    }
+
+    for (Cluster& cluster : _clusters) {
+
+        // Deserialized BLASes are exactly the size of their contents, so they can't be rebuilt in
+        // place.
+        bool hostBuild = VulkanAccelerationStructure::preferHostBuild(_vkbi, cluster.numTriangles);
+        bool reallocate =
+            reallocateClusters
+            || cluster.maxAsTriangles < cluster.numTriangles
+            || (cluster.needsRebuild && cluster.as.isDeserialized())
+            || (cluster.needsRebuild && cluster.as.isHostBuild() != hostBuild);
+
+        cluster.cacheKey = 0;
+        if ((reallocate || cluster.needsRebuild)
+            && cluster.numTriangles >= AS_CACHE_MIN_TRIANGLES
+            && _asCache.isEnabled())
+        {
+            cluster.cacheKey = _getClusterCacheKey(cluster);
+        }
+
+        if (cluster.cacheKey != 0 && cluster.as.allocateBottomLevelFromCache(_asCache, cluster.cacheKey)) {
+            cluster.maxAsTriangles = cluster.numTriangles;
+
+            cluster.needsRebuild = false;
+            cluster.needsRefit = false;
+            cluster.needsDeserialize = true;
+            cluster.reallocated = true;
 
-        _as.allocateBottomLevel(_maxAsVertices, _maxAsTriangles);
+        } else if (reallocate) {
+            cluster.maxAsTriangles = cluster.numTriangles;
 
-        _needsRebuild = true;
+            cluster.as.allocateBottomLevel(_maxAsVertices, cluster.maxAsTriangles, hostBuild);
+
+            cluster.needsRebuild = true;
+            cluster.needsDeserialize = false;
+            cluster.reallocated = true;
+        }
+
+        if (_transformChanged) {
+            cluster.instanceChanged = true;
+        }
+    }
+    _transformChanged = false;
+
+    if (geometryChanged) {
+        _version = nextMeshVersion++;
+        _bakedAOSamples = 0;
+
+        _worldBounds = pxr::GfRange3f();
+        if (!_localBounds.IsEmpty()) {
+            for (size_t i = 0; i < 8; i++) {
+                _worldBounds.UnionWith(_modelToWorld.Transform(_localBounds.GetCorner(i)));
+            }
+        }
     }
 }
 
+void HVRTMesh::_buildClusters() {
+
+    std::vector<std::pair<uint32_t, uint32_t>> clusterRanges;
+    if (_indices.size() > CLUSTER_MAX_TRIANGLES) {
+
+        std::vector<uint32_t> triangleOrder;
+        partitionTriangles(_vertices, _indices, CLUSTER_MAX_TRIANGLES, &triangleOrder, &clusterRanges);
+
+        _clusterIndices.resize(_indices.size());
+        for (size_t i = 0; i < triangleOrder.size(); i++) {
+            _clusterIndices[i] = _indices[triangleOrder[i]];
+        }
+
+        size_t newClusterIndexBufferSize = _clusterIndices.size() * sizeof(pxr::GfVec3i);
+        if (_clusterIndexBuffer.size() != newClusterIndexBufferSize) {
+            _clusterIndexBuffer.allocate(
+                newClusterIndexBufferSize,
+                true,
+                vk::BufferUsageFlagBits::eRayTracingKHR
+                | vk::BufferUsageFlagBits::eShaderDeviceAddress);
+        }
+
+        std::memcpy(
+            _clusterIndexBuffer.data(),
+            _clusterIndices.data(),
+            _clusterIndexBuffer.size());
+
+    } else {
+
+        clusterRanges.emplace_back(0, _indices.size());
+        _clusterIndices.clear();
+    }
+
+    // Existing clusters keep their BLAS allocations where they're large enough. Any new ones get
+    // allocated by commitResources().
+    while (_clusters.size() > clusterRanges.size()) {
+        _clusters.pop_back();
+    }
+    while (_clusters.size() < clusterRanges.size()) {
+        _clusters.emplace_back(_vkbi);
+    }
+
+    for (size_t i = 0; i < _clusters.size(); i++) {
+        Cluster& cluster = _clusters[i];
+        cluster.firstTriangle = clusterRanges[i].first;
+        cluster.numTriangles = clusterRanges[i].second;
+        cluster.needsRebuild = true;
+    }
+}
+
+void HVRTMesh::_markMovedClusters() {
+
+    for (Cluster& cluster : _clusters) {
+
+        if (_movedVertices.empty()) {
+            cluster.needsRefit = true;
+            continue;
+        }
+
+        for (uint32_t i = 0; i < cluster.numTriangles; i++) {
+            const pxr::GfVec3i& triangle = _clusterIndices[cluster.firstTriangle + i];
+            if (_movedVertices[triangle[0]]
+                || _movedVertices[triangle[1]]
+                || _movedVertices[triangle[2]])
+            {
+                cluster.needsRefit = true;
+                break;
+            }
+        }
+    }
+
+    _movedVertices.clear();
+}
+
+uint64_t HVRTMesh::_getClusterCacheKey(const Cluster& cluster) {
+
+    // Hash all vertices once, then each cluster's own triangles on top of that.
+    if (!_verticesHash) {
+        _verticesHash = ASCache::hash(_vertices.cdata(), _vertices.size() * sizeof(pxr::GfVec3f));
+    }
+
+    const pxr::GfVec3i* triangles = (_clusters.size() > 1) ? _clusterIndices.data() : _indices.cdata();
+    return ASCache::hash(
+        triangles + cluster.firstTriangle,
+        cluster.numTriangles * sizeof(pxr::GfVec3i),
+        *_verticesHash);
+}
+
 void HVRTMesh::getASBuildInfo(
+    size_t clusterI,
+    bool* blasChanged,
     bool* instanceChanged,
+    bool* blasReallocated,
     vk::AccelerationStructureInstanceKHR* instance,
     uint64_t* scratchMemorySize)
 {
-    *instanceChanged = (_needsRebuild || _transformChanged);
-    _transformChanged = false;
+    Cluster& cluster = _clusters[clusterI];
+
+    *blasChanged = (cluster.needsRebuild || cluster.needsRefit || cluster.needsDeserialize);
+    *instanceChanged = (cluster.reallocated || cluster.instanceChanged);
+    *blasReallocated = cluster.reallocated;
+    cluster.instanceChanged = false;
+    cluster.reallocated = false;
 
     *instance = {
         .transform = {},
@@ -206,44 +465,95 @@ void HVRTMesh::getASBuildInfo(
         .mask = 0xff,
         .instanceShaderBindingTableRecordOffset = 0,
         .flags = vk::GeometryInstanceFlagsKHR(),
-        .accelerationStructureReference = _vkbi.device.getAccelerationStructureAddressKHR({
-                .accelerationStructure = _as.getAccelerationStructure(),
-            },
-            _vkbi.dispatchLoader),
+        .accelerationStructureReference = cluster.as.getDeviceAddress(),
     };
     auto modelToWorldT = _modelToWorld.GetTranspose();
     std::memcpy(&instance->transform.matrix[0][0], modelToWorldT.data(), 12 * sizeof(float));
 
-    *scratchMemorySize = _as.getScratchMemorySize();
+    *scratchMemorySize = cluster.as.getScratchMemorySize();
 }
 
-void HVRTMesh::buildAS(vk::CommandBuffer& commandBuffer, VulkanBuffer& scratchBuffer)
+void HVRTMesh::buildAS(
+    size_t clusterI,
+    VulkanAccelerationStructureBuildBatch& batch,
+    vk::DeviceAddress scratchAddress)
 {
-    if (_needsRebuild || _needsRefit) {
-        _as.buildBottomLevel(
-            commandBuffer,
-            scratchBuffer,
-            _indices.size(),
+    Cluster& cluster = _clusters[clusterI];
+
+    if (cluster.needsDeserialize) {
+        cluster.as.deserialize(batch);
+        cluster.needsDeserialize = false;
+
+    } else if (cluster.needsRebuild || cluster.needsRefit) {
+        cluster.as.buildBottomLevel(
+            batch,
+            scratchAddress,
+            cluster.firstTriangle,
+            cluster.numTriangles,
             _vertexBuffer,
-            _indexBuffer,
-            _needsRefit && !_needsRebuild);
-        _needsRebuild = false;
-        _needsRefit = false;
+            getClusterIndexBuffer(),
+            cluster.needsRefit && !cluster.needsRebuild);
+
+        if (cluster.needsRebuild && cluster.cacheKey != 0) {
+            cluster.as.queueCacheStore(_asCache, cluster.cacheKey);
+        }
+
+        cluster.needsRebuild = false;
+        cluster.needsRefit = false;
     }
 }
 
+void HVRTMesh::bakeAO(
+    vk::UniqueCommandBuffer& commandBuffer,
+    vk::UniquePipelineLayout& pipelineLayout,
+    uint32_t numSamples,
+    uint32_t samplerType,
+    float maxDistance)
+{
+    // Empty meshes have nothing to bake, but still finish.
+    if (_vertices.empty()) {
+        _bakedAOSamples += numSamples;
+        return;
+    }
+
+    HVRTMesh::BakeAOPushConstants pushConstants = {
+        _modelToWorld,
+        _normalModelToWorld.GetRow(0),
+        _normalModelToWorld.GetRow(1),
+        _normalModelToWorld.GetRow(2),
+        _vertexBuffer.getDeviceAddress(),
+        _normalBuffer.getDeviceAddress(),
+        _bakedAOBuffer.getDeviceAddress(),
+        uint32_t(_vertices.size()),
+        _bakedAOSamples,
+        numSamples,
+        samplerType,
+        maxDistance,
+    };
+    commandBuffer->pushConstants(
+        pipelineLayout.get(),
+        vk::ShaderStageFlagBits::eCompute,
+        0,
+        sizeof(HVRTMesh::BakeAOPushConstants),
+        reinterpret_cast<void*>(&pushConstants));
+    commandBuffer->dispatch((_vertices.size() + AO_BAKE_GROUP_SIZE - 1) / AO_BAKE_GROUP_SIZE, 1, 1);
+
+    _bakedAOSamples += numSamples;
+}
+
 void HVRTMesh::draw(
     vk::UniqueCommandBuffer& commandBuffer,
     vk::UniquePipelineLayout& pipelineLayout,
-    pxr::GfMatrix4f& worldToNdc)
+    bool bakedAO)
 {
     HVRTMesh::PushConstants pushConstants = {
-        _modelToWorld * worldToNdc,
         _modelToWorld,
+        _drawnModelToWorld.value_or(_modelToWorld),
         _normalModelToWorld.GetRow(0),
         _normalModelToWorld.GetRow(1),
         _normalModelToWorld.GetRow(2),
-        _color
+        _color,
+        bakedAO ? 1u : 0u,
     };
     commandBuffer->pushConstants(
         pipelineLayout.get(),
@@ -251,10 +561,15 @@ void HVRTMesh::draw(
         0,
         sizeof(HVRTMesh::PushConstants),
         reinterpret_cast<void*>(&pushConstants));
+    _drawnModelToWorld = _modelToWorld;
 
-    vk::Buffer vertexBuffers[] = { _vertexBuffer.getBuffer(), _normalBuffer.getBuffer() };
-    vk::DeviceSize vertexBufferOffsets[] = { 0, 0 };
-    commandBuffer->bindVertexBuffers(0, 2, vertexBuffers, vertexBufferOffsets);
+    vk::Buffer vertexBuffers[] = {
+        _vertexBuffer.getBuffer(),
+        _normalBuffer.getBuffer(),
+        _bakedAOBuffer.getBuffer(),
+    };
+    vk::DeviceSize vertexBufferOffsets[] = { 0, 0, 0 };
+    commandBuffer->bindVertexBuffers(0, 3, vertexBuffers, vertexBufferOffsets);
 
     commandBuffer->bindIndexBuffer(_indexBuffer.getBuffer(), 0, vk::IndexType::eUint32);
 
@@ -5,6 +5,7 @@
 #include <VulkanUtils.h>
 #include <VulkanBuffer.h>
 #include <VulkanAccelerationStructure.h>
+#include <ASCache.h>
 #include <Material.h>
 
 
@@ -12,20 +13,39 @@ class HVRTMesh : public pxr::HdMesh {
 
 public:
 
+    // The camera comes from a uniform buffer shared by all meshes.
     struct PushConstants {
-        pxr::GfMatrix4f modelToNdc;
         pxr::GfMatrix4f modelToWorld;
+        pxr::GfMatrix4f prevModelToWorld;
         pxr::GfVec4f normalModelToWorld0;
         pxr::GfVec4f normalModelToWorld1;
         pxr::GfVec4f normalModelToWorld2;
         pxr::GfVec3f color;
+        uint32_t bakedAO;
+    };
+
+    // Must match aoBake.comp. The normal transform's rows are padded to vec4s like above.
+    struct BakeAOPushConstants {
+        pxr::GfMatrix4f modelToWorld;
+        pxr::GfVec4f normalModelToWorld0;
+        pxr::GfVec4f normalModelToWorld1;
+        pxr::GfVec4f normalModelToWorld2;
+        vk::DeviceAddress vertices;
+        vk::DeviceAddress normals;
+        vk::DeviceAddress bakedAO;
+        uint32_t numVertices;
+        uint32_t firstSample;
+        uint32_t numSamples;
+        uint32_t samplerType;
+        float maxDistance;
     };
 
     HVRTMesh(
         pxr::SdfPath const& id,
         pxr::SdfPath const& instancerId,
         const VulkanBasicInfo& vkbi,
-        const std::unordered_map<std::string, HVRTMaterial*>& materials);
+        const std::unordered_map<std::string, HVRTMaterial*>& materials,
+        ASCache& asCache);
 
     virtual ~HVRTMesh();
 
@@ -46,17 +66,105 @@ public:
 
     void commitResources();
 
+    // Changes whenever anything affecting the mesh's ray traced geometry changes.
+    uint64_t getVersion() {
+        return _version;
+    }
+
+    const pxr::GfRange3f& getWorldBounds() {
+        return _worldBounds;
+    }
+
+    const pxr::GfMatrix4f& getModelToWorld() {
+        return _modelToWorld;
+    }
+
+    // The inverse transpose of modelToWorld's rotation and scale, which normals are transformed by.
+    const pxr::GfMatrix4f& getNormalModelToWorld() {
+        return _normalModelToWorld;
+    }
+
+    const pxr::GfVec3f& getColor() {
+        return _color;
+    }
+
+    size_t getNumVertices() {
+        return _vertices.size();
+    }
+
+    size_t getNumTriangles() {
+        return _indices.size();
+    }
+
+    VulkanBuffer& getVertexBuffer() {
+        return _vertexBuffer;
+    }
+
+    VulkanBuffer& getIndexBuffer() {
+        return _indexBuffer;
+    }
+
+    VulkanBuffer& getNormalBuffer() {
+        return _normalBuffer;
+    }
+
+    // Large meshes are split into several clusters, each with its own BLAS and TLAS instance.
+    size_t getNumClusters() {
+        return _clusters.size();
+    }
+
+    size_t getClusterNumTriangles(size_t clusterI) {
+        return _clusters[clusterI].numTriangles;
+    }
+
+    // A cluster's BLAS takes its triangles from here, starting at getClusterFirstTriangle(), so a
+    // hit's primitive index is relative to that.
+    VulkanBuffer& getClusterIndexBuffer() {
+        return (_clusters.size() > 1) ? _clusterIndexBuffer : _indexBuffer;
+    }
+
+    uint32_t getClusterFirstTriangle(size_t clusterI) {
+        return _clusters[clusterI].firstTriangle;
+    }
+
     void getASBuildInfo(
+        size_t clusterI,
+        bool* blasChanged,
         bool* instanceChanged,
+        bool* blasReallocated,
         vk::AccelerationStructureInstanceKHR* instance,
         uint64_t* scratchMemorySize);
 
-    void buildAS(vk::CommandBuffer& commandBuffer, VulkanBuffer& scratchBuffer);
+    void buildAS(
+        size_t clusterI,
+        VulkanAccelerationStructureBuildBatch& batch,
+        vk::DeviceAddress scratchAddress);
+
+    // How many AO samples each vertex has baked since the mesh or anything near it last changed.
+    uint32_t getBakedAOSamples() {
+        return _bakedAOSamples;
+    }
+
+    // Starts the bake over, for when something else moved near the mesh.
+    void resetBakedAO() {
+        _bakedAOSamples = 0;
+    }
+
+    // Records a dispatch of the AO bake pipeline adding numSamples more samples to every vertex,
+    // which needs the TLAS to be built.
+    void bakeAO(
+        vk::UniqueCommandBuffer& commandBuffer,
+        vk::UniquePipelineLayout& pipelineLayout,
+        uint32_t numSamples,
+        uint32_t samplerType,
+        float maxDistance);
 
+    // Expected once per frame, since the transform it was last drawn with gives motion vectors. With
+    // bakedAO, shading uses the baked AO instead of tracing AO rays.
     void draw(
         vk::UniqueCommandBuffer& commandBuffer,
         vk::UniquePipelineLayout& pipelineLayout,
-        pxr::GfMatrix4f& worldToNdc);
+        bool bakedAO);
 
 protected:
 
@@ -74,7 +182,33 @@ protected:
 
 private:
 
+    struct Cluster {
+
+        Cluster(const VulkanBasicInfo& vkbi) : as(vkbi) {
+        }
+
+        uint32_t firstTriangle = 0;
+        uint32_t numTriangles = 0;
+
+        bool needsRebuild = false;
+        bool needsRefit = false;
+        bool needsDeserialize = false;
+        bool reallocated = false;
+        bool instanceChanged = false;
+        size_t maxAsTriangles = 0;
+        uint64_t cacheKey = 0;
+        VulkanAccelerationStructure as;
+
+    };
+
+    void _buildClusters();
+
+    void _markMovedClusters();
+
+    uint64_t _getClusterCacheKey(const Cluster& cluster);
+
     const VulkanBasicInfo& _vkbi;
+    ASCache& _asCache;
 
     const std::unordered_map<std::string, HVRTMaterial*>& _materials;
     HVRTMaterial* _material = nullptr;
@@ -83,6 +217,8 @@ private:
 
     bool _verticesChanged = false;
     pxr::VtVec3fArray _vertices;
+    std::optional<uint64_t> _verticesHash;
+    std::vector<bool> _movedVertices;
 
     bool _indicesChanged = false;
     pxr::VtVec3iArray _indices;
@@ -96,15 +232,26 @@ private:
     bool _transformChanged = false;
     pxr::GfMatrix4f _modelToWorld;
     pxr::GfMatrix4f _normalModelToWorld;
+    std::optional<pxr::GfMatrix4f> _drawnModelToWorld;
+
+    uint64_t _version = 0;
+    pxr::GfRange3f _localBounds;
+    pxr::GfRange3f _worldBounds;
 
     VulkanBuffer _vertexBuffer;
     VulkanBuffer _indexBuffer;
     VulkanBuffer _normalBuffer;
 
-    bool _needsRebuild = false;
-    bool _needsRefit = false;
+    // The fraction of each vertex's cosine-weighted hemisphere that AO rays escape, averaged over
+    // _bakedAOSamples samples. It's always allocated, since the raster pipeline binds it either way.
+    VulkanBuffer _bakedAOBuffer;
+    uint32_t _bakedAOSamples = 0;
+
+    // Clusters index into a copy of the index buffer with their triangles stored contiguously, which
+    // is only needed when there's more than one. Rasterization always uses the original.
+    std::deque<Cluster> _clusters;
+    std::vector<pxr::GfVec3i> _clusterIndices;
+    VulkanBuffer _clusterIndexBuffer;
     size_t _maxAsVertices = 0;
-    size_t _maxAsTriangles = 0;
-    VulkanAccelerationStructure _as;
 
 };
@@ -3,6 +3,7 @@
 #include <RenderPass.h>
 #include <Mesh.h>
 #include <Material.h>
+#include <Light.h>
 
 #include <RenderDelegate.h>
 
@@ -17,6 +18,11 @@ const pxr::TfTokenVector HVRTRenderDelegate::SUPPORTED_SPRIM_TYPES =
     pxr::HdPrimTypeTokens->camera,
     pxr::HdPrimTypeTokens->extComputation,
     pxr::HdPrimTypeTokens->material,
+    pxr::HdPrimTypeTokens->sphereLight,
+    pxr::HdPrimTypeTokens->rectLight,
+    pxr::HdPrimTypeTokens->diskLight,
+    pxr::HdPrimTypeTokens->distantLight,
+    pxr::HdPrimTypeTokens->domeLight,
 };
 
 const pxr::TfTokenVector HVRTRenderDelegate::SUPPORTED_BPRIM_TYPES =
@@ -39,6 +45,7 @@ HVRTRenderDelegate::HVRTRenderDelegate(pxr::HdRenderSettingsMap const& settingsM
 void HVRTRenderDelegate::init() {
     _resourceRegistry = std::make_shared<pxr::HdResourceRegistry>();
     vulkanInit();
+    _asCache = std::make_unique<ASCache>(_vkbi);
 }
 
 const pxr::TfTokenVector& HVRTRenderDelegate::GetSupportedRprimTypes() const {
@@ -61,7 +68,7 @@ pxr::HdRenderPassSharedPtr HVRTRenderDelegate::CreateRenderPass(
     pxr::HdRenderIndex* index,
     pxr::HdRprimCollection const& collection)
 {
-    return std::make_shared<HVRTRenderPass>(index, collection, _vkbi, _meshes);
+    return std::make_shared<HVRTRenderPass>(index, collection, _vkbi, *_asCache, _meshes, _lights);
 }
 
 pxr::HdInstancer* HVRTRenderDelegate::CreateInstancer(
@@ -85,7 +92,7 @@ pxr::HdRprim* HVRTRenderDelegate::CreateRprim(
     pxr::SdfPath const& instancerId)
 {
     if (typeId == pxr::HdPrimTypeTokens->mesh) {
-        HVRTMesh* mesh = new HVRTMesh(rprimId, instancerId, _vkbi, _materials);
+        HVRTMesh* mesh = new HVRTMesh(rprimId, instancerId, _vkbi, _materials, *_asCache);
         _meshes.insert(mesh);
         return mesh;
     }
@@ -109,6 +116,18 @@ pxr::HdSprim* HVRTRenderDelegate::CreateSprim(pxr::TfToken const& typeId, pxr::S
         HVRTMaterial* material = new HVRTMaterial(sprimId);
         _materials[sprimId.GetString()] = material;
         return material;
+    } else if (
+        typeId == pxr::HdPrimTypeTokens->sphereLight
+        || typeId == pxr::HdPrimTypeTokens->rectLight
+        || typeId == pxr::HdPrimTypeTokens->diskLight
+        || typeId == pxr::HdPrimTypeTokens->distantLight
+        || typeId == pxr::HdPrimTypeTokens->domeLight)
+    {
+        HVRTLight* light = new HVRTLight(sprimId, typeId);
+
+        // Fallback lights are never synced, so they don't light anything.
+        if (!sprimId.IsEmpty()) _lights.insert(light);
+        return light;
     }
     return nullptr;
 }
@@ -122,6 +141,9 @@ void HVRTRenderDelegate::DestroySprim(pxr::HdSprim* sprim) {
     // If sprim is a material, remove it from _materials.
     _materials.erase(sprim->GetId().GetString());
 
+    // If sprim is a light, remove it from _lights.
+    _lights.erase(reinterpret_cast<HVRTLight*>(sprim));
+
     delete sprim;
 }
 
@@ -303,11 +325,18 @@ void HVRTRenderDelegate::vulkanInit() {
         _vkbi.computeQueueFamilyIndex = _vkbi.graphicsQueueFamilyIndex;
     }
 
-    float queuePriorities[3] = { 1.0f, 1.0f, 1.0f };
+    // Use every queue the compute family exposes so AS builds can be spread across all of them.
+    uint32_t numComputeQueues = queueFamilyProperties[_vkbi.computeQueueFamilyIndex].queueCount;
+    std::vector<float> queuePriorities(numComputeQueues, 1.0f);
     std::vector<vk::DeviceQueueCreateInfo> queueCreateInfos = {
-        { vk::DeviceQueueCreateFlags(), _vkbi.graphicsQueueFamilyIndex, 1, queuePriorities },
-        { vk::DeviceQueueCreateFlags(), _vkbi.transferQueueFamilyIndex, 1, queuePriorities },
-        { vk::DeviceQueueCreateFlags(), _vkbi.computeQueueFamilyIndex, 3, queuePriorities },
+        { vk::DeviceQueueCreateFlags(), _vkbi.graphicsQueueFamilyIndex, 1, queuePriorities.data() },
+        { vk::DeviceQueueCreateFlags(), _vkbi.transferQueueFamilyIndex, 1, queuePriorities.data() },
+        {
+            vk::DeviceQueueCreateFlags(),
+            _vkbi.computeQueueFamilyIndex,
+            numComputeQueues,
+            queuePriorities.data()
+        },
     };
 
     std::vector<const char*> deviceExtensions = {
@@ -326,8 +355,24 @@ void HVRTRenderDelegate::vulkanInit() {
 
     vk::PhysicalDeviceFeatures2* features = nullptr;
 
+    // Either RT pipelines or ray queries are enough to render, and host AS builds are optional, so
+    // only enable what's supported.
+    vk::PhysicalDeviceRayTracingFeaturesKHR supportedRTFeatures;
+    vk::PhysicalDeviceFeatures2 supportedFeatures;
+    supportedFeatures.pNext = &supportedRTFeatures;
+    _vkbi.physicalDevice.getFeatures2(&supportedFeatures);
+    _vkbi.rayTracingPipeline = supportedRTFeatures.rayTracing;
+    _vkbi.rayQuery = supportedRTFeatures.rayQuery;
+    _vkbi.hostAccelerationStructureCommands =
+        supportedRTFeatures.rayTracingHostAccelerationStructureCommands;
+    if (!_vkbi.rayTracingPipeline && !_vkbi.rayQuery) {
+        throw std::runtime_error("Device supports neither ray tracing pipelines nor ray queries.");
+    }
+
     vk::PhysicalDeviceRayTracingFeaturesKHR rtFeatures = {};
-    rtFeatures.rayTracing = true;
+    rtFeatures.rayTracing = _vkbi.rayTracingPipeline;
+    rtFeatures.rayQuery = _vkbi.rayQuery;
+    rtFeatures.rayTracingHostAccelerationStructureCommands = _vkbi.hostAccelerationStructureCommands;
     rtFeatures.setPNext(features);
     features = reinterpret_cast<vk::PhysicalDeviceFeatures2*>(&rtFeatures);
 
@@ -349,7 +394,8 @@ void HVRTRenderDelegate::vulkanInit() {
 
     _vkbi.graphicsQueue = _vkbi.device.getQueue(_vkbi.graphicsQueueFamilyIndex, 0);
     _vkbi.transferQueue = _vkbi.device.getQueue(_vkbi.transferQueueFamilyIndex, 0);
-    for (int i = 0; i < 3; i++) {
+    _vkbi.computeQueues.resize(numComputeQueues);
+    for (uint32_t i = 0; i < numComputeQueues; i++) {
         _vkbi.computeQueues[i] = _vkbi.device.getQueue(_vkbi.computeQueueFamilyIndex, i);
     }
 }
@@ -3,7 +3,9 @@
 #include <Common.h>
 
 #include <VulkanUtils.h>
+#include <ASCache.h>
 #include <Mesh.h>
+#include <Light.h>
 
 
 class HVRTRenderDelegate : public pxr::HdRenderDelegate {
@@ -72,7 +74,10 @@ private:
 
     VulkanBasicInfo _vkbi;
 
+    std::unique_ptr<ASCache> _asCache;
+
     std::unordered_set<HVRTMesh*> _meshes;
+    std::unordered_set<HVRTLight*> _lights;
     std::unordered_map<std::string, HVRTMaterial*> _materials;
 
 };
@@ -5,24 +5,102 @@
 #include <RenderPass.h>
 
 
+// Refitting the TLAS degrades its quality as instances move away from where they were when it was
+// last fully built, so force a full build after this many consecutive refits.
+const uint32_t TLAS_MAX_CONSECUTIVE_UPDATES = 64;
+
+// Must match TILE_SIZE in rayquery.comp.
+const uint32_t RAY_QUERY_TILE_SIZE = 8;
+
+// Must match the TRACE_RATE_ constants in tracerate.glsl.
+const uint32_t TRACE_RATE_FULL = 0;
+const uint32_t TRACE_RATE_CHECKERBOARD = 1;
+const uint32_t TRACE_RATE_QUARTER = 2;
+
+// Each of the frame budget controller's quality levels first halves the AO rays per frame, down to
+// one, then lowers the render scale by a step, down to the minimum. The steps are coarse since each
+// one recreates every render resolution image.
+const float FRAME_BUDGET_SCALE_STEP = 0.25f;
+const int32_t FRAME_BUDGET_SCALE_LEVELS = 3;
+
+// While the camera moves, the render scale changes at most once in this many frames.
+const uint32_t FRAME_BUDGET_RESIZE_FRAMES = 8;
+
+// Quality only goes back up while the camera moves once frames fit the budget with this much to
+// spare, so it doesn't flip back and forth between two levels.
+const float FRAME_BUDGET_HEADROOM = 0.6f;
+
+// How many frames the camera has to stay still before climbing back to full quality.
+const uint32_t FRAME_BUDGET_STILL_FRAMES = 4;
+
+// Must match the sizes of PathState and ShadowRay in path.glsl.
+const uint64_t PATH_STATE_SIZE = 80;
+const uint64_t PATH_SHADOW_RAY_SIZE = 48;
+
+// Must match the offset in forward.frag and visibility.frag.
+const uint32_t FORWARD_PUSH_CONSTANTS_OFFSET = 192;
+static_assert(FORWARD_PUSH_CONSTANTS_OFFSET >= sizeof(HVRTMesh::PushConstants));
+static_assert(
+    sizeof(HVRTRenderPass::VisibilityPushConstants) <= sizeof(HVRTRenderPass::ForwardPushConstants));
+
+// Must match VISIBILITY_BACKGROUND in visibility.glsl. The visibility buffer is cleared to it, so
+// pixels without a triangle have it as their draw index.
+const uint32_t VISIBILITY_BACKGROUND = 0xffffffff;
+
+
 HVRTRenderPass::HVRTRenderPass(
     pxr::HdRenderIndex* index,
     pxr::HdRprimCollection const& collection,
     const VulkanBasicInfo& vkbi,
-    std::unordered_set<HVRTMesh*>& meshes)
+    ASCache& asCache,
+    std::unordered_set<HVRTMesh*>& meshes,
+    std::unordered_set<HVRTLight*>& lights)
     : pxr::HdRenderPass(index, collection),
       _vkbi(vkbi),
+      _asCache(asCache),
       _meshes(meshes),
+      _lights(lights),
       _outputColorImg(_vkbi),
       _outputDepthImg(_vkbi),
       _albedoImg(_vkbi),
       _worldPositionImg(_vkbi),
       _worldNormalImg(_vkbi),
+      _sampleStatsImg(_vkbi),
+      _sampleCountImg(_vkbi),
+      _motionImg(_vkbi),
+      _historyWorldPositionImg(_vkbi),
+      _historyWorldNormalImg(_vkbi),
+      _historyColorImg(_vkbi),
+      _historySampleStatsImg(_vkbi),
+      _sparseLightingImg(_vkbi),
+      _reservoirImg(_vkbi),
+      _spatialReservoirImg(_vkbi),
+      _historyReservoirImg(_vkbi),
+      _triangleIdImg(_vkbi),
+      _pathRadianceImg(_vkbi),
+      _displayColorImg(_vkbi),
+      _displayDepthImg(_vkbi),
       _lightBuffer(_vkbi),
+      _localLightBuffer(_vkbi),
+      _cameraBuffer(_vkbi),
+      _staticBatcher(_vkbi),
       _instanceBuffer(_vkbi),
       _tlas(_vkbi),
-      _scratchBuffers{ {_vkbi}, {_vkbi}, {_vkbi} },
-      _sbtBuffer(_vkbi)
+      _scratchBuffer(_vkbi),
+      _rtPipeline(_vkbi),
+      _pathCountersBuffer(_vkbi),
+      _pathGeometryBuffer(_vkbi),
+      _pathStateBuffer(_vkbi),
+      _pathHitQueueBuffer(_vkbi),
+      _pathRayQueueBuffer(_vkbi),
+      _pathNextRayQueueBuffer(_vkbi),
+      _pathShadowQueueBuffer(_vkbi),
+      _radianceCacheBuffer(_vkbi),
+      _environmentBuffer(_vkbi),
+      _drawGeometryBuffer(_vkbi),
+      _unconvergedCountBuffer(_vkbi),
+      _denoiser(_vkbi),
+      _upscaler(_vkbi)
 {
     vulkanInit();
     _blitter.importSemaphores(_renderDoneSemaphoreExternalHandle, _blitDoneSemaphoreExternalHandle);
@@ -45,36 +123,64 @@ void HVRTRenderPass::_Execute(
 {
     (void) renderTags;
 
+    // Forward mode traces from the fragment shader, which needs ray queries.
+    bool forward = _forwardSupported && getInt("forward", 0) != 0;
+
+    // Only main.rgen can rebuild surfaces from the visibility buffer, and the preview shown while
+    // it compiles needs the full G-buffer.
+    bool visibilityBuffer =
+        !forward
+        && _vkbi.rayTracingPipeline
+        && _rtPipeline.isReady()
+        && getInt("visibilityBuffer", 0) != 0;
+
     pxr::GfVec4f viewport = renderPassState->GetViewport();
-    if (viewport != _viewport) {
+    if (viewport != _viewport || forward != _forward || visibilityBuffer != _visibilityBuffer) {
         _viewport = viewport;
+        _forward = forward;
+        _visibilityBuffer = visibilityBuffer;
         _viewportExtent = vk::Extent2D(_viewport[2] - _viewport[0], _viewport[3] - _viewport[1]);
 
         // Delete old memory object from GL if one exists.
         _blitter.deleteTexture();
 
-        vulkanCreateFramebuffer();
+        vulkanCreateDisplayImages();
 
         // Import memory object into GL.
         _blitter.createTexture(
             _viewportExtent.width,
             _viewportExtent.height,
-            _outputColorImg.getExternalHandle(),
-            _outputColorImg.getMemorySize(),
-            _outputDepthImg.getExternalHandle(),
-            _outputDepthImg.getMemorySize());
+            _displayColorImg.getExternalHandle(),
+            _displayColorImg.getMemorySize(),
+            _displayDepthImg.getExternalHandle(),
+            _displayDepthImg.getMemorySize());
 
-        _accumulateFrame = 0;
+        // Force the render resolution images to be recreated too.
+        _renderExtent = vk::Extent2D();
     }
 
+    bool cameraMoved = false;
     pxr::GfMatrix4d worldToView = renderPassState->GetWorldToViewMatrix();
     pxr::GfMatrix4d viewToNdc = renderPassState->GetProjectionMatrix();
     if (worldToView != _worldToView || viewToNdc != _viewToNdc) {
 
         _worldToView = worldToView;
         _viewToNdc = viewToNdc;
+        cameraMoved = true;
+
+        // With reprojection, accumulation carries over to the new view instead.
+        if (!canReproject()) _accumulateFrame = 0;
+    }
+
+    updateFrameBudget(cameraMoved);
+    updateSamplerStats();
 
+    vk::Extent2D renderExtent = getRenderExtent();
+    if (renderExtent != _renderExtent) {
+        _renderExtent = renderExtent;
+        vulkanCreateFramebuffer();
         _accumulateFrame = 0;
+        _framesSinceResize = 0;
     }
 
     vulkanDraw();
@@ -85,7 +191,17 @@ void HVRTRenderPass::vulkanInit() {
 
     _firstRender = true;
     _mustTransitionOutputColor = false;
+    _forward = false;
+    _visibilityBuffer = false;
     _maxTlasInstances = 0;
+    _tlasBuilt = false;
+    _tlasUpdateCount = 0;
+    _budgetLevel = 0;
+    _budgetMovingLevel = 0;
+    _renderScaleLevel = 0;
+    _samplerStatsSamples = 0;
+    _framesSinceCameraMoved = 0;
+    _framesSinceResize = 0;
 
     // Just create a single command pool here for now.
 
@@ -105,15 +221,17 @@ void HVRTRenderPass::vulkanInit() {
         vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
         _vkbi.computeQueueFamilyIndex));
 
+    // One BLAS build command buffer per compute queue, plus one for the TLAS build.
+
+    size_t numComputeQueues = _vkbi.computeQueues.size();
     std::vector<vk::UniqueCommandBuffer> computeCommandBuffers =
         _vkbi.device.allocateCommandBuffersUnique(vk::CommandBufferAllocateInfo(
             _computeCommandPool.get(),
             vk::CommandBufferLevel::ePrimary,
-            4));
-    _blasBuildCommandBuffers[0] = std::move(computeCommandBuffers[0]);
-    _blasBuildCommandBuffers[1] = std::move(computeCommandBuffers[1]);
-    _blasBuildCommandBuffers[2] = std::move(computeCommandBuffers[2]);
-    _tlasBuildCommandBuffer = std::move(computeCommandBuffers[3]);
+            numComputeQueues + 1));
+    _tlasBuildCommandBuffer = std::move(computeCommandBuffers.back());
+    computeCommandBuffers.pop_back();
+    _blasBuildCommandBuffers = std::move(computeCommandBuffers);
 
     // Create render pass for drawing to interop image.
 
@@ -151,6 +269,17 @@ void HVRTRenderPass::vulkanInit() {
             vk::ImageLayout::eUndefined,
             vk::ImageLayout::eGeneral
         },
+        {
+            {},
+            vk::Format::eR16G16Sfloat,
+            vk::SampleCountFlagBits::e1,
+            vk::AttachmentLoadOp::eClear,
+            vk::AttachmentStoreOp::eStore,
+            vk::AttachmentLoadOp::eDontCare,
+            vk::AttachmentStoreOp::eDontCare,
+            vk::ImageLayout::eUndefined,
+            vk::ImageLayout::eGeneral
+        },
         {
             {},
             vk::Format::eD32Sfloat,
@@ -167,15 +296,16 @@ void HVRTRenderPass::vulkanInit() {
         {0, vk::ImageLayout::eColorAttachmentOptimal},
         {1, vk::ImageLayout::eColorAttachmentOptimal},
         {2, vk::ImageLayout::eColorAttachmentOptimal},
+        {3, vk::ImageLayout::eColorAttachmentOptimal},
     };
     vk::AttachmentReference depthAttachmentReference =
-        {3, vk::ImageLayout::eDepthStencilAttachmentOptimal};
+        {4, vk::ImageLayout::eDepthStencilAttachmentOptimal};
     vk::SubpassDescription subpass(
         {},
         vk::PipelineBindPoint::eGraphics,
         0,
         nullptr,
-        3,
+        4,
         colorAttachmentReferences,
         nullptr,
         &depthAttachmentReference,
@@ -191,31 +321,150 @@ void HVRTRenderPass::vulkanInit() {
         vk::DependencyFlags());
     _renderPass = _vkbi.device.createRenderPassUnique(vk::RenderPassCreateInfo(
         {},
-        4,
+        5,
         attachments,
         1,
         &subpass,
         1,
         &subpassDependency));
 
+    // Forward mode draws straight to the output image instead, blending into what's already there
+    // so that frames still accumulate.
+
+    vk::AttachmentDescription forwardAttachments[] = {
+        {
+            {},
+            vk::Format::eR32G32B32A32Sfloat,
+            vk::SampleCountFlagBits::e1,
+            vk::AttachmentLoadOp::eLoad,
+            vk::AttachmentStoreOp::eStore,
+            vk::AttachmentLoadOp::eDontCare,
+            vk::AttachmentStoreOp::eDontCare,
+            vk::ImageLayout::eGeneral,
+            vk::ImageLayout::eGeneral
+        },
+        attachments[4],
+    };
+    vk::AttachmentReference forwardDepthAttachmentReference =
+        {1, vk::ImageLayout::eDepthStencilAttachmentOptimal};
+    vk::SubpassDescription forwardSubpass(
+        {},
+        vk::PipelineBindPoint::eGraphics,
+        0,
+        nullptr,
+        1,
+        colorAttachmentReferences,
+        nullptr,
+        &forwardDepthAttachmentReference,
+        0,
+        nullptr);
+    vk::SubpassDependency forwardSubpassDependency(
+        VK_SUBPASS_EXTERNAL,
+        0,
+        vk::PipelineStageFlagBits::eColorAttachmentOutput,
+        vk::PipelineStageFlagBits::eColorAttachmentOutput,
+        vk::AccessFlags(),
+        vk::AccessFlagBits::eColorAttachmentRead | vk::AccessFlagBits::eColorAttachmentWrite,
+        vk::DependencyFlags());
+    _forwardRenderPass = _vkbi.device.createRenderPassUnique(vk::RenderPassCreateInfo(
+        {},
+        2,
+        forwardAttachments,
+        1,
+        &forwardSubpass,
+        1,
+        &forwardSubpassDependency));
+
+    // Visibility buffer mode only draws each pixel's draw and triangle indices, leaving the rest of
+    // the G-buffer to be rebuilt while ray tracing.
+
+    vk::AttachmentDescription visibilityAttachments[] = {
+        {
+            {},
+            vk::Format::eR32G32Uint,
+            vk::SampleCountFlagBits::e1,
+            vk::AttachmentLoadOp::eClear,
+            vk::AttachmentStoreOp::eStore,
+            vk::AttachmentLoadOp::eDontCare,
+            vk::AttachmentStoreOp::eDontCare,
+            vk::ImageLayout::eUndefined,
+            vk::ImageLayout::eGeneral
+        },
+        attachments[4],
+    };
+    vk::SubpassDescription visibilitySubpass(
+        {},
+        vk::PipelineBindPoint::eGraphics,
+        0,
+        nullptr,
+        1,
+        colorAttachmentReferences,
+        nullptr,
+        &forwardDepthAttachmentReference,
+        0,
+        nullptr);
+    _visibilityRenderPass = _vkbi.device.createRenderPassUnique(vk::RenderPassCreateInfo(
+        {},
+        2,
+        visibilityAttachments,
+        1,
+        &visibilitySubpass,
+        1,
+        &subpassDependency));
+
     // Create synchronization primitives for interop.
 
     _blitDoneSemaphore = createExternalSemaphore(_vkbi, &_blitDoneSemaphoreExternalHandle);
     _rasterDoneSemaphore = createSemaphore(_vkbi);
-    for (int i = 0; i < 3; i++) {
-        _blasBuildDoneSemaphores[i] = createSemaphore(_vkbi);
+    for (size_t i = 0; i < numComputeQueues; i++) {
+        _blasBuildDoneSemaphores.push_back(createSemaphore(_vkbi));
     }
     _tlasBuildDoneSemaphore = createSemaphore(_vkbi);
     _renderDoneSemaphore = createExternalSemaphore(_vkbi, &_renderDoneSemaphoreExternalHandle);
     _renderDoneFence = createFence(_vkbi, true);
 
+    // Forward mode traces with ray queries, and blends each frame into the accumulated output,
+    // which not every device can do with 32-bit float attachments.
+    vk::FormatFeatureFlags outputColorFeatures =
+        _vkbi.physicalDevice.getFormatProperties(vk::Format::eR32G32B32A32Sfloat).optimalTilingFeatures;
+    _forwardSupported =
+        _vkbi.rayQuery && bool(outputColorFeatures & vk::FormatFeatureFlagBits::eColorAttachmentBlend);
+    if (_vkbi.rayQuery && !_forwardSupported) {
+        std::cerr << "Forward mode is unavailable, since the device can't blend float attachments.\n";
+    }
+
     // Create shader modules.
 
     _vertexShaderModule = loadShaderModule(_vkbi, "main.vert");
     _fragmentShaderModule = loadShaderModule(_vkbi, "main.frag");
-    _raygenShaderModule = loadShaderModule(_vkbi, "main.rgen");
-    _missShaderModule = loadShaderModule(_vkbi, "main.rmiss");
-    _closestHitShaderModule = loadShaderModule(_vkbi, "main.rchit");
+    _visibilityFragmentShaderModule = loadShaderModule(_vkbi, "visibility.frag");
+    if (_forwardSupported) {
+        _forwardFragmentShaderModule = loadShaderModule(_vkbi, "forward.frag");
+    }
+    if (_vkbi.rayTracingPipeline) {
+        _raygenShaderModule = loadShaderModule(_vkbi, "main.rgen");
+        _missShaderModule = loadShaderModule(_vkbi, "main.rmiss");
+        _occlusionMissShaderModule = loadShaderModule(_vkbi, "occlusion.rmiss");
+        _closestHitShaderModule = loadShaderModule(_vkbi, "main.rchit");
+    }
+    _previewShaderModule = loadShaderModule(_vkbi, "preview.comp");
+    if (_vkbi.rayQuery) {
+        _rayQueryShaderModule = loadShaderModule(_vkbi, "rayquery.comp");
+        _pathGenerateShaderModule = loadShaderModule(_vkbi, "pathGenerate.comp");
+        _pathAdvanceShaderModule = loadShaderModule(_vkbi, "pathAdvance.comp");
+        _pathShadeShaderModule = loadShaderModule(_vkbi, "pathShade.comp");
+        _pathShadowShaderModule = loadShaderModule(_vkbi, "pathShadow.comp");
+        _pathSortShaderModule = loadShaderModule(_vkbi, "pathSort.comp");
+        _pathExtendShaderModule = loadShaderModule(_vkbi, "pathExtend.comp");
+        _pathResolveShaderModule = loadShaderModule(_vkbi, "pathResolve.comp");
+        _aoBakeShaderModule = loadShaderModule(_vkbi, "aoBake.comp");
+    }
+    _adaptiveShaderModule = loadShaderModule(_vkbi, "adaptive.comp");
+    _reprojectShaderModule = loadShaderModule(_vkbi, "reproject.comp");
+    _upsampleShaderModule = loadShaderModule(_vkbi, "upsample.comp");
+    _restirTemporalShaderModule = loadShaderModule(_vkbi, "restirTemporal.comp");
+    _restirSpatialShaderModule = loadShaderModule(_vkbi, "restirSpatial.comp");
+    _radianceCacheResolveShaderModule = loadShaderModule(_vkbi, "radianceCacheResolve.comp");
 
     // Create RT descriptor set.
 
@@ -226,17 +475,21 @@ void HVRTRenderPass::vulkanInit() {
         },
         {
             .type = vk::DescriptorType::eStorageImage,
-            .descriptorCount = 4,
+            .descriptorCount = 17,
         },
         {
             .type = vk::DescriptorType::eUniformBuffer,
-            .descriptorCount = 1,
+            .descriptorCount = 2,
+        },
+        {
+            .type = vk::DescriptorType::eStorageBuffer,
+            .descriptorCount = 12,
         },
     };
     _descriptorPool = _vkbi.device.createDescriptorPoolUnique({
         vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet,
         1,
-        2,
+        4,
         descriptorPoolSizes,
     });
 
@@ -245,40 +498,204 @@ void HVRTRenderPass::vulkanInit() {
             0,
             vk::DescriptorType::eAccelerationStructureKHR,
             1,
-            vk::ShaderStageFlagBits::eRaygenKHR,
+            vk::ShaderStageFlagBits::eRaygenKHR
+            | vk::ShaderStageFlagBits::eCompute
+            | vk::ShaderStageFlagBits::eFragment,
         },
         {
             1,
             vk::DescriptorType::eStorageImage,
             1,
-            vk::ShaderStageFlagBits::eRaygenKHR,
+            vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eCompute,
         },
         {
             2,
             vk::DescriptorType::eStorageImage,
             1,
-            vk::ShaderStageFlagBits::eRaygenKHR,
+            vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eCompute,
         },
         {
             3,
             vk::DescriptorType::eStorageImage,
             1,
-            vk::ShaderStageFlagBits::eRaygenKHR,
+            vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eCompute,
         },
         {
             4,
             vk::DescriptorType::eStorageImage,
             1,
-            vk::ShaderStageFlagBits::eRaygenKHR,
+            vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eCompute,
         },
         {
             5,
             vk::DescriptorType::eUniformBuffer,
             1,
+            vk::ShaderStageFlagBits::eRaygenKHR
+            | vk::ShaderStageFlagBits::eCompute
+            | vk::ShaderStageFlagBits::eFragment,
+        },
+        {
+            6,
+            vk::DescriptorType::eStorageImage,
+            1,
+            vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            7,
+            vk::DescriptorType::eStorageImage,
+            1,
+            vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            8,
+            vk::DescriptorType::eStorageBuffer,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            9,
+            vk::DescriptorType::eUniformBuffer,
+            1,
+            vk::ShaderStageFlagBits::eVertex,
+        },
+        {
+            10,
+            vk::DescriptorType::eStorageImage,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            11,
+            vk::DescriptorType::eStorageImage,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            12,
+            vk::DescriptorType::eStorageImage,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            13,
+            vk::DescriptorType::eStorageImage,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            14,
+            vk::DescriptorType::eStorageImage,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            15,
+            vk::DescriptorType::eStorageImage,
+            1,
+            vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            16,
+            vk::DescriptorType::eStorageBuffer,
+            1,
+            vk::ShaderStageFlagBits::eRaygenKHR
+            | vk::ShaderStageFlagBits::eCompute
+            | vk::ShaderStageFlagBits::eFragment,
+        },
+        {
+            17,
+            vk::DescriptorType::eStorageImage,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            18,
+            vk::DescriptorType::eStorageImage,
+            1,
+            vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            19,
+            vk::DescriptorType::eStorageImage,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            20,
+            vk::DescriptorType::eStorageBuffer,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            21,
+            vk::DescriptorType::eStorageBuffer,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            22,
+            vk::DescriptorType::eStorageBuffer,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            23,
+            vk::DescriptorType::eStorageBuffer,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            24,
+            vk::DescriptorType::eStorageBuffer,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            25,
+            vk::DescriptorType::eStorageBuffer,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            26,
+            vk::DescriptorType::eStorageBuffer,
+            1,
+            vk::ShaderStageFlagBits::eClosestHitKHR | vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            27,
+            vk::DescriptorType::eStorageImage,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            28,
+            vk::DescriptorType::eStorageBuffer,
+            1,
+            vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eCompute,
+        },
+        {
+            29,
+            vk::DescriptorType::eStorageBuffer,
+            1,
+            vk::ShaderStageFlagBits::eRaygenKHR
+            | vk::ShaderStageFlagBits::eCompute
+            | vk::ShaderStageFlagBits::eFragment,
+        },
+        {
+            30,
+            vk::DescriptorType::eStorageBuffer,
+            1,
+            vk::ShaderStageFlagBits::eRaygenKHR,
+        },
+        {
+            31,
+            vk::DescriptorType::eStorageImage,
+            1,
             vk::ShaderStageFlagBits::eRaygenKHR,
         },
     };
-    _rtDescriptorSetLayout = _vkbi.device.createDescriptorSetLayoutUnique({ {}, 6, bindings });
+    _rtDescriptorSetLayout = _vkbi.device.createDescriptorSetLayoutUnique({ {}, 32, bindings });
 
     std::vector<vk::UniqueDescriptorSet> descriptorSets = _vkbi.device.allocateDescriptorSetsUnique({
         _descriptorPool.get(),
@@ -289,13 +706,14 @@ void HVRTRenderPass::vulkanInit() {
 
     // Create RT pipeline.
 
-    vk::PipelineShaderStageCreateInfo rtStages[] = {
+    std::vector<vk::PipelineShaderStageCreateInfo> rtStages = {
         { {}, vk::ShaderStageFlagBits::eRaygenKHR, _raygenShaderModule.get(), "main" },
         { {}, vk::ShaderStageFlagBits::eMissKHR, _missShaderModule.get(), "main" },
+        { {}, vk::ShaderStageFlagBits::eMissKHR, _occlusionMissShaderModule.get(), "main" },
         { {}, vk::ShaderStageFlagBits::eClosestHitKHR, _closestHitShaderModule.get(), "main" },
     };
 
-    vk::RayTracingShaderGroupCreateInfoKHR rtGroups[] = {
+    std::vector<vk::RayTracingShaderGroupCreateInfoKHR> rtGroups = {
         {
             .type = vk::RayTracingShaderGroupTypeKHR::eGeneral,
             .generalShader = 0,
@@ -310,10 +728,17 @@ void HVRTRenderPass::vulkanInit() {
             .anyHitShader = VK_SHADER_UNUSED_KHR,
             .intersectionShader = VK_SHADER_UNUSED_KHR,
         },
+        {
+            .type = vk::RayTracingShaderGroupTypeKHR::eGeneral,
+            .generalShader = 2,
+            .closestHitShader = VK_SHADER_UNUSED_KHR,
+            .anyHitShader = VK_SHADER_UNUSED_KHR,
+            .intersectionShader = VK_SHADER_UNUSED_KHR,
+        },
         {
             .type = vk::RayTracingShaderGroupTypeKHR::eTrianglesHitGroup,
             .generalShader = VK_SHADER_UNUSED_KHR,
-            .closestHitShader = 2,
+            .closestHitShader = 3,
             .anyHitShader = VK_SHADER_UNUSED_KHR,
             .intersectionShader = VK_SHADER_UNUSED_KHR,
         },
@@ -321,57 +746,168 @@ void HVRTRenderPass::vulkanInit() {
 
     std::vector<vk::DescriptorSetLayout> rtDescriptorSetLayouts = { _rtDescriptorSetLayout.get() };
     std::vector<vk::PushConstantRange> rtPushConstantRanges = {
-        {vk::ShaderStageFlagBits::eRaygenKHR, 0, sizeof(RTPushConstants)},
+        {vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eCompute, 0, sizeof(RTPushConstants)},
     };
     _rtPipelineLayout = _vkbi.device.createPipelineLayoutUnique(vk::PipelineLayoutCreateInfo(
         {},
         rtDescriptorSetLayouts,
         rtPushConstantRanges));
 
-    vk::UniqueHandle<vk::Pipeline, vk::DispatchLoaderDynamic> rtPipeline =
-        _vkbi.device.createRayTracingPipelineKHRUnique(
+    // Compiling the RT pipeline can take a while, so it's done in the background and frames are
+    // shaded by the preview pipeline until it's ready. The payloads are the hit distance, normal and
+    // color for regular rays and a visibility flag for occlusion rays, which use the second miss
+    // shader.
+    if (_vkbi.rayTracingPipeline) {
+        _rtPipeline.compile(rtStages, rtGroups, 1, 8 * sizeof(float), _rtPipelineLayout.get());
+    }
+
+    // Create ray query pipeline, an alternative to the RT pipeline which traces from compute.
+
+    if (_vkbi.rayQuery) {
+        _rayQueryPipeline = _vkbi.device.createComputePipelineUnique(
             {},
-            {
-                .flags = vk::PipelineCreateFlags(),
-                .stageCount = 3,
-                .stages = rtStages,
-                .groupCount = 3,
-                .groups = rtGroups,
-                .maxRecursionDepth = 1,
-                .libraries = {},
-                .pLibraryInterface = nullptr,
-                .layout = _rtPipelineLayout.get(),
-            },
-            nullptr,
-            _vkbi.dispatchLoader);
-    _rtPipeline = std::move(rtPipeline);
+            vk::ComputePipelineCreateInfo(
+                {},
+                { {}, vk::ShaderStageFlagBits::eCompute, _rayQueryShaderModule.get(), "main" },
+                _rtPipelineLayout.get()));
+    }
 
-    // Create RT shader binding table.
+    // Create adaptive sampling pipeline, which decides how many AO rays each pixel gets.
 
-    vk::PhysicalDeviceProperties2 properties;
-    vk::PhysicalDeviceRayTracingPropertiesKHR rtProperties;
-    properties.pNext = &rtProperties;
-    _vkbi.physicalDevice.getProperties2(&properties);
+    _adaptivePipeline = _vkbi.device.createComputePipelineUnique(
+        {},
+        vk::ComputePipelineCreateInfo(
+            {},
+            { {}, vk::ShaderStageFlagBits::eCompute, _adaptiveShaderModule.get(), "main" },
+            _rtPipelineLayout.get()));
+    _adaptiveSampled = false;
+    _adaptiveConverged = false;
 
-    std::vector<uint8_t> shaderGroupHandles(3 * rtProperties.shaderGroupHandleSize);
-    _vkbi.device.getRayTracingShaderGroupHandlesKHR(
-        _rtPipeline.get(),
-        0,
-        3,
-        shaderGroupHandles.size() * sizeof(uint8_t),
-        shaderGroupHandles.data(),
-        _vkbi.dispatchLoader);
+    // Create reprojection pipeline, which carries accumulation over to the current view.
 
-    _sbtBuffer.allocate(
-        3 * rtProperties.shaderGroupBaseAlignment,
-        true,
-        vk::BufferUsageFlagBits::eRayTracingKHR);
-    for (uint32_t i = 0; i < 3; i++) {
-        std::memcpy(
-            reinterpret_cast<uint8_t*>(_sbtBuffer.data()) + i * rtProperties.shaderGroupBaseAlignment,
-            shaderGroupHandles.data() + i * rtProperties.shaderGroupHandleSize,
-            rtProperties.shaderGroupHandleSize);
+    _reprojectPipeline = _vkbi.device.createComputePipelineUnique(
+        {},
+        vk::ComputePipelineCreateInfo(
+            {},
+            { {}, vk::ShaderStageFlagBits::eCompute, _reprojectShaderModule.get(), "main" },
+            _rtPipelineLayout.get()));
+
+    // Create upsampling pipeline, which fills in the pixels skipped at a reduced trace rate.
+
+    _upsamplePipeline = _vkbi.device.createComputePipelineUnique(
+        {},
+        vk::ComputePipelineCreateInfo(
+            {},
+            { {}, vk::ShaderStageFlagBits::eCompute, _upsampleShaderModule.get(), "main" },
+            _rtPipelineLayout.get()));
+
+    // Create ReSTIR pipelines, which pick each pixel's local light sample before main.rgen shades
+    // it.
+
+    _restirTemporalPipeline = _vkbi.device.createComputePipelineUnique(
+        {},
+        vk::ComputePipelineCreateInfo(
+            {},
+            { {}, vk::ShaderStageFlagBits::eCompute, _restirTemporalShaderModule.get(), "main" },
+            _rtPipelineLayout.get()));
+    _restirSpatialPipeline = _vkbi.device.createComputePipelineUnique(
+        {},
+        vk::ComputePipelineCreateInfo(
+            {},
+            { {}, vk::ShaderStageFlagBits::eCompute, _restirSpatialShaderModule.get(), "main" },
+            _rtPipelineLayout.get()));
+    _restirHistoryValid = false;
+    _frameIndex = 0;
+
+    // Create wavefront path tracing pipelines, one per stage, which trace with ray queries.
+
+    if (_vkbi.rayQuery) {
+        std::pair<vk::UniquePipeline*, vk::ShaderModule> pathStages[] = {
+            { &_pathGeneratePipeline, _pathGenerateShaderModule.get() },
+            { &_pathAdvancePipeline, _pathAdvanceShaderModule.get() },
+            { &_pathShadePipeline, _pathShadeShaderModule.get() },
+            { &_pathShadowPipeline, _pathShadowShaderModule.get() },
+            { &_pathSortPipeline, _pathSortShaderModule.get() },
+            { &_pathExtendPipeline, _pathExtendShaderModule.get() },
+            { &_pathResolvePipeline, _pathResolveShaderModule.get() },
+        };
+        for (auto& [pipeline, shaderModule] : pathStages) {
+            *pipeline = _vkbi.device.createComputePipelineUnique(
+                {},
+                vk::ComputePipelineCreateInfo(
+                    {},
+                    { {}, vk::ShaderStageFlagBits::eCompute, shaderModule, "main" },
+                    _rtPipelineLayout.get()));
+        }
+    }
+    // Create radiance cache pipeline, which blends each frame's samples into the cache after
+    // main.rgen adds them.
+
+    _radianceCacheResolvePipeline = _vkbi.device.createComputePipelineUnique(
+        {},
+        vk::ComputePipelineCreateInfo(
+            {},
+            { {}, vk::ShaderStageFlagBits::eCompute, _radianceCacheResolveShaderModule.get(), "main" },
+            _rtPipelineLayout.get()));
+
+    // Create the AO bake pipeline, which forward mode uses to bake AO into mesh vertices. It has its
+    // own push constants, giving the mesh to bake.
+
+    if (_vkbi.rayQuery) {
+        std::vector<vk::PushConstantRange> aoBakePushConstantRanges = {
+            {vk::ShaderStageFlagBits::eCompute, 0, sizeof(HVRTMesh::BakeAOPushConstants)},
+        };
+        _aoBakePipelineLayout = _vkbi.device.createPipelineLayoutUnique(vk::PipelineLayoutCreateInfo(
+            {},
+            rtDescriptorSetLayouts,
+            aoBakePushConstantRanges));
+
+        _aoBakePipeline = _vkbi.device.createComputePipelineUnique(
+            {},
+            vk::ComputePipelineCreateInfo(
+                {},
+                { {}, vk::ShaderStageFlagBits::eCompute, _aoBakeShaderModule.get(), "main" },
+                _aoBakePipelineLayout.get()));
     }
+    _aoBakeMeshes.clear();
+    _aoBakeMaxDistance = -1.0f;
+    _aoBaking = false;
+
+    _pathBuffersExtent = vk::Extent2D(0, 0);
+    _mustTransitionPathRadiance = false;
+    _pathTraced = false;
+    _pathsLaunched = 0;
+
+    // Create RT pass timestamp queries, used for ray throughput stats.
+
+    _rtTimestampQueryPool = _vkbi.device.createQueryPoolUnique({
+        .queryType = vk::QueryType::eTimestamp,
+        .queryCount = 2,
+    });
+    _rtTimestampPeriod = _vkbi.physicalDevice.getProperties().limits.timestampPeriod;
+    _rtRaysLaunched = 0;
+
+    // Create whole frame timestamp queries, for the frame budget. The raster and RT passes' command
+    // buffers each get a pair, so the gap between their submissions isn't counted.
+
+    _frameTimestampQueryPool = _vkbi.device.createQueryPoolUnique({
+        .queryType = vk::QueryType::eTimestamp,
+        .queryCount = 4,
+    });
+    _numFrameTimestamps = 0;
+
+    // Create preview pipeline.
+
+    _previewPipelineLayout = _vkbi.device.createPipelineLayoutUnique(vk::PipelineLayoutCreateInfo(
+        {},
+        rtDescriptorSetLayouts));
+
+    _previewPipeline = _vkbi.device.createComputePipelineUnique(
+        {},
+        vk::ComputePipelineCreateInfo(
+            {},
+            { {}, vk::ShaderStageFlagBits::eCompute, _previewShaderModule.get(), "main" },
+            _previewPipelineLayout.get()));
 
     // Allocate light buffer.
 
@@ -381,9 +917,94 @@ void HVRTRenderPass::vulkanInit() {
         0,
         VK_WHOLE_SIZE,
     };
-    vk::WriteDescriptorSet writeDescriptorSets[] = {
-        {
-            _rtDescriptorSet.get(),
+
+    // The local light buffer is allocated along with its alias table, once the lights are known.
+
+    _localLightsVersion = std::numeric_limits<uint64_t>::max();
+    _numLocalLights = 0;
+
+    // Allocate camera buffer, used for rasterizing and motion vectors.
+
+    _cameraBuffer.allocate(sizeof(CameraData), true, vk::BufferUsageFlagBits::eUniformBuffer);
+    vk::DescriptorBufferInfo cameraBufferInfo = {
+        _cameraBuffer.getBuffer(),
+        0,
+        VK_WHOLE_SIZE,
+    };
+
+    // Allocate adaptive sampling's count of pixels which still need rays.
+
+    _unconvergedCountBuffer.allocate(sizeof(uint32_t), true, vk::BufferUsageFlagBits::eStorageBuffer);
+    vk::DescriptorBufferInfo unconvergedCountBufferInfo = {
+        _unconvergedCountBuffer.getBuffer(),
+        0,
+        VK_WHOLE_SIZE,
+    };
+
+    // Allocate path tracing's queue counters, which are reset from the CPU before each frame and
+    // read back after it for stats. The path geometry table grows with the scene, and the queues
+    // with the render resolution.
+
+    _pathCountersBuffer.allocate(
+        sizeof(PathCounters),
+        true,
+        vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndirectBuffer);
+    vk::DescriptorBufferInfo pathCountersBufferInfo = {
+        _pathCountersBuffer.getBuffer(),
+        0,
+        VK_WHOLE_SIZE,
+    };
+    _pathGeometryBuffer.allocate(sizeof(PathGeometry), true, vk::BufferUsageFlagBits::eStorageBuffer);
+    vk::DescriptorBufferInfo pathGeometryBufferInfo = {
+        _pathGeometryBuffer.getBuffer(),
+        0,
+        VK_WHOLE_SIZE,
+    };
+
+    // main.rgen always reads the radiance cache, so it starts out with a single cell until it's
+    // turned on.
+
+    _radianceCacheBuffer.allocate(
+        sizeof(RadianceCacheCell),
+        false,
+        vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst);
+    _radianceCacheMustClear = true;
+    vk::DescriptorBufferInfo radianceCacheBufferInfo = {
+        _radianceCacheBuffer.getBuffer(),
+        0,
+        VK_WHOLE_SIZE,
+    };
+
+    // Likewise, shading always declares the environment map, which is a single black texel until a
+    // dome light has one.
+
+    _environmentBuffer.allocate(
+        sizeof(EnvironmentMap::Texel),
+        true,
+        vk::BufferUsageFlagBits::eStorageBuffer);
+    std::memset(_environmentBuffer.data(), 0, sizeof(EnvironmentMap::Texel));
+    _environmentFile.clear();
+    _environmentMaxWidth = 0;
+    _environmentWidth = 0;
+    _environmentHeight = 0;
+    vk::DescriptorBufferInfo environmentBufferInfo = {
+        _environmentBuffer.getBuffer(),
+        0,
+        VK_WHOLE_SIZE,
+    };
+
+    // main.rgen declares the draw geometry table even outside visibility buffer mode.
+
+    _drawGeometryBuffer.allocate(sizeof(DrawGeometry), true, vk::BufferUsageFlagBits::eStorageBuffer);
+    vk::DescriptorBufferInfo drawGeometryBufferInfo = {
+        _drawGeometryBuffer.getBuffer(),
+        0,
+        VK_WHOLE_SIZE,
+    };
+
+    vk::WriteDescriptorSet writeDescriptorSets[] = {
+        {
+            _rtDescriptorSet.get(),
             5,
             0,
             1,
@@ -392,82 +1013,312 @@ void HVRTRenderPass::vulkanInit() {
             &_lightBufferInfo,
             nullptr,
         },
+        {
+            _rtDescriptorSet.get(),
+            8,
+            0,
+            1,
+            vk::DescriptorType::eStorageBuffer,
+            nullptr,
+            &unconvergedCountBufferInfo,
+            nullptr,
+        },
+        {
+            _rtDescriptorSet.get(),
+            9,
+            0,
+            1,
+            vk::DescriptorType::eUniformBuffer,
+            nullptr,
+            &cameraBufferInfo,
+            nullptr,
+        },
+        {
+            _rtDescriptorSet.get(),
+            20,
+            0,
+            1,
+            vk::DescriptorType::eStorageBuffer,
+            nullptr,
+            &pathCountersBufferInfo,
+            nullptr,
+        },
+        {
+            _rtDescriptorSet.get(),
+            26,
+            0,
+            1,
+            vk::DescriptorType::eStorageBuffer,
+            nullptr,
+            &pathGeometryBufferInfo,
+            nullptr,
+        },
+        {
+            _rtDescriptorSet.get(),
+            28,
+            0,
+            1,
+            vk::DescriptorType::eStorageBuffer,
+            nullptr,
+            &radianceCacheBufferInfo,
+            nullptr,
+        },
+        {
+            _rtDescriptorSet.get(),
+            29,
+            0,
+            1,
+            vk::DescriptorType::eStorageBuffer,
+            nullptr,
+            &environmentBufferInfo,
+            nullptr,
+        },
+        {
+            _rtDescriptorSet.get(),
+            30,
+            0,
+            1,
+            vk::DescriptorType::eStorageBuffer,
+            nullptr,
+            &drawGeometryBufferInfo,
+            nullptr,
+        },
     };
-    _vkbi.device.updateDescriptorSets(1, writeDescriptorSets, 0, nullptr);
+    _vkbi.device.updateDescriptorSets(8, writeDescriptorSets, 0, nullptr);
 }
 
-void HVRTRenderPass::vulkanCreateFramebuffer() {
+void HVRTRenderPass::vulkanCreateDisplayImages() {
 
-    // Make sure we don't try to recreate the framebuffer during rendering.
+    // Make sure we don't try to recreate the images during rendering.
 
     _vkbi.device.waitForFences(1, &_renderDoneFence.get(), true, std::numeric_limits<uint64_t>::max());
 
-    // Create all images.
+    // The upscaled frame, shared with GL for the blit. GL reads the depth image as R32F, so it's
+    // stored as a color image rather than a depth attachment.
 
-    _outputColorImg.allocate(
+    _displayColorImg.allocate(
         vk::Format::eR32G32B32A32Sfloat,
         _viewportExtent,
-        vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eStorage,
+        vk::ImageUsageFlagBits::eStorage,
         vk::ImageAspectFlagBits::eColor,
         true);
+
+    _displayDepthImg.allocate(
+        vk::Format::eR32Sfloat,
+        _viewportExtent,
+        vk::ImageUsageFlagBits::eStorage,
+        vk::ImageAspectFlagBits::eColor,
+        true);
+}
+
+void HVRTRenderPass::vulkanCreateFramebuffer() {
+
+    // Make sure we don't try to recreate the framebuffer during rendering.
+
+    _vkbi.device.waitForFences(1, &_renderDoneFence.get(), true, std::numeric_limits<uint64_t>::max());
+
+    // Create all images, at the internal render resolution.
+
+    _outputColorImg.allocate(
+        vk::Format::eR32G32B32A32Sfloat,
+        _renderExtent,
+        vk::ImageUsageFlagBits::eColorAttachment
+        | vk::ImageUsageFlagBits::eStorage
+        | vk::ImageUsageFlagBits::eTransferSrc,
+        vk::ImageAspectFlagBits::eColor);
     _mustTransitionOutputColor = true;
+    _restirHistoryValid = false;
 
     _outputDepthImg.allocate(
         vk::Format::eD32Sfloat,
+        _renderExtent,
+        vk::ImageUsageFlagBits::eDepthStencilAttachment | vk::ImageUsageFlagBits::eSampled,
+        vk::ImageAspectFlagBits::eDepth);
+
+    _upscaler.setImages(
+        _outputColorImg,
+        _outputDepthImg,
         _viewportExtent,
-        vk::ImageUsageFlagBits::eDepthStencilAttachment,
-        vk::ImageAspectFlagBits::eDepth,
-        true);
+        _displayColorImg,
+        _displayDepthImg);
+
+    // Forward mode shades while rasterizing, so it doesn't need a G-buffer at all, and visibility
+    // buffer mode rebuilds surfaces from triangle IDs instead. Images a mode doesn't use are still
+    // kept as single pixel placeholders, so the descriptor set never refers to freed images.
+    vk::Extent2D placeholderExtent(1, 1);
+    vk::Extent2D gBufferExtent = (_forward || _visibilityBuffer) ? placeholderExtent : _renderExtent;
+    vk::Extent2D samplingExtent = _forward ? placeholderExtent : _renderExtent;
+
+    _triangleIdImg.allocate(
+        vk::Format::eR32G32Uint,
+        _visibilityBuffer ? _renderExtent : placeholderExtent,
+        vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eStorage,
+        vk::ImageAspectFlagBits::eColor);
 
     _albedoImg.allocate(
         vk::Format::eR16G16B16A16Sfloat,
-        _viewportExtent,
+        gBufferExtent,
         vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eStorage,
         vk::ImageAspectFlagBits::eColor);
 
     _worldPositionImg.allocate(
         vk::Format::eR32G32B32A32Sfloat,
-        _viewportExtent,
-        vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eStorage,
+        gBufferExtent,
+        vk::ImageUsageFlagBits::eColorAttachment
+        | vk::ImageUsageFlagBits::eStorage
+        | vk::ImageUsageFlagBits::eTransferSrc,
         vk::ImageAspectFlagBits::eColor);
 
     _worldNormalImg.allocate(
         vk::Format::eR16G16B16A16Sfloat,
-        _viewportExtent,
+        gBufferExtent,
+        vk::ImageUsageFlagBits::eColorAttachment
+        | vk::ImageUsageFlagBits::eStorage
+        | vk::ImageUsageFlagBits::eTransferSrc,
+        vk::ImageAspectFlagBits::eColor);
+
+    _sampleStatsImg.allocate(
+        vk::Format::eR32G32B32A32Sfloat,
+        samplingExtent,
+        vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferSrc,
+        vk::ImageAspectFlagBits::eColor);
+
+    _sampleCountImg.allocate(
+        vk::Format::eR32Uint,
+        samplingExtent,
+        vk::ImageUsageFlagBits::eStorage,
+        vk::ImageAspectFlagBits::eColor);
+
+    _motionImg.allocate(
+        vk::Format::eR16G16Sfloat,
+        gBufferExtent,
         vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eStorage,
         vk::ImageAspectFlagBits::eColor);
 
+    // Last frame's G-buffer and accumulation, copied at the start of each frame for
+    // reprojection.
+
+    _historyWorldPositionImg.allocate(
+        vk::Format::eR32G32B32A32Sfloat,
+        gBufferExtent,
+        vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferDst,
+        vk::ImageAspectFlagBits::eColor);
+
+    _historyWorldNormalImg.allocate(
+        vk::Format::eR16G16B16A16Sfloat,
+        gBufferExtent,
+        vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferDst,
+        vk::ImageAspectFlagBits::eColor);
+
+    _historyColorImg.allocate(
+        vk::Format::eR32G32B32A32Sfloat,
+        gBufferExtent,
+        vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferDst,
+        vk::ImageAspectFlagBits::eColor);
+
+    _historySampleStatsImg.allocate(
+        vk::Format::eR32G32B32A32Sfloat,
+        gBufferExtent,
+        vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferDst,
+        vk::ImageAspectFlagBits::eColor);
+
+    // Lighting traced at a reduced rate, before upsampling. Sized for the checkerboard pattern,
+    // which traces the most pixels.
+
+    _sparseLightingImg.allocate(
+        vk::Format::eR16G16B16A16Sfloat,
+        { (gBufferExtent.width + 1) / 2, gBufferExtent.height },
+        vk::ImageUsageFlagBits::eStorage,
+        vk::ImageAspectFlagBits::eColor);
+
+    // ReSTIR's reservoirs: after initial candidates and temporal reuse, after spatial reuse, and
+    // last frame's, which are cleared whenever they can't be reused.
+
+    _reservoirImg.allocate(
+        vk::Format::eR32G32B32A32Uint,
+        gBufferExtent,
+        vk::ImageUsageFlagBits::eStorage,
+        vk::ImageAspectFlagBits::eColor);
+
+    _spatialReservoirImg.allocate(
+        vk::Format::eR32G32B32A32Uint,
+        gBufferExtent,
+        vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferSrc,
+        vk::ImageAspectFlagBits::eColor);
+
+    _historyReservoirImg.allocate(
+        vk::Format::eR32G32B32A32Uint,
+        gBufferExtent,
+        vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferDst,
+        vk::ImageAspectFlagBits::eColor);
+
+    if (_forward || _visibilityBuffer) {
+        _denoiser.freeImages();
+    } else {
+        _denoiser.setImages(
+            _renderExtent,
+            _outputColorImg,
+            _albedoImg,
+            _worldPositionImg,
+            _worldNormalImg,
+            _motionImg,
+            _historyWorldPositionImg,
+            _historyWorldNormalImg);
+    }
+
     // Create the output framebuffer.
 
-    vk::ImageView attachments[] = {
-        _albedoImg.getImageView(),
-        _worldPositionImg.getImageView(),
-        _worldNormalImg.getImageView(),
-        _outputDepthImg.getImageView()
-    };
+    std::vector<vk::ImageView> attachments;
+    if (_forward) {
+        attachments = {
+            _outputColorImg.getImageView(),
+            _outputDepthImg.getImageView()
+        };
+    } else if (_visibilityBuffer) {
+        attachments = {
+            _triangleIdImg.getImageView(),
+            _outputDepthImg.getImageView()
+        };
+    } else {
+        attachments = {
+            _albedoImg.getImageView(),
+            _worldPositionImg.getImageView(),
+            _worldNormalImg.getImageView(),
+            _motionImg.getImageView(),
+            _outputDepthImg.getImageView()
+        };
+    }
     _outputFramebuffer = _vkbi.device.createFramebufferUnique(vk::FramebufferCreateInfo(
         {},
-        _renderPass.get(),
-        4,
-        attachments,
-        _viewportExtent.width,
-        _viewportExtent.height,
+        getRasterRenderPass(),
+        attachments.size(),
+        attachments.data(),
+        _renderExtent.width,
+        _renderExtent.height,
         1));
 
     // Create pipeline.
 
+    vk::ShaderModule fragmentShaderModule = _fragmentShaderModule.get();
+    if (_forward) {
+        fragmentShaderModule = _forwardFragmentShaderModule.get();
+    } else if (_visibilityBuffer) {
+        fragmentShaderModule = _visibilityFragmentShaderModule.get();
+    }
     std::vector<vk::PipelineShaderStageCreateInfo> shaderStageCreateInfos = {
         {{}, vk::ShaderStageFlagBits::eVertex, _vertexShaderModule.get(), "main"},
-        {{}, vk::ShaderStageFlagBits::eFragment, _fragmentShaderModule.get(), "main"}
+        {{}, vk::ShaderStageFlagBits::eFragment, fragmentShaderModule, "main"}
     };
 
     std::vector<vk::VertexInputBindingDescription> vertexInputBindingDescriptions = {
         { .binding = 0, .stride = sizeof(pxr::GfVec3f), .inputRate = vk::VertexInputRate::eVertex },
         { .binding = 1, .stride = sizeof(pxr::GfVec3f), .inputRate = vk::VertexInputRate::eVertex },
+        { .binding = 2, .stride = sizeof(float), .inputRate = vk::VertexInputRate::eVertex },
     };
     std::vector<vk::VertexInputAttributeDescription> vertexInputAttributeDescriptions = {
         { .binding = 0, .location = 0, .format = vk::Format::eR32G32B32Sfloat, .offset = 0 },
         { .binding = 1, .location = 1, .format = vk::Format::eR32G32B32Sfloat, .offset = 0 },
+        { .binding = 2, .location = 2, .format = vk::Format::eR32Sfloat, .offset = 0 },
     };
     vk::PipelineVertexInputStateCreateInfo vertexInputState(
         {},
@@ -479,8 +1330,8 @@ void HVRTRenderPass::vulkanCreateFramebuffer() {
         vk::PrimitiveTopology::eTriangleList,
         false);
 
-    vk::Viewport viewport(0.0f, 0.0f, _viewportExtent.width, _viewportExtent.height, 0.0f, 1.0f);
-    vk::Rect2D scissor({ 0, 0 }, _viewportExtent);
+    vk::Viewport viewport(0.0f, 0.0f, _renderExtent.width, _renderExtent.height, 0.0f, 1.0f);
+    vk::Rect2D scissor({ 0, 0 }, _renderExtent);
     vk::PipelineViewportStateCreateInfo viewportState({}, 1, &viewport, 1, &scissor);
 
     vk::PipelineRasterizationStateCreateInfo rasterizationState(
@@ -557,18 +1408,69 @@ void HVRTRenderPass::vulkanCreateFramebuffer() {
             | vk::ColorComponentFlagBits::eB
             | vk::ColorComponentFlagBits::eA
         },
+        {
+            false,
+            vk::BlendFactor::eOne,
+            vk::BlendFactor::eZero,
+            vk::BlendOp::eAdd,
+            vk::BlendFactor::eOne,
+            vk::BlendFactor::eZero,
+            vk::BlendOp::eAdd,
+            vk::ColorComponentFlagBits::eR
+            | vk::ColorComponentFlagBits::eG
+        },
     };
     vk::PipelineColorBlendStateCreateInfo colorBlendState(
         {},
         false,
         vk::LogicOp::eCopy,
-        3,
+        4,
         colorBlendAttachmentStates,
         { 0.0f, 0.0f, 0.0f, 0.0f});
 
-    std::vector<vk::DescriptorSetLayout> descriptorSetLayouts;
+    // The visibility buffer is just the triangle IDs, which aren't blended either.
+    vk::PipelineColorBlendAttachmentState visibilityColorBlendAttachmentState =
+        colorBlendAttachmentStates[3];
+    vk::PipelineColorBlendStateCreateInfo visibilityColorBlendState(
+        {},
+        false,
+        vk::LogicOp::eCopy,
+        1,
+        &visibilityColorBlendAttachmentState,
+        { 0.0f, 0.0f, 0.0f, 0.0f});
+
+    // Forward mode accumulates by blending each frame in with weight 1 / (frame + 1), which is set
+    // through the blend constants.
+    vk::PipelineColorBlendAttachmentState forwardColorBlendAttachmentState = {
+        true,
+        vk::BlendFactor::eConstantAlpha,
+        vk::BlendFactor::eOneMinusConstantAlpha,
+        vk::BlendOp::eAdd,
+        vk::BlendFactor::eConstantAlpha,
+        vk::BlendFactor::eOneMinusConstantAlpha,
+        vk::BlendOp::eAdd,
+        vk::ColorComponentFlagBits::eR
+        | vk::ColorComponentFlagBits::eG
+        | vk::ColorComponentFlagBits::eB
+        | vk::ColorComponentFlagBits::eA
+    };
+    vk::PipelineColorBlendStateCreateInfo forwardColorBlendState(
+        {},
+        false,
+        vk::LogicOp::eCopy,
+        1,
+        &forwardColorBlendAttachmentState,
+        { 0.0f, 0.0f, 0.0f, 0.0f});
+
+    vk::DynamicState forwardDynamicStates[] = { vk::DynamicState::eBlendConstants };
+    vk::PipelineDynamicStateCreateInfo forwardDynamicState({}, 1, forwardDynamicStates);
+
+    // All modes share a layout. The descriptor set provides the camera, and in forward mode the TLAS
+    // and lights.
+    std::vector<vk::DescriptorSetLayout> descriptorSetLayouts = { _rtDescriptorSetLayout.get() };
     std::vector<vk::PushConstantRange> pushConstantRanges = {
         {vk::ShaderStageFlagBits::eVertex, 0, sizeof(HVRTMesh::PushConstants)},
+        {vk::ShaderStageFlagBits::eFragment, FORWARD_PUSH_CONSTANTS_OFFSET, sizeof(ForwardPushConstants)},
     };
     _pipelineLayout = _vkbi.device.createPipelineLayoutUnique(vk::PipelineLayoutCreateInfo(
         {},
@@ -587,10 +1489,12 @@ void HVRTRenderPass::vulkanCreateFramebuffer() {
             &rasterizationState,
             &multisampleState,
             &depthStencilState,
-            &colorBlendState,
-            nullptr,
+            _forward
+                ? &forwardColorBlendState
+                : (_visibilityBuffer ? &visibilityColorBlendState : &colorBlendState),
+            _forward ? &forwardDynamicState : nullptr,
             *_pipelineLayout,
-            *_renderPass,
+            getRasterRenderPass(),
             0,
             nullptr,
             -1));
@@ -618,6 +1522,66 @@ void HVRTRenderPass::vulkanCreateFramebuffer() {
         _worldNormalImg.getImageView(),
         vk::ImageLayout::eGeneral,
     };
+    vk::DescriptorImageInfo sampleStatsDescriptorImageInfo = {
+        {},
+        _sampleStatsImg.getImageView(),
+        vk::ImageLayout::eGeneral,
+    };
+    vk::DescriptorImageInfo sampleCountDescriptorImageInfo = {
+        {},
+        _sampleCountImg.getImageView(),
+        vk::ImageLayout::eGeneral,
+    };
+    vk::DescriptorImageInfo motionDescriptorImageInfo = {
+        {},
+        _motionImg.getImageView(),
+        vk::ImageLayout::eGeneral,
+    };
+    vk::DescriptorImageInfo historyWorldPositionDescriptorImageInfo = {
+        {},
+        _historyWorldPositionImg.getImageView(),
+        vk::ImageLayout::eGeneral,
+    };
+    vk::DescriptorImageInfo historyWorldNormalDescriptorImageInfo = {
+        {},
+        _historyWorldNormalImg.getImageView(),
+        vk::ImageLayout::eGeneral,
+    };
+    vk::DescriptorImageInfo historyColorDescriptorImageInfo = {
+        {},
+        _historyColorImg.getImageView(),
+        vk::ImageLayout::eGeneral,
+    };
+    vk::DescriptorImageInfo historySampleStatsDescriptorImageInfo = {
+        {},
+        _historySampleStatsImg.getImageView(),
+        vk::ImageLayout::eGeneral,
+    };
+    vk::DescriptorImageInfo sparseLightingDescriptorImageInfo = {
+        {},
+        _sparseLightingImg.getImageView(),
+        vk::ImageLayout::eGeneral,
+    };
+    vk::DescriptorImageInfo reservoirDescriptorImageInfo = {
+        {},
+        _reservoirImg.getImageView(),
+        vk::ImageLayout::eGeneral,
+    };
+    vk::DescriptorImageInfo spatialReservoirDescriptorImageInfo = {
+        {},
+        _spatialReservoirImg.getImageView(),
+        vk::ImageLayout::eGeneral,
+    };
+    vk::DescriptorImageInfo historyReservoirDescriptorImageInfo = {
+        {},
+        _historyReservoirImg.getImageView(),
+        vk::ImageLayout::eGeneral,
+    };
+    vk::DescriptorImageInfo triangleIdDescriptorImageInfo = {
+        {},
+        _triangleIdImg.getImageView(),
+        vk::ImageLayout::eGeneral,
+    };
     vk::WriteDescriptorSet writeDescriptorSets[] = {
         {
             _rtDescriptorSet.get(),
@@ -659,45 +1623,230 @@ void HVRTRenderPass::vulkanCreateFramebuffer() {
             nullptr,
             nullptr,
         },
-    };
-    _vkbi.device.updateDescriptorSets(4, writeDescriptorSets, 0, nullptr);
-}
-
-void HVRTRenderPass::vulkanDraw() {
-
-    // Wait on any remaining work.
-
-    _vkbi.device.waitForFences(1, &_renderDoneFence.get(), true, std::numeric_limits<uint64_t>::max());
-    _vkbi.device.resetFences(1, &_renderDoneFence.get());
-
-    // Prepare for AS rebuilds: reallocate TLAS, resize scratch buffer, resize instance buffer, etc..
-
-    std::vector<vk::AccelerationStructureInstanceKHR> instances(_meshes.size());
-    bool asChanged = false;
-    uint64_t minScratchMemorySize = 0;
-    size_t i = 0;
-    for (HVRTMesh* mesh : _meshes) {
-
-        bool meshInstanceChanged;
-        uint64_t meshScratchMemorySize;
-        mesh->getASBuildInfo(&meshInstanceChanged, &instances[i], &meshScratchMemorySize);
-
-        asChanged |= meshInstanceChanged;
-        minScratchMemorySize = std::max(minScratchMemorySize, meshScratchMemorySize);
-
-        i++;
-    }
-
-    if (_maxTlasInstances < instances.size()) {
-        _maxTlasInstances = instances.size();
-
-        // Re-allocate the TLAS and update the descriptor.
-        _tlas.allocateTopLevel(_maxTlasInstances);
-        vk::WriteDescriptorSet writeDescriptorSets[] = {
-            {
-                _rtDescriptorSet.get(),
-                0,
-                0,
+        {
+            _rtDescriptorSet.get(),
+            6,
+            0,
+            1,
+            vk::DescriptorType::eStorageImage,
+            &sampleStatsDescriptorImageInfo,
+            nullptr,
+            nullptr,
+        },
+        {
+            _rtDescriptorSet.get(),
+            7,
+            0,
+            1,
+            vk::DescriptorType::eStorageImage,
+            &sampleCountDescriptorImageInfo,
+            nullptr,
+            nullptr,
+        },
+        {
+            _rtDescriptorSet.get(),
+            10,
+            0,
+            1,
+            vk::DescriptorType::eStorageImage,
+            &motionDescriptorImageInfo,
+            nullptr,
+            nullptr,
+        },
+        {
+            _rtDescriptorSet.get(),
+            11,
+            0,
+            1,
+            vk::DescriptorType::eStorageImage,
+            &historyWorldPositionDescriptorImageInfo,
+            nullptr,
+            nullptr,
+        },
+        {
+            _rtDescriptorSet.get(),
+            12,
+            0,
+            1,
+            vk::DescriptorType::eStorageImage,
+            &historyWorldNormalDescriptorImageInfo,
+            nullptr,
+            nullptr,
+        },
+        {
+            _rtDescriptorSet.get(),
+            13,
+            0,
+            1,
+            vk::DescriptorType::eStorageImage,
+            &historyColorDescriptorImageInfo,
+            nullptr,
+            nullptr,
+        },
+        {
+            _rtDescriptorSet.get(),
+            14,
+            0,
+            1,
+            vk::DescriptorType::eStorageImage,
+            &historySampleStatsDescriptorImageInfo,
+            nullptr,
+            nullptr,
+        },
+        {
+            _rtDescriptorSet.get(),
+            15,
+            0,
+            1,
+            vk::DescriptorType::eStorageImage,
+            &sparseLightingDescriptorImageInfo,
+            nullptr,
+            nullptr,
+        },
+        {
+            _rtDescriptorSet.get(),
+            17,
+            0,
+            1,
+            vk::DescriptorType::eStorageImage,
+            &reservoirDescriptorImageInfo,
+            nullptr,
+            nullptr,
+        },
+        {
+            _rtDescriptorSet.get(),
+            18,
+            0,
+            1,
+            vk::DescriptorType::eStorageImage,
+            &spatialReservoirDescriptorImageInfo,
+            nullptr,
+            nullptr,
+        },
+        {
+            _rtDescriptorSet.get(),
+            19,
+            0,
+            1,
+            vk::DescriptorType::eStorageImage,
+            &historyReservoirDescriptorImageInfo,
+            nullptr,
+            nullptr,
+        },
+        {
+            _rtDescriptorSet.get(),
+            31,
+            0,
+            1,
+            vk::DescriptorType::eStorageImage,
+            &triangleIdDescriptorImageInfo,
+            nullptr,
+            nullptr,
+        },
+    };
+    _vkbi.device.updateDescriptorSets(16, writeDescriptorSets, 0, nullptr);
+}
+
+void HVRTRenderPass::vulkanDraw() {
+
+    // Wait on any remaining work.
+
+    _vkbi.device.waitForFences(1, &_renderDoneFence.get(), true, std::numeric_limits<uint64_t>::max());
+    _vkbi.device.resetFences(1, &_renderDoneFence.get());
+
+    // Now that last frame's AS builds are done, any newly built ones can be saved to the AS cache.
+
+    _asCache.update();
+
+    // Last frame's path tracing counters are final too. Paths don't trace a fixed number of rays, so
+    // the RT pass's ray count comes from them instead of an estimate.
+
+    if (_pathTraced) {
+        const PathCounters& counters = *reinterpret_cast<PathCounters*>(_pathCountersBuffer.data());
+        _rtRaysLaunched = counters.rays;
+        _pathsLaunched = counters.paths;
+        for (int i = 0; i <= MAX_PATH_BOUNCES; i++) {
+            setInt("stats_pathBounces_" + std::to_string(i), counters.bounceHistogram[i]);
+        }
+        _pathTraced = false;
+    }
+
+    // Last frame's RT pass is done too, so its timestamps can be read back.
+
+    if (_rtRaysLaunched > 0) {
+        uint64_t timestamps[2];
+        _vkbi.device.getQueryPoolResults(
+            _rtTimestampQueryPool.get(),
+            0,
+            2,
+            sizeof(timestamps),
+            timestamps,
+            sizeof(uint64_t),
+            vk::QueryResultFlagBits::e64);
+        double seconds = double(timestamps[1] - timestamps[0]) * _rtTimestampPeriod * 1e-9;
+        setFloat("stats_rtPassMs", seconds * 1e3);
+        if (seconds > 0.0) setFloat("stats_mraysPerSecond", _rtRaysLaunched / seconds * 1e-6);
+        setFloat("stats_mpathsPerSecond", seconds > 0.0 ? _pathsLaunched / seconds * 1e-6 : 0.0);
+        _rtRaysLaunched = 0;
+        _pathsLaunched = 0;
+    }
+    _denoiser.updateStats();
+
+    // If last frame's adaptive sampling pass gave every pixel zero rays, the image is as converged
+    // as it's going to get, unless accumulation has since started over.
+
+    _adaptiveConverged =
+        _adaptiveSampled
+        && _accumulateFrame > 0
+        && *reinterpret_cast<uint32_t*>(_unconvergedCountBuffer.data()) == 0;
+    _adaptiveSampled = false;
+
+    // Merge small static meshes into batches, then assign each batch and each remaining mesh
+    // cluster a slot in the TLAS instance buffer. Slots are kept stable across frames so only
+    // instances which actually changed need to be re-written, but if the set of meshes, their
+    // clusters, or the batches changed at all we just re-assign all of them.
+
+    bool instanceSetChanged = _staticBatcher.update(_meshes);
+    instanceSetChanged |= (_tlasMeshNumClusters.size() != _meshes.size());
+    if (!instanceSetChanged) {
+        for (HVRTMesh* mesh : _meshes) {
+            auto it = _tlasMeshNumClusters.find(mesh);
+            if (it == _tlasMeshNumClusters.end() || it->second != mesh->getNumClusters()) {
+                instanceSetChanged = true;
+                break;
+            }
+        }
+    }
+    if (instanceSetChanged) {
+        _tlasInstances.clear();
+        _tlasMeshNumClusters.clear();
+        for (StaticBatch& batch : _staticBatcher.getBatches()) {
+            _tlasInstances.push_back({ nullptr, 0, &batch });
+        }
+        for (HVRTMesh* mesh : _meshes) {
+            if (!_staticBatcher.isBatched(mesh)) {
+                for (size_t clusterI = 0; clusterI < mesh->getNumClusters(); clusterI++) {
+                    _tlasInstances.push_back({ mesh, clusterI, nullptr });
+                }
+            }
+            _tlasMeshNumClusters[mesh] = mesh->getNumClusters();
+        }
+    }
+    uint32_t numInstances = _tlasInstances.size();
+
+    // Prepare for AS rebuilds: reallocate TLAS, resize scratch buffer, resize instance buffer, etc..
+
+    if (_maxTlasInstances < numInstances) {
+        _maxTlasInstances = numInstances;
+
+        // Re-allocate the TLAS and update the descriptor.
+        _tlas.allocateTopLevel(_maxTlasInstances);
+        _tlasBuilt = false;
+        vk::WriteDescriptorSet writeDescriptorSets[] = {
+            {
+                _rtDescriptorSet.get(),
+                0,
+                0,
                 1,
                 vk::DescriptorType::eAccelerationStructureKHR,
                 nullptr,
@@ -717,155 +1866,207 @@ void HVRTRenderPass::vulkanDraw() {
             vk::BufferUsageFlagBits::eRayTracingKHR
             | vk::BufferUsageFlagBits::eShaderDeviceAddress);
     }
-    minScratchMemorySize = std::max(
-        minScratchMemorySize,
-        _tlas.getScratchMemorySize());
 
-    if (_scratchBuffers[0].size() < minScratchMemorySize) {
-        for (int i = 0; i < 3; i++) {
-            _scratchBuffers[i].allocate(
-                minScratchMemorySize,
-                false,
-                vk::BufferUsageFlagBits::eRayTracingKHR
-                | vk::BufferUsageFlagBits::eShaderDeviceAddress);
+    // The previous frame's TLAS build has finished by now, so we're free to write to the instance
+    // buffer directly.
+    vk::AccelerationStructureInstanceKHR* instances =
+        reinterpret_cast<vk::AccelerationStructureInstanceKHR*>(_instanceBuffer.data());
+    bool blasChanged = false;
+    bool instancesChanged = false;
+    bool blasReallocated = false;
+    _blasScheduler.clear();
+    uint32_t firstPathGeometry = 0;
+    for (uint32_t slot = 0; slot < numInstances; slot++) {
+
+        bool meshBlasChanged;
+        bool meshInstanceChanged;
+        bool meshBlasReallocated;
+        vk::AccelerationStructureInstanceKHR instance;
+        uint64_t meshScratchMemorySize;
+        const BlasInstance& blasInstance = _tlasInstances[slot];
+        blasInstance.getASBuildInfo(
+            &meshBlasChanged,
+            &meshInstanceChanged,
+            &meshBlasReallocated,
+            &instance,
+            &meshScratchMemorySize);
+
+        // Geometries only move around the path geometry table when the instance set changes.
+        instance.instanceCustomIndex = firstPathGeometry;
+        firstPathGeometry += blasInstance.getNumGeometries();
+
+        if (meshInstanceChanged || instanceSetChanged || !_tlasBuilt) {
+            instances[slot] = instance;
         }
+
+        if (meshBlasChanged) {
+            _blasScheduler.addJob(
+                blasInstance,
+                blasInstance.getNumTriangles(),
+                meshScratchMemorySize);
+        }
+
+        blasChanged |= meshBlasChanged;
+        instancesChanged |= meshInstanceChanged;
+        blasReallocated |= meshBlasReallocated;
+    }
+
+    // Path tracing's buffers are only allocated once it's used, since they're large. The radiance
+    // cache's closest hits look up surfaces in the path geometry table too.
+
+    bool pathTracing = usePathTracing();
+    if (pathTracing && _pathBuffersExtent != _renderExtent) vulkanAllocatePathBuffers();
+    bool radianceCache = useRadianceCache();
+    if (radianceCache) updateRadianceCacheSize();
+    if (pathTracing || radianceCache) updatePathGeometry();
+
+    // The table's descriptor may be rewritten, so it's filled before any command buffer binds it.
+    if (_visibilityBuffer) updateDrawGeometry();
+
+    // Only clusters which need building are scheduled, so the scratch pool just needs to fit the
+    // builds of this frame. The TLAS build runs after all BLAS builds, so re-uses the pool too.
+
+    size_t numComputeQueues = _vkbi.computeQueues.size();
+    uint64_t scratchBudget = uint64_t(std::max(getInt("scratchBudgetMB", 256), 1)) * 1024 * 1024;
+    _blasScheduler.schedule(numComputeQueues, scratchBudget);
+
+    uint64_t minScratchMemorySize =
+        std::max(_blasScheduler.getScratchMemorySize(), _tlas.getScratchMemorySize());
+
+    // Shrink the pool back down again after any builds which needed more than the budget.
+    if (_scratchBuffer.size() < minScratchMemorySize
+        || _scratchBuffer.size() > std::max(minScratchMemorySize, scratchBudget))
+    {
+        _scratchBuffer.allocate(
+            minScratchMemorySize,
+            false,
+            vk::BufferUsageFlagBits::eRayTracingKHR
+            | vk::BufferUsageFlagBits::eShaderDeviceAddress);
     }
 
+    // The TLAS can be refit in place as long as the instance count and BLAS references are the same
+    // as when it was last fully built. Changed BLAS references could be refit too, but would
+    // degrade quality much faster than moving instances does.
+
+    bool asChanged =
+        _maxTlasInstances > 0
+        && (instanceSetChanged || blasChanged || instancesChanged || !_tlasBuilt);
+    bool tlasUpdate =
+        _tlasBuilt
+        && !instanceSetChanged
+        && !blasReallocated
+        && _tlasUpdateCount < TLAS_MAX_CONSECUTIVE_UPDATES;
+
     // Build RT acceleration structure.
 
     if (asChanged) {
 
         _accumulateFrame = 0;
 
-        // Build bottom-level AS.
+        // Whatever the radiance cache saw may have moved.
+        _radianceCacheMustClear = true;
 
-        for (int i = 0; i < 3; i++) {
-            _blasBuildCommandBuffers[i]->begin(
-                { vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr });
-        }
+        // Build bottom-level AS. Each queue records each wave of its builds as a single batch,
+        // which needs no barriers since every build in it has its own scratch range. Any host
+        // builds in a batch are run right away, which is fine since nothing on the device is
+        // using the ASes at this point.
 
-        {
-            int i = 0;
-            for (HVRTMesh* mesh : _meshes) {
-                int queueI = i % 3;
-                mesh->buildAS(_blasBuildCommandBuffers[queueI].get(), _scratchBuffers[queueI]);
-                vk::MemoryBarrier barrier = {
-                    .srcAccessMask = vk::AccessFlagBits::eAccelerationStructureWriteKHR,
-                    .dstAccessMask = vk::AccessFlagBits::eAccelerationStructureReadKHR,
-                };
-                _blasBuildCommandBuffers[queueI]->pipelineBarrier(
-                    vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
-                    vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
-                    vk::DependencyFlags(),
-                    1, &barrier,
-                    0, nullptr,
-                    0, nullptr);
-                i++;
-            }
-        }
+        vk::MemoryBarrier scratchBarrier = {
+            .srcAccessMask = vk::AccessFlagBits::eAccelerationStructureWriteKHR,
+            .dstAccessMask =
+                vk::AccessFlagBits::eAccelerationStructureReadKHR
+                | vk::AccessFlagBits::eAccelerationStructureWriteKHR,
+        };
 
-        for (int i = 0; i < 3; i++) {
+        std::vector<vk::Semaphore> blasBuildDoneSemaphores;
+        for (size_t queueI = 0; queueI < numComputeQueues; queueI++) {
+
+            const std::vector<BlasScheduler::Job>& jobs = _blasScheduler.getQueueJobs(queueI);
+            if (jobs.empty()) continue;
+
+            vk::CommandBuffer& commandBuffer = _blasBuildCommandBuffers[queueI].get();
+            commandBuffer.begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr });
+
+            VulkanAccelerationStructureBuildBatch batch(_vkbi);
+            vk::DeviceAddress scratchAddress = _scratchBuffer.getDeviceAddress();
+            for (size_t jobI = 0; jobI < jobs.size(); jobI++) {
+
+                const BlasScheduler::Job& job = jobs[jobI];
+
+                // The next wave re-uses this wave's scratch memory.
+                if (jobI > 0 && job.wave != jobs[jobI - 1].wave) {
+                    batch.buildOnHost();
+                    batch.record(commandBuffer);
+                    batch.clear();
+                    commandBuffer.pipelineBarrier(
+                        vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                        vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                        vk::DependencyFlags(),
+                        1, &scratchBarrier,
+                        0, nullptr,
+                        0, nullptr);
+                }
+
+                job.blasInstance.buildAS(batch, scratchAddress + job.scratchOffset);
+            }
+            batch.buildOnHost();
+            batch.record(commandBuffer);
 
-            _blasBuildCommandBuffers[i]->end();
+            commandBuffer.end();
 
             vk::SubmitInfo submitInfo(
                 0, nullptr, nullptr,
-                1, &_blasBuildCommandBuffers[i].get(),
-                1, &_blasBuildDoneSemaphores[i].get());
-            _vkbi.computeQueues[i].submit(1, &submitInfo, vk::Fence());
+                1, &commandBuffer,
+                1, &_blasBuildDoneSemaphores[queueI].get());
+            _vkbi.computeQueues[queueI].submit(1, &submitInfo, vk::Fence());
+
+            blasBuildDoneSemaphores.push_back(_blasBuildDoneSemaphores[queueI].get());
         }
 
         // Build top-level AS.
 
-        std::memcpy(
-            _instanceBuffer.data(),
-            instances.data(),
-            instances.size() * sizeof(vk::AccelerationStructureInstanceKHR));
-
         _tlasBuildCommandBuffer->begin(
             vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr));
         _tlas.buildTopLevel(
             _tlasBuildCommandBuffer.get(),
-            _scratchBuffers[0],
-            instances.size(),
-            _instanceBuffer);
+            _scratchBuffer,
+            numInstances,
+            _instanceBuffer,
+            tlasUpdate);
         _tlasBuildCommandBuffer->end();
 
+        if (tlasUpdate) {
+            _tlasUpdateCount++;
+        } else {
+            _tlasBuilt = true;
+            _tlasUpdateCount = 0;
+        }
+
         {
-            vk::PipelineStageFlags waitStages[] = {
-                vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
-                vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
-                vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
-            };
-            vk::Semaphore waitSemaphores[] = {
-                _blasBuildDoneSemaphores[0].get(),
-                _blasBuildDoneSemaphores[1].get(),
-                _blasBuildDoneSemaphores[2].get(),
-            };
+            std::vector<vk::PipelineStageFlags> waitStages(
+                blasBuildDoneSemaphores.size(),
+                vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR);
             vk::SubmitInfo submitInfo(
-                3, waitSemaphores, waitStages,
+                blasBuildDoneSemaphores.size(), blasBuildDoneSemaphores.data(), waitStages.data(),
                 1, &_tlasBuildCommandBuffer.get(),
                 1, &_tlasBuildDoneSemaphore.get());
             _vkbi.computeQueues[0].submit(1, &submitInfo, vk::Fence());
         }
     }
 
-    // Rasterization pass.
-
-    {
-        _rasterizeCommandBuffer->begin(
-            vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr));
-
-        vk::ClearValue clearValues[] = {
-            vk::ClearColorValue(std::array<float, 4>{ 0.1f, 0.1f, 0.1f, 1.0f }),
-            vk::ClearColorValue(std::array<float, 4>{ 0.0f, 0.0f, 0.0f, 0.0f }),
-            vk::ClearColorValue(std::array<float, 4>{ 0.0f, 0.0f, 0.0f, 0.0f }),
-            vk::ClearDepthStencilValue(1.0f, 0.0f)
-        };
-        _rasterizeCommandBuffer->beginRenderPass(
-            vk::RenderPassBeginInfo(
-                _renderPass.get(),
-                _outputFramebuffer.get(),
-                vk::Rect2D({0, 0}, _viewportExtent),
-                4,
-                clearValues),
-            vk::SubpassContents::eInline);
-
-        _rasterizeCommandBuffer->bindPipeline(vk::PipelineBindPoint::eGraphics, _pipeline.get());
-        pxr::GfMatrix4f worldToNdc =
-            pxr::GfMatrix4f(_worldToView * _viewToNdc)
-            * VK_TO_GL_DEPTH_CORRECTION_MATRIX;
-        for (HVRTMesh* mesh : _meshes) {
-            mesh->draw(_rasterizeCommandBuffer, _pipelineLayout, worldToNdc);
-        }
-
-        _rasterizeCommandBuffer->endRenderPass();
-
-        _rasterizeCommandBuffer->end();
-
-        // Submit the draw work.
-
-        vk::PipelineStageFlags waitStage = vk::PipelineStageFlagBits::eColorAttachmentOutput;
+    // Update light buffers, which the ray tracing pass or forward mode's raster pass will read.
 
-        vk::SubmitInfo submitInfo(
-            _firstRender ? 0 : 1, &_blitDoneSemaphore.get(), &waitStage,
-            1, &_rasterizeCommandBuffer.get(),
-            1, &_rasterDoneSemaphore.get());
-        _vkbi.graphicsQueue.submit(1, &submitInfo, vk::Fence());
-    }
-
-    // Ray tracing pass.
+    updateLocalLights();
 
     {
-
-        // Update light buffer.
-        _lightData.numLights_padding = pxr::GfVec4i(getInt("numLights", 0), 0, 0, 0);
         _lightData.ambientLightIntensity_maxDistance = pxr::GfVec4f(
             0.3f,
             0.4f,
             0.7f,
             getFloat("ao_maxdist", 100.0f));
-        for (int i = 0; i < 10; i++) {
+
+        int numLights = std::clamp(getInt("numLights", 0), 0, 10);
+        for (int i = 0; i < numLights; i++) {
             std::string iStr = std::to_string(i);
             _lightData.lights[i] = LightData::Light(
                 getVec3("light_v_" + iStr, pxr::GfVec3f(0.0f, 0.0f, 1.0f)).GetNormalized(),
@@ -873,20 +2074,56 @@ void HVRTRenderPass::vulkanDraw() {
                 getVec3("light_intensity_" + iStr, pxr::GfVec3f(1.0f)),
                 (bool) getInt("light_raytraced_" + iStr, 1));
         }
+        for (const LightData::Light& light : _distantLights) {
+            if (numLights == MAX_DIRECTIONAL_LIGHTS) break;
+            _lightData.lights[numLights++] = light;
+        }
+
+        updateEnvironment();
+
+        _lightData.numLights_numLocalLights_localLightSamples_padding = pxr::GfVec4i(
+            numLights,
+            _numLocalLights,
+            std::max(getInt("localLightSamples", 1), 1),
+            0);
+
         std::memcpy(
             _lightBuffer.data(),
             &_lightData,
             sizeof(LightData));
+    }
 
-        _raytraceCommandBuffer->begin(
+    // Forward mode can shade static meshes with AO baked into their vertices, which only has to be
+    // traced again when something near them changes.
+
+    bool bakedAO = useBakedAO();
+    uint64_t aoBakeRays = updateBakedAO();
+    uint32_t aoBakeSamples = uint32_t(std::max(getInt("aoBakeSamples", 256), 1));
+
+    // ReSTIR's temporal reuse needs last frame's reservoirs, which are saved with the rest of the
+    // history.
+
+    bool restir = useRestir();
+    bool restirTemporal = restir && _restirHistoryValid;
+
+    // Rasterization pass. In forward mode this also shades, and is the last pass.
+
+    {
+        _rasterizeCommandBuffer->begin(
             vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr));
 
-        if (_mustTransitionOutputColor) {
+        _rasterizeCommandBuffer->resetQueryPool(_frameTimestampQueryPool.get(), 0, 4);
+        _rasterizeCommandBuffer->writeTimestamp(
+            vk::PipelineStageFlagBits::eTopOfPipe,
+            _frameTimestampQueryPool.get(),
+            0);
+
+        if (_forward && _mustTransitionOutputColor) {
 
-            // Transition output color image from eUndefined to eGeneral so we can store to it.
+            // Transition output color image from eUndefined to eGeneral so we can draw to it.
             vk::ImageMemoryBarrier barrier = {
                 .srcAccessMask = vk::AccessFlags(),
-                .dstAccessMask = vk::AccessFlagBits::eShaderWrite,
+                .dstAccessMask = vk::AccessFlagBits::eColorAttachmentRead | vk::AccessFlagBits::eColorAttachmentWrite,
                 .oldLayout = vk::ImageLayout::eUndefined,
                 .newLayout = vk::ImageLayout::eGeneral,
                 .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
@@ -894,9 +2131,9 @@ void HVRTRenderPass::vulkanDraw() {
                 .image = _outputColorImg.getImage(),
                 .subresourceRange = { vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 },
             };
-            _raytraceCommandBuffer->pipelineBarrier(
+            _rasterizeCommandBuffer->pipelineBarrier(
                 vk::PipelineStageFlagBits::eTopOfPipe,
-                vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                vk::PipelineStageFlagBits::eColorAttachmentOutput,
                 vk::DependencyFlags(),
                 0, nullptr,
                 0, nullptr,
@@ -905,59 +2142,668 @@ void HVRTRenderPass::vulkanDraw() {
             _mustTransitionOutputColor = false;
         }
 
-        _raytraceCommandBuffer->bindPipeline(
-            vk::PipelineBindPoint::eRayTracingKHR,
-            _rtPipeline.get());
-        _raytraceCommandBuffer->bindDescriptorSets(
-            vk::PipelineBindPoint::eRayTracingKHR,
-            _rtPipelineLayout.get(),
-            0,
-            { _rtDescriptorSet.get() },
-            {});
+        // Save last frame's G-buffer, accumulation and reservoirs before they're overwritten, for
+        // reprojection and ReSTIR. There's nothing to save before the first RT pass.
 
-        if (getInt("converge", 0) == 0) _accumulateFrame = 0;
-        RTPushConstants rtPushConstants = {
-            pxr::GfMatrix4f((_worldToView * _viewToNdc).GetInverse()),
-            pxr::GfVec3f(_worldToView.GetInverse().Transform(pxr::GfVec3d(0.0f))),
-            _accumulateFrame,
-            getInt("aoRaysPerFrame", 1),
-        };
-        _accumulateFrame++;
-        _raytraceCommandBuffer->pushConstants(
-            _rtPipelineLayout.get(),
-            vk::ShaderStageFlagBits::eRaygenKHR,
-            0,
-            sizeof(RTPushConstants),
-            reinterpret_cast<void*>(&rtPushConstants));
-
-        vk::PhysicalDeviceProperties2 properties;
-        vk::PhysicalDeviceRayTracingPropertiesKHR rtProperties;
-        properties.pNext = &rtProperties;
-        _vkbi.physicalDevice.getProperties2(&properties);
-        vk::DeviceSize programSize = rtProperties.shaderGroupBaseAlignment;
-
-        _raytraceCommandBuffer->traceRaysKHR(
-            { _sbtBuffer.getBuffer(), 0 * programSize, programSize, programSize },
-            { _sbtBuffer.getBuffer(), 1 * programSize, programSize, programSize },
-            { _sbtBuffer.getBuffer(), 2 * programSize, programSize, programSize },
-            { _sbtBuffer.getBuffer(), 0, 0, 0 },
-            _viewportExtent.width,
-            _viewportExtent.height,
-            1,
-            _vkbi.dispatchLoader);
+        if (!_mustTransitionOutputColor && (canReproject() || restirTemporal)) {
 
-        _raytraceCommandBuffer->end();
+            vk::MemoryBarrier historyReadBarrier = {
+                .srcAccessMask = vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eShaderWrite,
+                .dstAccessMask = vk::AccessFlagBits::eTransferRead | vk::AccessFlagBits::eTransferWrite,
+            };
+            _rasterizeCommandBuffer->pipelineBarrier(
+                vk::PipelineStageFlagBits::eColorAttachmentOutput
+                | vk::PipelineStageFlagBits::eRayTracingShaderKHR
+                | vk::PipelineStageFlagBits::eComputeShader,
+                vk::PipelineStageFlagBits::eTransfer,
+                vk::DependencyFlags(),
+                1, &historyReadBarrier,
+                0, nullptr,
+                0, nullptr);
+
+            vk::ImageCopy region = {
+                { vk::ImageAspectFlagBits::eColor, 0, 0, 1 },
+                { 0, 0, 0 },
+                { vk::ImageAspectFlagBits::eColor, 0, 0, 1 },
+                { 0, 0, 0 },
+                { _renderExtent.width, _renderExtent.height, 1 },
+            };
+            std::vector<std::pair<VulkanImage*, VulkanImage*>> copies = {
+                { &_worldPositionImg, &_historyWorldPositionImg },
+                { &_worldNormalImg, &_historyWorldNormalImg },
+                { &_outputColorImg, &_historyColorImg },
+                { &_sampleStatsImg, &_historySampleStatsImg },
+            };
+            if (restirTemporal) copies.push_back({ &_spatialReservoirImg, &_historyReservoirImg });
+            for (auto [src, dst] : copies) {
+                _rasterizeCommandBuffer->copyImage(
+                    src->getImage(),
+                    vk::ImageLayout::eGeneral,
+                    dst->getImage(),
+                    vk::ImageLayout::eGeneral,
+                    1,
+                    &region);
+            }
 
-        // Submit the draw work.
+            // The G-buffer can't be cleared until it's been copied. The RT pass waits on this whole
+            // submission, so reading the copies needs nothing more.
+            _rasterizeCommandBuffer->pipelineBarrier(
+                vk::PipelineStageFlagBits::eTransfer,
+                vk::PipelineStageFlagBits::eColorAttachmentOutput,
+                vk::DependencyFlags(),
+                0, nullptr,
+                0, nullptr,
+                0, nullptr);
+        }
 
-        vk::Semaphore waitSemaphores[2];
+        if (_forward) {
+            _rasterizeCommandBuffer->resetQueryPool(_rtTimestampQueryPool.get(), 0, 2);
+            _rasterizeCommandBuffer->writeTimestamp(
+                vk::PipelineStageFlagBits::eTopOfPipe,
+                _rtTimestampQueryPool.get(),
+                0);
+
+            if (aoBakeRays > 0) recordBakeAO();
+        }
+
+        vk::ClearValue clearValues[] = {
+            vk::ClearColorValue(std::array<float, 4>{ 0.1f, 0.1f, 0.1f, 1.0f }),
+            vk::ClearColorValue(std::array<float, 4>{ 0.0f, 0.0f, 0.0f, 0.0f }),
+            vk::ClearColorValue(std::array<float, 4>{ 0.0f, 0.0f, 0.0f, 0.0f }),
+            vk::ClearColorValue(std::array<float, 4>{ 0.0f, 0.0f, 0.0f, 0.0f }),
+            vk::ClearDepthStencilValue(1.0f, 0.0f)
+        };
+        vk::ClearValue forwardClearValues[] = {
+            vk::ClearColorValue(std::array<float, 4>{ 0.0f, 0.0f, 0.0f, 1.0f }),
+            vk::ClearDepthStencilValue(1.0f, 0.0f)
+        };
+        vk::ClearValue visibilityClearValues[] = {
+            vk::ClearColorValue(std::array<uint32_t, 4>{ VISIBILITY_BACKGROUND, 0, 0, 0 }),
+            vk::ClearDepthStencilValue(1.0f, 0.0f)
+        };
+        vk::RenderPassBeginInfo renderPassBeginInfo(
+            getRasterRenderPass(),
+            _outputFramebuffer.get(),
+            vk::Rect2D({0, 0}, _renderExtent),
+            5,
+            clearValues);
+        if (_forward) {
+            renderPassBeginInfo.setClearValueCount(2).setPClearValues(forwardClearValues);
+        } else if (_visibilityBuffer) {
+            renderPassBeginInfo.setClearValueCount(2).setPClearValues(visibilityClearValues);
+        }
+        _rasterizeCommandBuffer->beginRenderPass(renderPassBeginInfo, vk::SubpassContents::eInline);
+
+        _rasterizeCommandBuffer->bindPipeline(vk::PipelineBindPoint::eGraphics, _pipeline.get());
+
+        _rasterizeCommandBuffer->bindDescriptorSets(
+            vk::PipelineBindPoint::eGraphics,
+            _pipelineLayout.get(),
+            0,
+            { _rtDescriptorSet.get() },
+            {});
+
+        if (_forward) {
+
+            if (getInt("converge", 0) == 0) _accumulateFrame = 0;
+
+            // The output is loaded rather than cleared so frames can accumulate, but background
+            // pixels are never drawn so it still has to be cleared when starting over.
+            if (_accumulateFrame == 0) {
+                vk::ClearAttachment clearAttachment = {
+                    vk::ImageAspectFlagBits::eColor,
+                    0,
+                    forwardClearValues[0],
+                };
+                vk::ClearRect clearRect = { vk::Rect2D({0, 0}, _renderExtent), 0, 1 };
+                _rasterizeCommandBuffer->clearAttachments(1, &clearAttachment, 1, &clearRect);
+            }
+
+            float accumulateWeight = 1.0f / (_accumulateFrame + 1);
+            float blendConstants[] = { accumulateWeight, accumulateWeight, accumulateWeight, accumulateWeight };
+            _rasterizeCommandBuffer->setBlendConstants(blendConstants);
+
+            ForwardPushConstants forwardPushConstants = {
+                _accumulateFrame,
+                getAoRaysPerFrame(),
+                getSampler("forward"),
+            };
+            _accumulateFrame++;
+            _rasterizeCommandBuffer->pushConstants(
+                _pipelineLayout.get(),
+                vk::ShaderStageFlagBits::eFragment,
+                FORWARD_PUSH_CONSTANTS_OFFSET,
+                sizeof(ForwardPushConstants),
+                reinterpret_cast<void*>(&forwardPushConstants));
+
+            // Overdrawn fragments trace rays too, unless early depth testing rejects them. Once every
+            // mesh is baked, none of them trace AO rays.
+            _rtRaysLaunched = aoBakeRays + estimateRaysPerFrame(
+                _renderExtent,
+                (bakedAO && !_aoBaking) ? 0 : forwardPushConstants.aoRaysPerFrame,
+                false,
+                0);
+        }
+
+        pxr::GfMatrix4f worldToNdc =
+            pxr::GfMatrix4f(_worldToView * _viewToNdc)
+            * VK_TO_GL_DEPTH_CORRECTION_MATRIX;
+        CameraData cameraData = {
+            worldToNdc,
+            _drawnWorldToNdc.value_or(worldToNdc),
+        };
+        std::memcpy(
+            _cameraBuffer.data(),
+            &cameraData,
+            sizeof(CameraData));
+        _drawnWorldToNdc = worldToNdc;
+
+        // Meshes are drawn in the same order as the draw geometry table, so the visibility buffer's
+        // draw indices are just their position in it.
+        uint32_t drawIndex = 0;
+        for (HVRTMesh* mesh : _meshes) {
+            if (_visibilityBuffer) {
+                VisibilityPushConstants visibilityPushConstants = { drawIndex++ };
+                _rasterizeCommandBuffer->pushConstants(
+                    _pipelineLayout.get(),
+                    vk::ShaderStageFlagBits::eFragment,
+                    FORWARD_PUSH_CONSTANTS_OFFSET,
+                    sizeof(VisibilityPushConstants),
+                    reinterpret_cast<void*>(&visibilityPushConstants));
+            }
+            mesh->draw(
+                _rasterizeCommandBuffer,
+                _pipelineLayout,
+                bakedAO && mesh->getBakedAOSamples() >= aoBakeSamples);
+        }
+
+        _rasterizeCommandBuffer->endRenderPass();
+
+        if (_forward) {
+            _rasterizeCommandBuffer->writeTimestamp(
+                vk::PipelineStageFlagBits::eBottomOfPipe,
+                _rtTimestampQueryPool.get(),
+                1);
+
+            _upscaler.upscale(_rasterizeCommandBuffer);
+        }
+
+        _rasterizeCommandBuffer->writeTimestamp(
+            vk::PipelineStageFlagBits::eBottomOfPipe,
+            _frameTimestampQueryPool.get(),
+            1);
+
+        _rasterizeCommandBuffer->end();
+
+        // Submit the draw work. In forward mode it also has to wait for the TLAS, and finishes the
+        // frame.
+
+        std::vector<vk::Semaphore> waitSemaphores;
+        std::vector<vk::PipelineStageFlags> waitStages;
+        if (!_firstRender) {
+            waitSemaphores.push_back(_blitDoneSemaphore.get());
+            waitStages.push_back(vk::PipelineStageFlagBits::eColorAttachmentOutput);
+        }
+        if (_forward && asChanged) {
+            waitSemaphores.push_back(_tlasBuildDoneSemaphore.get());
+            waitStages.push_back(
+                vk::PipelineStageFlagBits::eComputeShader | vk::PipelineStageFlagBits::eFragmentShader);
+        }
+
+        vk::SubmitInfo submitInfo(
+            waitSemaphores.size(), waitSemaphores.data(), waitStages.data(),
+            1, &_rasterizeCommandBuffer.get(),
+            1, _forward ? &_renderDoneSemaphore.get() : &_rasterDoneSemaphore.get());
+        _vkbi.graphicsQueue.submit(1, &submitInfo, _forward ? _renderDoneFence.get() : vk::Fence());
+    }
+
+    // Ray tracing pass.
+
+    if (!_forward) {
+
+        _raytraceCommandBuffer->begin(
+            vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr));
+
+        _raytraceCommandBuffer->writeTimestamp(
+            vk::PipelineStageFlagBits::eTopOfPipe,
+            _frameTimestampQueryPool.get(),
+            2);
+
+        if (_mustTransitionOutputColor) {
+
+            // Transition output color, sampling and history images from eUndefined to eGeneral so
+            // we can store to them. So must whichever of the G-buffer and visibility buffer the raster
+            // pass didn't draw, since they're still bound.
+            std::vector<VulkanImage*> images = {
+                &_outputColorImg,
+                &_sampleStatsImg,
+                &_sampleCountImg,
+                &_historyWorldPositionImg,
+                &_historyWorldNormalImg,
+                &_historyColorImg,
+                &_historySampleStatsImg,
+                &_sparseLightingImg,
+                &_reservoirImg,
+                &_spatialReservoirImg,
+                &_historyReservoirImg,
+            };
+            if (_visibilityBuffer) {
+                images.insert(images.end(), { &_albedoImg, &_worldPositionImg, &_worldNormalImg, &_motionImg });
+            } else {
+                images.push_back(&_triangleIdImg);
+            }
+            std::vector<vk::ImageMemoryBarrier> barriers;
+            for (VulkanImage* image : images) {
+                barriers.push_back({
+                    .srcAccessMask = vk::AccessFlags(),
+                    .dstAccessMask = vk::AccessFlagBits::eShaderWrite,
+                    .oldLayout = vk::ImageLayout::eUndefined,
+                    .newLayout = vk::ImageLayout::eGeneral,
+                    .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                    .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                    .image = image->getImage(),
+                    .subresourceRange = { vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 },
+                });
+            }
+            _raytraceCommandBuffer->pipelineBarrier(
+                vk::PipelineStageFlagBits::eTopOfPipe,
+                vk::PipelineStageFlagBits::eRayTracingShaderKHR | vk::PipelineStageFlagBits::eComputeShader,
+                vk::DependencyFlags(),
+                0, nullptr,
+                0, nullptr,
+                barriers.size(), barriers.data());
+
+            _mustTransitionOutputColor = false;
+        }
+
+        bool useRayQuery = this->useRayQuery();
+
+        if (pathTracing || useRayQuery || _rtPipeline.isReady()) {
+
+            // Path tracing binds each of its stages itself.
+            if (!pathTracing) {
+                vk::PipelineBindPoint bindPoint =
+                    useRayQuery ? vk::PipelineBindPoint::eCompute : vk::PipelineBindPoint::eRayTracingKHR;
+                _raytraceCommandBuffer->bindPipeline(
+                    bindPoint,
+                    useRayQuery ? _rayQueryPipeline.get() : _rtPipeline.getPipeline());
+                _raytraceCommandBuffer->bindDescriptorSets(
+                    bindPoint,
+                    _rtPipelineLayout.get(),
+                    0,
+                    { _rtDescriptorSet.get() },
+                    {});
+            }
+
+            // The denoiser does its own accumulation, so the RT pass just leaves it the noisy frame. It
+            // filters with the G-buffer, so it can't run in visibility buffer mode.
+            bool denoise = !_visibilityBuffer && getInt("denoise", 0) != 0;
+
+            // Only main.rgen can trace at a reduced rate, and upsample.comp has to fill in every pixel
+            // from the G-buffer.
+            uint32_t traceRate = (useRayQuery || pathTracing || _visibilityBuffer)
+                ? TRACE_RATE_FULL
+                : uint32_t(std::clamp(getInt("traceRate", 0), 0, 2));
+            vk::Extent2D traceExtent = _renderExtent;
+            if (traceRate == TRACE_RATE_CHECKERBOARD) {
+                traceExtent.width = (_renderExtent.width + 1) / 2;
+            } else if (traceRate == TRACE_RATE_QUARTER) {
+                traceExtent = { (_renderExtent.width + 1) / 2, (_renderExtent.height + 1) / 2 };
+            }
+            setInt("stats_traceRate", traceRate);
+
+            // Adaptive sampling only makes sense while converging, and only main.rgen supports it.
+            // Skipped pixels would be counted again by the denoiser's accumulation, and upsampling
+            // doesn't know which pixels were skipped.
+            bool adaptive =
+                !useRayQuery
+                && !pathTracing
+                && !denoise
+                && traceRate == TRACE_RATE_FULL
+                && getInt("converge", 0) != 0
+                && getInt("adaptiveSampling", 0) != 0;
+
+            // The denoiser's history only starts over when the view changes, and it needs the
+            // samples to keep moving from frame to frame even when not converging.
+            if (getInt("converge", 0) == 0 && !denoise) _accumulateFrame = 0;
+            RTPushConstants rtPushConstants = {
+                pxr::GfMatrix4f((_worldToView * _viewToNdc).GetInverse()),
+                pxr::GfVec3f(_worldToView.GetInverse().Transform(pxr::GfVec3d(0.0f))),
+                _accumulateFrame,
+                getAoRaysPerFrame(),
+                getSampler(pathTracing ? "path" : "ao"),
+                adaptive ? getFloat("adaptiveThreshold", 0.02f) : 0.0f,
+                denoise ? 1u : 0u,
+                traceRate,
+                restir ? uint32_t(std::clamp(getInt("restirCandidates", 8), 1, 64)) : 0u,
+                _frameIndex,
+                radianceCache ? uint32_t(std::clamp(getInt("radianceCacheInterval", 16), 1, 256)) : 0u,
+                std::max(getFloat("radianceCacheScale", 0.02f), 1e-4f),
+                uint32_t(std::max(getInt("radianceCacheTTL", 60), 1)),
+                _visibilityBuffer ? 1u : 0u,
+            };
+            _accumulateFrame++;
+            _frameIndex++;
+            _raytraceCommandBuffer->pushConstants(
+                _rtPipelineLayout.get(),
+                vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eCompute,
+                0,
+                sizeof(RTPushConstants),
+                reinterpret_cast<void*>(&rtPushConstants));
+
+            _raytraceCommandBuffer->resetQueryPool(_rtTimestampQueryPool.get(), 0, 2);
+            _raytraceCommandBuffer->writeTimestamp(
+                vk::PipelineStageFlagBits::eTopOfPipe,
+                _rtTimestampQueryPool.get(),
+                0);
+
+            if (useRayQuery && !pathTracing) {
+                _raytraceCommandBuffer->dispatch(
+                    (_renderExtent.width + RAY_QUERY_TILE_SIZE - 1) / RAY_QUERY_TILE_SIZE,
+                    (_renderExtent.height + RAY_QUERY_TILE_SIZE - 1) / RAY_QUERY_TILE_SIZE,
+                    1);
+            } else {
+
+                if (canReproject() && !denoise && rtPushConstants.accumulateFrame > 0) {
+
+                    // Move the accumulation to where its surfaces are now.
+
+                    _raytraceCommandBuffer->bindPipeline(
+                        vk::PipelineBindPoint::eCompute,
+                        _reprojectPipeline.get());
+                    _raytraceCommandBuffer->bindDescriptorSets(
+                        vk::PipelineBindPoint::eCompute,
+                        _rtPipelineLayout.get(),
+                        0,
+                        { _rtDescriptorSet.get() },
+                        {});
+                    _raytraceCommandBuffer->dispatch(
+                        (_renderExtent.width + 7) / 8,
+                        (_renderExtent.height + 7) / 8,
+                        1);
+
+                    vk::MemoryBarrier reprojectBarrier = {
+                        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+                        .dstAccessMask = vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+                    };
+                    _raytraceCommandBuffer->pipelineBarrier(
+                        vk::PipelineStageFlagBits::eComputeShader,
+                        vk::PipelineStageFlagBits::eComputeShader | vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                        vk::DependencyFlags(),
+                        1, &reprojectBarrier,
+                        0, nullptr,
+                        0, nullptr);
+                }
+
+                if (restir) {
+
+                    // Pick each pixel's local light sample, reusing last frame's and then its
+                    // neighbors' picks. Without usable history, temporal reuse finds empty
+                    // reservoirs.
+
+                    if (!restirTemporal) {
+                        vk::ImageSubresourceRange range = { vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 };
+                        _raytraceCommandBuffer->clearColorImage(
+                            _historyReservoirImg.getImage(),
+                            vk::ImageLayout::eGeneral,
+                            vk::ClearColorValue(std::array<uint32_t, 4>{ 0, 0, 0, 0 }),
+                            range);
+                    }
+
+                    vk::MemoryBarrier historyBarrier = {
+                        .srcAccessMask = vk::AccessFlagBits::eTransferWrite | vk::AccessFlagBits::eShaderWrite,
+                        .dstAccessMask = vk::AccessFlagBits::eShaderRead,
+                    };
+                    _raytraceCommandBuffer->pipelineBarrier(
+                        vk::PipelineStageFlagBits::eTransfer | vk::PipelineStageFlagBits::eComputeShader,
+                        vk::PipelineStageFlagBits::eComputeShader,
+                        vk::DependencyFlags(),
+                        1, &historyBarrier,
+                        0, nullptr,
+                        0, nullptr);
+
+                    for (vk::Pipeline pipeline : { _restirTemporalPipeline.get(), _restirSpatialPipeline.get() }) {
+
+                        _raytraceCommandBuffer->bindPipeline(vk::PipelineBindPoint::eCompute, pipeline);
+                        _raytraceCommandBuffer->bindDescriptorSets(
+                            vk::PipelineBindPoint::eCompute,
+                            _rtPipelineLayout.get(),
+                            0,
+                            { _rtDescriptorSet.get() },
+                            {});
+                        _raytraceCommandBuffer->dispatch(
+                            (_renderExtent.width + 7) / 8,
+                            (_renderExtent.height + 7) / 8,
+                            1);
+
+                        vk::MemoryBarrier reservoirBarrier = {
+                            .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+                            .dstAccessMask = vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+                        };
+                        _raytraceCommandBuffer->pipelineBarrier(
+                            vk::PipelineStageFlagBits::eComputeShader,
+                            vk::PipelineStageFlagBits::eComputeShader | vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                            vk::DependencyFlags(),
+                            1, &reservoirBarrier,
+                            0, nullptr,
+                            0, nullptr);
+                    }
+                }
+
+                if (adaptive) {
+
+                    // Build the ray count map from the statistics last frame's rays left behind.
+
+                    *reinterpret_cast<uint32_t*>(_unconvergedCountBuffer.data()) = 0;
+
+                    vk::MemoryBarrier statsBarrier = {
+                        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+                        .dstAccessMask = vk::AccessFlagBits::eShaderRead,
+                    };
+                    _raytraceCommandBuffer->pipelineBarrier(
+                        vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                        vk::PipelineStageFlagBits::eComputeShader,
+                        vk::DependencyFlags(),
+                        1, &statsBarrier,
+                        0, nullptr,
+                        0, nullptr);
+
+                    _raytraceCommandBuffer->bindPipeline(
+                        vk::PipelineBindPoint::eCompute,
+                        _adaptivePipeline.get());
+                    _raytraceCommandBuffer->bindDescriptorSets(
+                        vk::PipelineBindPoint::eCompute,
+                        _rtPipelineLayout.get(),
+                        0,
+                        { _rtDescriptorSet.get() },
+                        {});
+                    _raytraceCommandBuffer->dispatch(
+                        (_renderExtent.width + 7) / 8,
+                        (_renderExtent.height + 7) / 8,
+                        1);
+
+                    vk::MemoryBarrier countBarrier = {
+                        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+                        .dstAccessMask = vk::AccessFlagBits::eShaderRead,
+                    };
+                    _raytraceCommandBuffer->pipelineBarrier(
+                        vk::PipelineStageFlagBits::eComputeShader,
+                        vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                        vk::DependencyFlags(),
+                        1, &countBarrier,
+                        0, nullptr,
+                        0, nullptr);
+
+                    _adaptiveSampled = true;
+                }
+
+                if (radianceCache && _radianceCacheMustClear) {
+
+                    _raytraceCommandBuffer->fillBuffer(_radianceCacheBuffer.getBuffer(), 0, VK_WHOLE_SIZE, 0);
+
+                    vk::MemoryBarrier clearBarrier = {
+                        .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
+                        .dstAccessMask = vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+                    };
+                    _raytraceCommandBuffer->pipelineBarrier(
+                        vk::PipelineStageFlagBits::eTransfer,
+                        vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                        vk::DependencyFlags(),
+                        1, &clearBarrier,
+                        0, nullptr,
+                        0, nullptr);
+
+                    _radianceCacheMustClear = false;
+                }
+
+                if (pathTracing) {
+                    recordPathTracing();
+                } else {
+                    _raytraceCommandBuffer->traceRaysKHR(
+                        _rtPipeline.getShaderBindingTableRegion(0),
+                        _rtPipeline.getShaderBindingTableRegion(1, 2),
+                        _rtPipeline.getShaderBindingTableRegion(3),
+                        {},
+                        traceExtent.width,
+                        traceExtent.height,
+                        1,
+                        _vkbi.dispatchLoader);
+                }
+
+                if (radianceCache) {
+
+                    // Blend this frame's samples into the cache, before next frame's rays read it.
+
+                    vk::MemoryBarrier samplesBarrier = {
+                        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+                        .dstAccessMask = vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+                    };
+                    _raytraceCommandBuffer->pipelineBarrier(
+                        vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                        vk::PipelineStageFlagBits::eComputeShader,
+                        vk::DependencyFlags(),
+                        1, &samplesBarrier,
+                        0, nullptr,
+                        0, nullptr);
+
+                    _raytraceCommandBuffer->bindPipeline(
+                        vk::PipelineBindPoint::eCompute,
+                        _radianceCacheResolvePipeline.get());
+                    _raytraceCommandBuffer->bindDescriptorSets(
+                        vk::PipelineBindPoint::eCompute,
+                        _rtPipelineLayout.get(),
+                        0,
+                        { _rtDescriptorSet.get() },
+                        {});
+                    uint64_t numCells = _radianceCacheBuffer.size() / sizeof(RadianceCacheCell);
+                    _raytraceCommandBuffer->dispatch(uint32_t((numCells + 255) / 256), 1, 1);
+
+                    vk::MemoryBarrier resolveBarrier = {
+                        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+                        .dstAccessMask = vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+                    };
+                    _raytraceCommandBuffer->pipelineBarrier(
+                        vk::PipelineStageFlagBits::eComputeShader,
+                        vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                        vk::DependencyFlags(),
+                        1, &resolveBarrier,
+                        0, nullptr,
+                        0, nullptr);
+                }
+
+                if (traceRate != TRACE_RATE_FULL) {
+
+                    vk::MemoryBarrier sparseLightingBarrier = {
+                        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+                        .dstAccessMask = vk::AccessFlagBits::eShaderRead,
+                    };
+                    _raytraceCommandBuffer->pipelineBarrier(
+                        vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                        vk::PipelineStageFlagBits::eComputeShader,
+                        vk::DependencyFlags(),
+                        1, &sparseLightingBarrier,
+                        0, nullptr,
+                        0, nullptr);
+
+                    _raytraceCommandBuffer->bindPipeline(
+                        vk::PipelineBindPoint::eCompute,
+                        _upsamplePipeline.get());
+                    _raytraceCommandBuffer->bindDescriptorSets(
+                        vk::PipelineBindPoint::eCompute,
+                        _rtPipelineLayout.get(),
+                        0,
+                        { _rtDescriptorSet.get() },
+                        {});
+                    _raytraceCommandBuffer->dispatch(
+                        (_renderExtent.width + 7) / 8,
+                        (_renderExtent.height + 7) / 8,
+                        1);
+                }
+            }
+
+            _raytraceCommandBuffer->writeTimestamp(
+                vk::PipelineStageFlagBits::eBottomOfPipe,
+                _rtTimestampQueryPool.get(),
+                1);
+
+            if (pathTracing) {
+                _pathTraced = true;
+            } else {
+                _rtRaysLaunched = estimateRaysPerFrame(
+                    traceExtent,
+                    rtPushConstants.aoRaysPerFrame,
+                    restir,
+                    rtPushConstants.radianceCacheInterval);
+            }
+
+            if (denoise) {
+                _denoiser.denoise(
+                    _raytraceCommandBuffer,
+                    rtPushConstants.cameraOrigin,
+                    rtPushConstants.accumulateFrame == 0,
+                    getInt("converge", 0) != 0,
+                    canReproject());
+            }
+
+        } else {
+
+            _raytraceCommandBuffer->bindPipeline(
+                vk::PipelineBindPoint::eCompute,
+                _previewPipeline.get());
+            _raytraceCommandBuffer->bindDescriptorSets(
+                vk::PipelineBindPoint::eCompute,
+                _previewPipelineLayout.get(),
+                0,
+                { _rtDescriptorSet.get() },
+                {});
+            _raytraceCommandBuffer->dispatch(
+                (_renderExtent.width + 7) / 8,
+                (_renderExtent.height + 7) / 8,
+                1);
+
+            // Start converging from scratch once the real pipeline takes over.
+            _accumulateFrame = 0;
+        }
+
+        _upscaler.upscale(_raytraceCommandBuffer);
+
+        _raytraceCommandBuffer->writeTimestamp(
+            vk::PipelineStageFlagBits::eBottomOfPipe,
+            _frameTimestampQueryPool.get(),
+            3);
+
+        _raytraceCommandBuffer->end();
+
+        // Submit the draw work.
+
+        vk::Semaphore waitSemaphores[2];
         vk::PipelineStageFlags waitStages[2];
 
         waitSemaphores[0] = _rasterDoneSemaphore.get();
-        waitStages[0] = vk::PipelineStageFlagBits::eRayTracingShaderKHR;
+        waitStages[0] = vk::PipelineStageFlagBits::eRayTracingShaderKHR | vk::PipelineStageFlagBits::eComputeShader;
 
         waitSemaphores[1] = _tlasBuildDoneSemaphore.get();
-        waitStages[1] = vk::PipelineStageFlagBits::eRayTracingShaderKHR;
+        waitStages[1] = vk::PipelineStageFlagBits::eRayTracingShaderKHR | vk::PipelineStageFlagBits::eComputeShader;
 
         int numWaitSemaphores = asChanged ? 2 : 1;
 
@@ -968,5 +2814,749 @@ void HVRTRenderPass::vulkanDraw() {
         _vkbi.graphicsQueue.submit(1, &submitInfo, _renderDoneFence.get());
     }
 
+    _numFrameTimestamps = _forward ? 2 : 4;
+    _restirHistoryValid = restir;
     _firstRender = false;
 }
+
+uint64_t HVRTRenderPass::estimateRaysPerFrame(
+    vk::Extent2D traceExtent,
+    int32_t aoRaysPerFrame,
+    bool restir,
+    uint32_t radianceCacheInterval)
+{
+
+    // Every traced pixel traces at most this many AO and shadow rays. Background pixels and lights
+    // facing away skip theirs, so this overestimates the ray count, but it's consistent enough for
+    // comparing changes on the same scene. ReSTIR traces one shadow ray for all the local lights.
+    const pxr::GfVec4i& numLights = _lightData.numLights_numLocalLights_localLightSamples_padding;
+    uint64_t raysPerPixel = aoRaysPerFrame + (restir ? 1 : std::min(numLights[1], numLights[2]));
+    for (int i = 0; i < numLights[0]; i++) {
+        if (_lightData.lights[i].intensity_raytraced[3] != 0.0f) raysPerPixel++;
+    }
+    uint64_t numPixels = uint64_t(traceExtent.width) * traceExtent.height;
+    uint64_t numRays = numPixels * raysPerPixel;
+
+    // Pixels updating the radiance cache also trace a ray to another surface, and light it with one
+    // AO ray and the same shadow rays.
+    if (radianceCacheInterval > 0) {
+        numRays += numPixels / radianceCacheInterval * (2 + raysPerPixel - aoRaysPerFrame);
+    }
+    return numRays;
+}
+
+void HVRTRenderPass::updateEnvironment() {
+
+    // Only the first dome light is used, like the control panel's ambient light it replaces.
+    HVRTLight* dome = nullptr;
+    for (HVRTLight* light : _lights) {
+        if (light->isDome()) {
+            dome = light;
+            break;
+        }
+    }
+
+    std::string file = dome ? dome->getTextureFile() : std::string();
+    uint32_t maxWidth = uint32_t(std::clamp(getInt("environmentMaxWidth", 2048), 64, 8192));
+    if (file != _environmentFile || (!file.empty() && maxWidth != _environmentMaxWidth)) {
+        _environmentFile = file;
+        _environmentMaxWidth = maxWidth;
+        _environmentWidth = 0;
+        _environmentHeight = 0;
+        _accumulateFrame = 0;
+        _radianceCacheMustClear = true;
+
+        if (!file.empty()) {
+            try {
+                EnvironmentMap environmentMap(_asCache, file, maxWidth);
+                const std::vector<EnvironmentMap::Texel>& texels = environmentMap.getTexels();
+
+                uint64_t size = texels.size() * sizeof(EnvironmentMap::Texel);
+                ensureStorageBuffer(_environmentBuffer, size, 29);
+                std::memcpy(_environmentBuffer.data(), texels.data(), size);
+
+                _environmentWidth = environmentMap.getWidth();
+                _environmentHeight = environmentMap.getHeight();
+
+            } catch (std::runtime_error& e) {
+                // Carry on with a uniform dome rather than failing the whole render.
+                std::cerr << e.what() << "\n";
+            }
+        }
+    }
+
+    setInt("stats_environmentWidth", int(_environmentWidth));
+    setInt("stats_environmentHeight", int(_environmentHeight));
+
+    bool enabled = _environmentWidth > 0 && getInt("environment", 1) != 0;
+    _lightData.environmentWidth_height_enabled_mis = pxr::GfVec4i(
+        int(_environmentWidth),
+        int(_environmentHeight),
+        enabled ? 1 : 0,
+        getInt("environmentMis", 1) != 0 ? 1 : 0);
+
+    if (dome) {
+        const pxr::GfVec3f& radiance = dome->getDomeRadiance();
+        const pxr::GfVec3f* axes = dome->getDomeAxes();
+        pxr::GfVec4f scale(radiance[0], radiance[1], radiance[2], 0.0f);
+        bool changed = scale != _lightData.environmentScale;
+        _lightData.environmentScale = scale;
+        for (int i = 0; i < 3; i++) {
+            pxr::GfVec4f axis(axes[i][0], axes[i][1], axes[i][2], 0.0f);
+            changed = changed || axis != _lightData.environmentAxes[i];
+            _lightData.environmentAxes[i] = axis;
+        }
+
+        // A brighter, recolored or rotated dome lights everything differently.
+        if (changed) {
+            _accumulateFrame = 0;
+            _radianceCacheMustClear = true;
+        }
+
+        // A dome without a map is a uniform environment, so it just replaces the ambient light.
+        if (!enabled) {
+            _lightData.ambientLightIntensity_maxDistance = pxr::GfVec4f(
+                radiance[0],
+                radiance[1],
+                radiance[2],
+                _lightData.ambientLightIntensity_maxDistance[3]);
+        }
+    }
+}
+
+void HVRTRenderPass::updateLocalLights() {
+
+    // Building the alias table takes a while for big light rigs, so only do it when something
+    // changed.
+    uint64_t version = HVRTLight::getGlobalVersion();
+    if (version == _localLightsVersion) return;
+    _localLightsVersion = version;
+
+    // Whatever was accumulated or cached was lit by the old lights.
+    _accumulateFrame = 0;
+    _radianceCacheMustClear = true;
+
+    std::vector<HVRTLight::Data> localLights;
+    std::vector<double> powers;
+    _distantLights.clear();
+    for (HVRTLight* light : _lights) {
+        if (light->isDistant()) {
+            _distantLights.emplace_back(
+                light->getDirection(),
+                true, // directional
+                light->getIrradiance(),
+                light->isRaytraced());
+        } else if (light->getPower() > 0.0f) {
+            localLights.push_back(light->getData());
+            powers.push_back(light->getPower());
+        }
+    }
+    _numLocalLights = localLights.size();
+
+    // Reservoirs refer to lights by index, so last frame's are no good anymore.
+    _restirHistoryValid = false;
+    setInt("stats_numLocalLights", _numLocalLights);
+
+    // Shaders pick a light in proportion to its power.
+    std::vector<AliasTableEntry> table = buildAliasTable(powers);
+    for (size_t i = 0; i < localLights.size(); i++) {
+        localLights[i].aliasProbability = table[i].aliasProbability;
+        localLights[i].aliasIndex = table[i].aliasIndex;
+        localLights[i].selectionPdf = table[i].selectionPdf;
+    }
+
+    // The buffer can't be empty, even with no local lights.
+    uint64_t size = std::max<size_t>(localLights.size(), 1) * sizeof(HVRTLight::Data);
+    ensureStorageBuffer(_localLightBuffer, size, 16);
+    std::memcpy(_localLightBuffer.data(), localLights.data(), localLights.size() * sizeof(HVRTLight::Data));
+}
+
+void HVRTRenderPass::ensureStorageBuffer(VulkanBuffer& buffer, uint64_t size, uint32_t binding) {
+
+    if (size <= buffer.size()) return;
+
+    // Grow geometrically, so a scene that keeps growing doesn't reallocate every frame.
+    buffer.allocate(std::max(size, 2 * buffer.size()), true, vk::BufferUsageFlagBits::eStorageBuffer);
+
+    vk::DescriptorBufferInfo bufferInfo = {
+        buffer.getBuffer(),
+        0,
+        VK_WHOLE_SIZE,
+    };
+    vk::WriteDescriptorSet writeDescriptorSet = {
+        _rtDescriptorSet.get(),
+        binding,
+        0,
+        1,
+        vk::DescriptorType::eStorageBuffer,
+        nullptr,
+        &bufferInfo,
+        nullptr,
+    };
+    _vkbi.device.updateDescriptorSets(1, &writeDescriptorSet, 0, nullptr);
+}
+
+static int32_t numRayLevels(int32_t aoRaysPerFrame) {
+    int32_t levels = 0;
+    while ((aoRaysPerFrame >> levels) > 1) levels++;
+    return levels;
+}
+
+void HVRTRenderPass::vulkanAllocatePathBuffers() {
+
+    // Every pixel with a surface starts a path, so each queue needs room for one entry per pixel.
+
+    uint64_t numPaths = uint64_t(_renderExtent.width) * _renderExtent.height;
+    _pathStateBuffer.allocate(numPaths * PATH_STATE_SIZE, false, vk::BufferUsageFlagBits::eStorageBuffer);
+    _pathHitQueueBuffer.allocate(numPaths * sizeof(uint32_t), false, vk::BufferUsageFlagBits::eStorageBuffer);
+    _pathRayQueueBuffer.allocate(numPaths * sizeof(uint32_t), false, vk::BufferUsageFlagBits::eStorageBuffer);
+    _pathNextRayQueueBuffer.allocate(numPaths * sizeof(uint32_t), false, vk::BufferUsageFlagBits::eStorageBuffer);
+    _pathShadowQueueBuffer.allocate(
+        numPaths * PATH_SHADOW_RAY_SIZE,
+        false,
+        vk::BufferUsageFlagBits::eStorageBuffer);
+
+    // Light gathered along each pixel's path this frame, before it's accumulated.
+    _pathRadianceImg.allocate(
+        vk::Format::eR32G32B32A32Sfloat,
+        _renderExtent,
+        vk::ImageUsageFlagBits::eStorage,
+        vk::ImageAspectFlagBits::eColor);
+    _mustTransitionPathRadiance = true;
+
+    _pathBuffersExtent = _renderExtent;
+
+    VulkanBuffer* buffers[] = {
+        &_pathStateBuffer,
+        &_pathHitQueueBuffer,
+        &_pathRayQueueBuffer,
+        &_pathNextRayQueueBuffer,
+        &_pathShadowQueueBuffer,
+    };
+    vk::DescriptorBufferInfo bufferInfos[5];
+    vk::WriteDescriptorSet writeDescriptorSets[6];
+    for (uint32_t i = 0; i < 5; i++) {
+        bufferInfos[i] = { buffers[i]->getBuffer(), 0, VK_WHOLE_SIZE };
+        writeDescriptorSets[i] = {
+            _rtDescriptorSet.get(),
+            21 + i,
+            0,
+            1,
+            vk::DescriptorType::eStorageBuffer,
+            nullptr,
+            &bufferInfos[i],
+            nullptr,
+        };
+    }
+    vk::DescriptorImageInfo radianceImageInfo = {
+        {},
+        _pathRadianceImg.getImageView(),
+        vk::ImageLayout::eGeneral,
+    };
+    writeDescriptorSets[5] = {
+        _rtDescriptorSet.get(),
+        27,
+        0,
+        1,
+        vk::DescriptorType::eStorageImage,
+        &radianceImageInfo,
+        nullptr,
+        nullptr,
+    };
+    _vkbi.device.updateDescriptorSets(6, writeDescriptorSets, 0, nullptr);
+}
+
+void HVRTRenderPass::recordPathTracing() {
+
+    // The counters start over every frame. Last frame's passes are done with them, and they're host
+    // coherent, so they can just be written here.
+
+    PathCounters& counters = *reinterpret_cast<PathCounters*>(_pathCountersBuffer.data());
+    counters = {};
+    uint32_t maxBounces = uint32_t(std::clamp(getInt("pathMaxBounces", 4), 1, MAX_PATH_BOUNCES));
+    counters.maxBounces = maxBounces;
+
+    if (_mustTransitionPathRadiance) {
+        vk::ImageMemoryBarrier radianceBarrier = {
+            .srcAccessMask = vk::AccessFlags(),
+            .dstAccessMask = vk::AccessFlagBits::eShaderWrite,
+            .oldLayout = vk::ImageLayout::eUndefined,
+            .newLayout = vk::ImageLayout::eGeneral,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = _pathRadianceImg.getImage(),
+            .subresourceRange = { vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 },
+        };
+        _raytraceCommandBuffer->pipelineBarrier(
+            vk::PipelineStageFlagBits::eTopOfPipe,
+            vk::PipelineStageFlagBits::eComputeShader,
+            vk::DependencyFlags(),
+            0, nullptr,
+            0, nullptr,
+            1, &radianceBarrier);
+        _mustTransitionPathRadiance = false;
+    }
+
+    // Each stage reads what the ones before it wrote, both from storage and as dispatch arguments.
+    auto stageBarrier = [&]() {
+        vk::MemoryBarrier barrier = {
+            .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+            .dstAccessMask =
+                vk::AccessFlagBits::eShaderRead
+                | vk::AccessFlagBits::eShaderWrite
+                | vk::AccessFlagBits::eIndirectCommandRead,
+        };
+        _raytraceCommandBuffer->pipelineBarrier(
+            vk::PipelineStageFlagBits::eComputeShader,
+            vk::PipelineStageFlagBits::eComputeShader | vk::PipelineStageFlagBits::eDrawIndirect,
+            vk::DependencyFlags(),
+            1, &barrier,
+            0, nullptr,
+            0, nullptr);
+    };
+    auto bindStage = [&](vk::UniquePipeline& pipeline) {
+        _raytraceCommandBuffer->bindPipeline(vk::PipelineBindPoint::eCompute, pipeline.get());
+        _raytraceCommandBuffer->bindDescriptorSets(
+            vk::PipelineBindPoint::eCompute,
+            _rtPipelineLayout.get(),
+            0,
+            { _rtDescriptorSet.get() },
+            {});
+    };
+    auto dispatchPixels = [&](vk::UniquePipeline& pipeline) {
+        bindStage(pipeline);
+        _raytraceCommandBuffer->dispatch((_renderExtent.width + 7) / 8, (_renderExtent.height + 7) / 8, 1);
+    };
+    auto dispatchQueue = [&](vk::UniquePipeline& pipeline, vk::DeviceSize dispatchOffset) {
+        bindStage(pipeline);
+        _raytraceCommandBuffer->dispatchIndirect(_pathCountersBuffer.getBuffer(), dispatchOffset);
+    };
+    auto advance = [&]() {
+        bindStage(_pathAdvancePipeline);
+        _raytraceCommandBuffer->dispatch(1, 1, 1);
+        stageBarrier();
+    };
+
+    dispatchPixels(_pathGeneratePipeline);
+    stageBarrier();
+
+    // Each bounce shades every path's latest hit, then traces its shadow ray and extends it. The
+    // shadow rays and sorting are independent of each other, so they share a barrier.
+    for (uint32_t bounce = 0; bounce <= maxBounces; bounce++) {
+
+        advance();
+        dispatchQueue(_pathShadePipeline, offsetof(PathCounters, hitDispatch));
+        stageBarrier();
+
+        advance();
+        dispatchQueue(_pathShadowPipeline, offsetof(PathCounters, shadowDispatch));
+        if (bounce < maxBounces) {
+            dispatchQueue(_pathSortPipeline, offsetof(PathCounters, rayDispatch));
+            stageBarrier();
+            dispatchQueue(_pathExtendPipeline, offsetof(PathCounters, rayDispatch));
+        }
+        stageBarrier();
+    }
+
+    dispatchPixels(_pathResolvePipeline);
+}
+
+void HVRTRenderPass::updatePathGeometry() {
+
+    // Each geometry is in the same order the TLAS instances' custom indices were counted in.
+
+    auto makeGeometry = [](HVRTMesh* mesh, VulkanBuffer& indexBuffer, uint32_t firstTriangle) {
+        PathGeometry geometry = {};
+        geometry.vertices = mesh->getVertexBuffer().getDeviceAddress();
+        geometry.indices = indexBuffer.getDeviceAddress();
+        geometry.firstTriangle = firstTriangle;
+        pxr::GfMatrix4f modelToWorldT = mesh->getModelToWorld().GetTranspose();
+        for (int row = 0; row < 3; row++) {
+            geometry.modelToWorld[row] = modelToWorldT.GetRow(row);
+        }
+        const pxr::GfVec3f& color = mesh->getColor();
+        geometry.color = pxr::GfVec4f(color[0], color[1], color[2], 1.0f);
+        return geometry;
+    };
+
+    std::vector<PathGeometry> geometries;
+    for (const BlasInstance& blasInstance : _tlasInstances) {
+        for (uint32_t geometryI = 0; geometryI < blasInstance.getNumGeometries(); geometryI++) {
+            HVRTMesh* mesh = blasInstance.getGeometryMesh(geometryI);
+            if (blasInstance.batch) {
+                geometries.push_back(makeGeometry(mesh, mesh->getIndexBuffer(), 0));
+            } else {
+                geometries.push_back(makeGeometry(
+                    mesh,
+                    mesh->getClusterIndexBuffer(),
+                    mesh->getClusterFirstTriangle(blasInstance.cluster)));
+            }
+        }
+    }
+
+    uint64_t size = std::max<size_t>(geometries.size(), 1) * sizeof(PathGeometry);
+    ensureStorageBuffer(_pathGeometryBuffer, size, 26);
+    std::memcpy(_pathGeometryBuffer.data(), geometries.data(), geometries.size() * sizeof(PathGeometry));
+}
+
+void HVRTRenderPass::updateDrawGeometry() {
+
+    // Meshes are drawn in the order they're iterated here. Empty ones have no buffers, but they
+    // draw no triangles either.
+
+    std::vector<DrawGeometry> geometries;
+    for (HVRTMesh* mesh : _meshes) {
+        DrawGeometry geometry = {};
+        if (mesh->getNumTriangles() > 0) {
+            geometry.vertices = mesh->getVertexBuffer().getDeviceAddress();
+            geometry.normals = mesh->getNormalBuffer().getDeviceAddress();
+            geometry.indices = mesh->getIndexBuffer().getDeviceAddress();
+        }
+        pxr::GfMatrix4f modelToWorldT = mesh->getModelToWorld().GetTranspose();
+        pxr::GfMatrix4f normalModelToWorldT = mesh->getNormalModelToWorld().GetTranspose();
+        for (int row = 0; row < 3; row++) {
+            geometry.modelToWorld[row] = modelToWorldT.GetRow(row);
+            geometry.normalToWorld[row] = normalModelToWorldT.GetRow(row);
+        }
+        const pxr::GfVec3f& color = mesh->getColor();
+        geometry.color = pxr::GfVec4f(color[0], color[1], color[2], 1.0f);
+        geometries.push_back(geometry);
+    }
+
+    uint64_t size = std::max<size_t>(geometries.size(), 1) * sizeof(DrawGeometry);
+    ensureStorageBuffer(_drawGeometryBuffer, size, 30);
+    std::memcpy(_drawGeometryBuffer.data(), geometries.data(), geometries.size() * sizeof(DrawGeometry));
+}
+
+void HVRTRenderPass::updateRadianceCacheSize() {
+
+    // The most cells that fit in the memory limit, rounded down to a power of two so hashes can be
+    // masked into slots.
+    uint64_t maxBytes = uint64_t(std::clamp(getInt("radianceCacheMB", 32), 1, 1024)) * 1024 * 1024;
+    uint64_t numCells = 1;
+    while (2 * numCells * sizeof(RadianceCacheCell) <= maxBytes) numCells *= 2;
+    setInt("stats_radianceCacheCells", int(numCells));
+
+    uint64_t size = numCells * sizeof(RadianceCacheCell);
+    if (size == _radianceCacheBuffer.size()) return;
+
+    _radianceCacheBuffer.allocate(
+        size,
+        false,
+        vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst);
+    _radianceCacheMustClear = true;
+
+    vk::DescriptorBufferInfo radianceCacheBufferInfo = {
+        _radianceCacheBuffer.getBuffer(),
+        0,
+        VK_WHOLE_SIZE,
+    };
+    vk::WriteDescriptorSet writeDescriptorSet = {
+        _rtDescriptorSet.get(),
+        28,
+        0,
+        1,
+        vk::DescriptorType::eStorageBuffer,
+        nullptr,
+        &radianceCacheBufferInfo,
+        nullptr,
+    };
+    _vkbi.device.updateDescriptorSets(1, &writeDescriptorSet, 0, nullptr);
+}
+
+uint64_t HVRTRenderPass::updateBakedAO() {
+
+    _aoBaking = false;
+
+    // Changes aren't tracked while nothing is baking, so every bake starts over once it's back on.
+    if (!useBakedAO()) {
+        _aoBakeMeshes.clear();
+        _aoBakeMaxDistance = -1.0f;
+        setFloat("stats_aoBakeProgress", 0.0f);
+        return 0;
+    }
+
+    float maxDistance = _lightData.ambientLightIntensity_maxDistance[3];
+    bool resetAll = (maxDistance != _aoBakeMaxDistance);
+    _aoBakeMaxDistance = maxDistance;
+
+    // Collect where geometry was and now is for every mesh which was removed, added or changed
+    // since last frame. Versions are unique across meshes, so a new mesh at a deleted one's address
+    // still counts as changed.
+    std::vector<pxr::GfRange3f> changedBounds;
+    for (auto it = _aoBakeMeshes.begin(); it != _aoBakeMeshes.end();) {
+        if (_meshes.count(it->first) == 0) {
+            changedBounds.push_back(it->second.second);
+            it = _aoBakeMeshes.erase(it);
+        } else {
+            it++;
+        }
+    }
+    for (HVRTMesh* mesh : _meshes) {
+        auto [it, inserted] =
+            _aoBakeMeshes.try_emplace(mesh, mesh->getVersion(), mesh->getWorldBounds());
+        if (inserted) {
+            changedBounds.push_back(mesh->getWorldBounds());
+        } else if (it->second.first != mesh->getVersion()) {
+            changedBounds.push_back(it->second.second);
+            changedBounds.push_back(mesh->getWorldBounds());
+            it->second = { mesh->getVersion(), mesh->getWorldBounds() };
+        }
+    }
+
+    // AO rays only reach as far as the AO distance, so only meshes that close to changed geometry
+    // have to bake again. Meshes which changed themselves have already started over.
+    uint32_t targetSamples = uint32_t(std::max(getInt("aoBakeSamples", 256), 1));
+    uint32_t raysPerFrame = uint32_t(std::clamp(getInt("aoBakeRaysPerFrame", 16), 1, 256));
+    pxr::GfVec3f padding(maxDistance);
+    uint64_t numRays = 0;
+    uint64_t bakedSamples = 0;
+    uint64_t totalSamples = 0;
+    for (HVRTMesh* mesh : _meshes) {
+
+        const pxr::GfRange3f& bounds = mesh->getWorldBounds();
+        if (resetAll) {
+            mesh->resetBakedAO();
+        } else if (!bounds.IsEmpty() && !changedBounds.empty()) {
+            pxr::GfRange3f reach(bounds.GetMin() - padding, bounds.GetMax() + padding);
+            for (const pxr::GfRange3f& changed : changedBounds) {
+                if (!changed.IsEmpty() && !reach.IsOutside(changed)) {
+                    mesh->resetBakedAO();
+                    break;
+                }
+            }
+        }
+
+        uint32_t samples = std::min(mesh->getBakedAOSamples(), targetSamples);
+        bakedSamples += uint64_t(samples) * mesh->getNumVertices();
+        totalSamples += uint64_t(targetSamples) * mesh->getNumVertices();
+        if (samples < targetSamples) {
+            _aoBaking = true;
+            uint32_t numSamples = std::min(raysPerFrame, targetSamples - samples);
+            numRays += uint64_t(numSamples) * mesh->getNumVertices();
+        }
+    }
+
+    setFloat(
+        "stats_aoBakeProgress",
+        totalSamples > 0 ? 100.0f * bakedSamples / totalSamples : 100.0f);
+    return numRays;
+}
+
+void HVRTRenderPass::recordBakeAO() {
+
+    uint32_t targetSamples = uint32_t(std::max(getInt("aoBakeSamples", 256), 1));
+    uint32_t raysPerFrame = uint32_t(std::clamp(getInt("aoBakeRaysPerFrame", 16), 1, 256));
+
+    _rasterizeCommandBuffer->bindPipeline(vk::PipelineBindPoint::eCompute, _aoBakePipeline.get());
+    _rasterizeCommandBuffer->bindDescriptorSets(
+        vk::PipelineBindPoint::eCompute,
+        _aoBakePipelineLayout.get(),
+        0,
+        { _rtDescriptorSet.get() },
+        {});
+
+    bool finishedBake = false;
+    for (HVRTMesh* mesh : _meshes) {
+        uint32_t samples = mesh->getBakedAOSamples();
+        if (samples >= targetSamples) continue;
+        uint32_t numSamples = std::min(raysPerFrame, targetSamples - samples);
+        mesh->bakeAO(
+            _rasterizeCommandBuffer,
+            _aoBakePipelineLayout,
+            numSamples,
+            getSampler("aoBake"),
+            _aoBakeMaxDistance);
+        finishedBake |= (samples + numSamples >= targetSamples);
+    }
+
+    // Meshes switching over to their finished bakes would otherwise be blended in with frames
+    // which traced their AO.
+    if (finishedBake) _accumulateFrame = 0;
+
+    // The raster pass reads the bakes as vertex attributes.
+    vk::MemoryBarrier bakeBarrier = {
+        .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+        .dstAccessMask = vk::AccessFlagBits::eVertexAttributeRead,
+    };
+    _rasterizeCommandBuffer->pipelineBarrier(
+        vk::PipelineStageFlagBits::eComputeShader,
+        vk::PipelineStageFlagBits::eVertexInput,
+        vk::DependencyFlags(),
+        1, &bakeBarrier,
+        0, nullptr,
+        0, nullptr);
+}
+
+void HVRTRenderPass::updateFrameBudget(bool cameraMoved) {
+
+    // Last frame is done, so its timestamps can be read back.
+
+    _vkbi.device.waitForFences(1, &_renderDoneFence.get(), true, std::numeric_limits<uint64_t>::max());
+
+    std::optional<float> frameMs;
+    if (_numFrameTimestamps > 0) {
+        uint64_t timestamps[4];
+        _vkbi.device.getQueryPoolResults(
+            _frameTimestampQueryPool.get(),
+            0,
+            _numFrameTimestamps,
+            _numFrameTimestamps * sizeof(uint64_t),
+            timestamps,
+            sizeof(uint64_t),
+            vk::QueryResultFlagBits::e64);
+        uint64_t ticks = timestamps[1] - timestamps[0];
+        if (_numFrameTimestamps == 4) ticks += timestamps[3] - timestamps[2];
+        frameMs = float(double(ticks) * _rtTimestampPeriod * 1e-6);
+        setFloat("stats_gpuFrameMs", *frameMs);
+        _numFrameTimestamps = 0;
+    }
+
+    bool resuming = cameraMoved && _framesSinceCameraMoved >= FRAME_BUDGET_STILL_FRAMES;
+    _framesSinceCameraMoved =
+        cameraMoved ? 0 : std::min(_framesSinceCameraMoved + 1, FRAME_BUDGET_STILL_FRAMES);
+
+    _framesSinceResize = std::min(_framesSinceResize + 1, FRAME_BUDGET_RESIZE_FRAMES);
+
+    bool interacting = false;
+    if (getInt("frameBudget", 0) == 0) {
+        _budgetLevel = 0;
+        _budgetMovingLevel = 0;
+    } else if (resuming) {
+        // Pick up where the controller left off the last time the camera moved, rather than
+        // starting over from full quality. Last frame was rendered at full quality, so its time
+        // says nothing about that level.
+        _budgetLevel = _budgetMovingLevel;
+    } else if (_framesSinceCameraMoved >= FRAME_BUDGET_STILL_FRAMES) {
+        // The camera is still, so there's no interaction to keep smooth.
+        _budgetLevel = 0;
+    } else {
+        if (frameMs) {
+            float budgetMs = getFloat("frameBudgetMs", 33.3f);
+            if (*frameMs > budgetMs) {
+                _budgetLevel++;
+            } else if (*frameMs < budgetMs * FRAME_BUDGET_HEADROOM) {
+                _budgetLevel--;
+            }
+        }
+        interacting = true;
+    }
+    int32_t rayLevels = numRayLevels(getInt("aoRaysPerFrame", 1));
+    _budgetLevel = std::clamp(_budgetLevel, 0, rayLevels + FRAME_BUDGET_SCALE_LEVELS);
+    int32_t scaleLevel = std::clamp(_budgetLevel - rayLevels, 0, FRAME_BUDGET_SCALE_LEVELS);
+
+    if (interacting) {
+        // Resizing stalls on the GPU and starts accumulation over, so the render scale only
+        // follows the controller a step at a time, and not too often. Meanwhile the controller
+        // waits one step away.
+        if (scaleLevel != _renderScaleLevel && _framesSinceResize >= FRAME_BUDGET_RESIZE_FRAMES) {
+            _renderScaleLevel += (scaleLevel > _renderScaleLevel) ? 1 : -1;
+        }
+        _budgetLevel = std::clamp(
+            _budgetLevel,
+            _renderScaleLevel > 0 ? rayLevels + _renderScaleLevel - 1 : 0,
+            rayLevels + _renderScaleLevel + 1);
+        _budgetMovingLevel = _budgetLevel;
+    } else {
+        _renderScaleLevel = scaleLevel;
+    }
+
+    setFloat("stats_renderScale", getRenderScale());
+    setInt("stats_aoRaysPerFrame", getAoRaysPerFrame());
+}
+
+vk::RenderPass HVRTRenderPass::getRasterRenderPass() {
+    if (_forward) return _forwardRenderPass.get();
+    if (_visibilityBuffer) return _visibilityRenderPass.get();
+    return _renderPass.get();
+}
+
+float HVRTRenderPass::getRenderScale() {
+    return 1.0f - _renderScaleLevel * FRAME_BUDGET_SCALE_STEP;
+}
+
+vk::Extent2D HVRTRenderPass::getRenderExtent() {
+    float scale = getRenderScale();
+    return vk::Extent2D(
+        std::max(uint32_t(std::round(_viewportExtent.width * scale)), 1u),
+        std::max(uint32_t(std::round(_viewportExtent.height * scale)), 1u));
+}
+
+int32_t HVRTRenderPass::getAoRaysPerFrame() {
+    int32_t aoRaysPerFrame = getInt("aoRaysPerFrame", 1);
+    return aoRaysPerFrame >> std::min(_budgetLevel, numRayLevels(aoRaysPerFrame));
+}
+
+bool HVRTRenderPass::useRayQuery() {
+    // Either backend works wherever both are supported, so which one is used can be switched at any
+    // time to compare them. Only main.rgen reads the visibility buffer, though.
+    return
+        _vkbi.rayQuery
+        && !_visibilityBuffer
+        && (getInt("rayQueryBackend", 0) != 0 || !_vkbi.rayTracingPipeline);
+}
+
+bool HVRTRenderPass::canReproject() {
+    // The denoiser reprojects its own history, but otherwise only main.rgen and path tracing
+    // accumulate per pixel.
+    // Forward and visibility buffer modes have no G-buffer to reproject with.
+    return
+        !_forward
+        && !_visibilityBuffer
+        && getInt("reproject", 0) != 0
+        && (getInt("denoise", 0) != 0 || !useRayQuery() || usePathTracing());
+}
+
+bool HVRTRenderPass::useRestir() {
+    // Only main.rgen shades from reservoirs, and only when it traces every pixel. Temporal and spatial
+    // reuse compare neighbors' G-buffer surfaces.
+    return
+        !_forward
+        && !_visibilityBuffer
+        && !useRayQuery()
+        && _rtPipeline.isReady()
+        && !usePathTracing()
+        && getInt("restir", 0) != 0
+        && std::clamp(getInt("traceRate", 0), 0, 2) == int(TRACE_RATE_FULL)
+        && _numLocalLights > 0;
+}
+
+bool HVRTRenderPass::useBakedAO() {
+    // The bake pipeline traces with ray queries.
+    return _forward && _vkbi.rayQuery && getInt("aoBake", 0) != 0;
+}
+
+bool HVRTRenderPass::useRadianceCache() {
+    // Only main.rgen can see what AO rays hit.
+    return
+        !_forward
+        && !useRayQuery()
+        && !usePathTracing()
+        && _rtPipeline.isReady()
+        && getInt("radianceCache", 0) != 0;
+}
+
+bool HVRTRenderPass::usePathTracing() {
+    // The path tracing stages trace with ray queries, and start their paths from the G-buffer.
+    return !_forward && !_visibilityBuffer && _vkbi.rayQuery && getInt("pathTracing", 0) != 0;
+}
+
+uint32_t HVRTRenderPass::getSampler(const std::string& pass) {
+    // Each pass can pick its own sampler, or follow the global choice with -1.
+    int32_t sampler = getInt("sampler_" + pass, -1);
+    if (sampler < 0) sampler = getInt("lowDiscrepancySampling", 1);
+    return sampler ? SAMPLER_LOW_DISCREPANCY : SAMPLER_RANDOM;
+}
+
+void HVRTRenderPass::updateSamplerStats() {
+
+    uint32_t numSamples = uint32_t(std::clamp(getInt("samplerStatsSamples", 64), 1, 4096));
+    if (numSamples == _samplerStatsSamples) return;
+    _samplerStatsSamples = numSamples;
+
+    // The first dimension pair is the Sobol sequence, and later ones are padded with the lattice.
+    const uint32_t numPixels = 256;
+    setFloat("stats_samplerRmseRandom", measureSamplerRmse(SAMPLER_RANDOM, 0, numSamples, numPixels));
+    setFloat("stats_samplerRmseSobol", measureSamplerRmse(SAMPLER_LOW_DISCREPANCY, 0, numSamples, numPixels));
+    setFloat("stats_samplerRmseLattice", measureSamplerRmse(SAMPLER_LOW_DISCREPANCY, 1, numSamples, numPixels));
+}
@@ -7,8 +7,18 @@
 #include <VulkanBuffer.h>
 #include <VulkanImage.h>
 #include <VulkanAccelerationStructure.h>
+#include <VulkanRayTracingPipeline.h>
+#include <ASCache.h>
 #include <Blitter.h>
 #include <Mesh.h>
+#include <Light.h>
+#include <AliasTable.h>
+#include <Sampler.h>
+#include <EnvironmentMap.h>
+#include <StaticBatcher.h>
+#include <BlasScheduler.h>
+#include <Denoiser.h>
+#include <Upscaler.h>
 
 
 class HVRTRenderPass : public pxr::HdRenderPass {
@@ -19,12 +29,20 @@ public:
         pxr::HdRenderIndex* index,
         pxr::HdRprimCollection const& collection,
         const VulkanBasicInfo& vkbi,
-        std::unordered_set<HVRTMesh*>& meshes);
+        ASCache& asCache,
+        std::unordered_set<HVRTMesh*>& meshes,
+        std::unordered_set<HVRTLight*>& lights);
 
     virtual ~HVRTRenderPass();
 
+    // Reduced quality from the frame budget isn't converged either, so Hydra keeps rendering until
+    // the controller climbs back to full quality, and neither are unfinished AO bakes.
     virtual bool IsConverged() const override {
-        return getInt("converge", 0) == 0;
+        return
+            (getInt("converge", 0) == 0 || _adaptiveConverged)
+            && _budgetLevel == 0
+            && _renderScaleLevel == 0
+            && !_aoBaking;
     }
 
 protected:
@@ -42,13 +60,50 @@ private:
         pxr::GfVec3f cameraOrigin;
         uint32_t accumulateFrame;
         int32_t aoRaysPerFrame;
+        uint32_t samplerType;
+        float adaptiveThreshold;
+        uint32_t denoise;
+        uint32_t traceRate;
+        uint32_t restirCandidates;
+        uint32_t frame;
+        uint32_t radianceCacheInterval;
+        float radianceCacheScale;
+        uint32_t radianceCacheTTL;
+        uint32_t visibilityBuffer;
     };
 
+    struct CameraData {
+        pxr::GfMatrix4f worldToNdc;
+        pxr::GfMatrix4f prevWorldToNdc;
+    };
+
+    // Forward mode's fragment shader push constants come after the vertex shader's.
+    struct ForwardPushConstants {
+        uint32_t accumulateFrame;
+        int32_t aoRaysPerFrame;
+        uint32_t samplerType;
+    };
+
+    // Must match visibility.frag, which shares forward.frag's offset.
+    struct VisibilityPushConstants {
+        uint32_t drawIndex;
+    };
+
+    // Must match MAX_DIRECTIONAL_LIGHTS in lights.glsl.
+    static const int MAX_DIRECTIONAL_LIGHTS = 16;
+
+    // Directional lights, from the control panel followed by Hydra's distant lights. Local lights
+    // are in their own storage buffer, since there can be any number of them.
     struct LightData {
 
-        pxr::GfVec4i numLights_padding;
+        pxr::GfVec4i numLights_numLocalLights_localLightSamples_padding;
         pxr::GfVec4f ambientLightIntensity_maxDistance;
 
+        // The dome light's environment map, if there is one. Its axes are in world space.
+        pxr::GfVec4i environmentWidth_height_enabled_mis;
+        pxr::GfVec4f environmentScale;
+        pxr::GfVec4f environmentAxes[3];
+
         struct Light {
 
             pxr::GfVec4f v_directional;
@@ -62,41 +117,177 @@ private:
             {
             }
 
-        } lights[10];
+        } lights[MAX_DIRECTIONAL_LIGHTS];
+    };
+
+    // Must match MAX_PATH_BOUNCES in path.glsl.
+    static const int MAX_PATH_BOUNCES = 8;
+
+    // Must match PathCounters in path.glsl. Each dispatch's xyz are the indirect dispatch size, and
+    // w the number of queue entries it processes.
+    struct PathCounters {
+        uint32_t hitDispatch[4];
+        uint32_t shadowDispatch[4];
+        uint32_t rayDispatch[4];
+        uint32_t hitCount;
+        uint32_t shadowCount;
+        uint32_t nextRayCount;
+        uint32_t maxBounces;
+        uint32_t binCounts[8];
+        uint32_t binCursors[8];
+        uint32_t paths;
+        uint32_t rays;
+        uint32_t padding[2];
+        uint32_t bounceHistogram[MAX_PATH_BOUNCES + 1];
+    };
+
+    // Must match PathGeometry in pathExtend.comp. One per BLAS geometry, so each TLAS instance's
+    // custom index is the index of its first geometry here.
+    struct PathGeometry {
+        vk::DeviceAddress vertices;
+        vk::DeviceAddress indices;
+        uint32_t firstTriangle;
+        uint32_t padding[3];
+        pxr::GfVec4f modelToWorld[3];
+        pxr::GfVec4f color;
+    };
+
+    // Must match DrawGeometry in visibility.glsl. One per mesh, in the order the raster pass draws
+    // them, so the visibility buffer's draw indices can find their meshes' buffers.
+    struct DrawGeometry {
+        vk::DeviceAddress vertices;
+        vk::DeviceAddress normals;
+        vk::DeviceAddress indices;
+        uint32_t padding[2];
+        pxr::GfVec4f modelToWorld[3];
+        pxr::GfVec4f normalToWorld[3];
+        pxr::GfVec4f color;
+    };
+
+    // Must match RadianceCacheCell in radianceCache.glsl.
+    struct RadianceCacheCell {
+        uint32_t checksum;
+        uint32_t lastUpdateFrame;
+        uint32_t sampleCount;
+        uint32_t padding;
+        uint32_t sampleSum[4];
+        pxr::GfVec4f radiance_frames;
     };
 
     void vulkanInit();
 
+    void vulkanCreateDisplayImages();
+
     void vulkanCreateFramebuffer();
 
     void vulkanDraw();
 
+    // (Re)allocates path tracing's per-pixel path states and queues at the render resolution.
+    void vulkanAllocatePathBuffers();
+
+    // Records the wavefront path tracing stages, which replace the RT pipeline's dispatch.
+    void recordPathTracing();
+
+    // Fills the path geometry table from this frame's TLAS instances.
+    void updatePathGeometry();
+
+    // Fills the draw geometry table, for visibility buffer mode.
+    void updateDrawGeometry();
+
+    // Rebuilds the local light buffer and its alias table if any Hydra light changed.
+    void updateLocalLights();
+
+    // Loads the dome light's environment map if it changed, and fills in its light data.
+    void updateEnvironment();
+
+    // Grows a host-visible storage buffer to at least size bytes, rebinding it at binding of the
+    // ray tracing descriptor set whenever it's reallocated.
+    void ensureStorageBuffer(VulkanBuffer& buffer, uint64_t size, uint32_t binding);
+
+    uint64_t estimateRaysPerFrame(
+        vk::Extent2D traceExtent,
+        int32_t aoRaysPerFrame,
+        bool restir,
+        uint32_t radianceCacheInterval);
+
+    // Reallocates the radiance cache if its memory limit changed.
+    void updateRadianceCacheSize();
+
+    // Starts over the AO bakes of meshes near any geometry which changed, and returns how many AO
+    // rays this frame's bake dispatches will trace.
+    uint64_t updateBakedAO();
+
+    // Records this frame's AO bake dispatches.
+    void recordBakeAO();
+
+    // Measures last frame's GPU time, and picks this frame's quality level to fit the frame budget.
+    void updateFrameBudget(bool cameraMoved);
+
+    // Measures how well each sampler converges on the CPU, whenever the sample count to measure
+    // changes.
+    void updateSamplerStats();
+
+    // The raster pass's render pass for the current mode.
+    vk::RenderPass getRasterRenderPass();
+
+    float getRenderScale();
+
+    vk::Extent2D getRenderExtent();
+
+    int32_t getAoRaysPerFrame();
+
+    // The sampler for one of the "forward", "ao", "path" or "aoBake" passes.
+    uint32_t getSampler(const std::string& pass);
+
+    bool useRayQuery();
+
+    bool canReproject();
+
+    // Whether local lights are shaded from ReSTIR's reservoirs this frame.
+    bool useRestir();
+
+    bool usePathTracing();
+
+    bool useRadianceCache();
+
+    bool useBakedAO();
+
     pxr::GfVec4f _viewport;
     vk::Extent2D _viewportExtent;
+    vk::Extent2D _renderExtent;
     pxr::GfMatrix4d _worldToView;
     pxr::GfMatrix4d _viewToNdc;
     uint32_t _accumulateFrame;
+    bool _forward;
+    bool _forwardSupported;
+    bool _visibilityBuffer;
 
     Blitter _blitter;
 
     const VulkanBasicInfo& _vkbi;
 
+    ASCache& _asCache;
+
     std::unordered_set<HVRTMesh*>& _meshes;
 
+    std::unordered_set<HVRTLight*>& _lights;
+
     bool _firstRender;
     bool _mustTransitionOutputColor;
     vk::UniqueCommandPool _graphicsCommandPool;
     vk::UniqueCommandPool _computeCommandPool;
-    vk::UniqueCommandBuffer _blasBuildCommandBuffers[3];
+    std::vector<vk::UniqueCommandBuffer> _blasBuildCommandBuffers;
     vk::UniqueCommandBuffer _tlasBuildCommandBuffer;
     vk::UniqueCommandBuffer _rasterizeCommandBuffer;
     vk::UniqueCommandBuffer _raytraceCommandBuffer;
     vk::UniqueRenderPass _renderPass;
+    vk::UniqueRenderPass _forwardRenderPass;
+    vk::UniqueRenderPass _visibilityRenderPass;
 
     vk::UniqueSemaphore _blitDoneSemaphore;
     int _blitDoneSemaphoreExternalHandle;
     vk::UniqueSemaphore _rasterDoneSemaphore;
-    vk::UniqueSemaphore _blasBuildDoneSemaphores[3];
+    std::vector<vk::UniqueSemaphore> _blasBuildDoneSemaphores;
     vk::UniqueSemaphore _tlasBuildDoneSemaphore;
     vk::UniqueSemaphore _renderDoneSemaphore;
     int _renderDoneSemaphoreExternalHandle;
@@ -104,32 +295,135 @@ private:
 
     vk::UniqueShaderModule _vertexShaderModule;
     vk::UniqueShaderModule _fragmentShaderModule;
+    vk::UniqueShaderModule _forwardFragmentShaderModule;
+    vk::UniqueShaderModule _visibilityFragmentShaderModule;
 
     VulkanImage _outputColorImg;
     VulkanImage _outputDepthImg;
     VulkanImage _albedoImg;
     VulkanImage _worldPositionImg;
     VulkanImage _worldNormalImg;
+    VulkanImage _sampleStatsImg;
+    VulkanImage _sampleCountImg;
+    VulkanImage _motionImg;
+    VulkanImage _historyWorldPositionImg;
+    VulkanImage _historyWorldNormalImg;
+    VulkanImage _historyColorImg;
+    VulkanImage _historySampleStatsImg;
+    VulkanImage _sparseLightingImg;
+    VulkanImage _reservoirImg;
+    VulkanImage _spatialReservoirImg;
+    VulkanImage _historyReservoirImg;
+    VulkanImage _triangleIdImg;
+    VulkanImage _pathRadianceImg;
+    VulkanImage _displayColorImg;
+    VulkanImage _displayDepthImg;
 
     vk::UniqueFramebuffer _outputFramebuffer;
     vk::UniquePipelineLayout _pipelineLayout;
     vk::UniquePipeline _pipeline;
     LightData _lightData;
     VulkanBuffer _lightBuffer;
-
+    VulkanBuffer _localLightBuffer;
+    uint64_t _localLightsVersion;
+    int32_t _numLocalLights;
+    std::vector<LightData::Light> _distantLights;
+    std::string _environmentFile;
+    uint32_t _environmentMaxWidth;
+    uint32_t _environmentWidth;
+    uint32_t _environmentHeight;
+    VulkanBuffer _cameraBuffer;
+    std::optional<pxr::GfMatrix4f> _drawnWorldToNdc;
+
+    StaticBatcher _staticBatcher;
     size_t _maxTlasInstances;
+    std::vector<BlasInstance> _tlasInstances;
+    std::unordered_map<HVRTMesh*, size_t> _tlasMeshNumClusters;
     VulkanBuffer _instanceBuffer;
     VulkanAccelerationStructure _tlas;
-    size_t _maxScratchMemorySize;
-    VulkanBuffer _scratchBuffers[3];
+    bool _tlasBuilt;
+    uint32_t _tlasUpdateCount;
+    BlasScheduler _blasScheduler;
+    VulkanBuffer _scratchBuffer;
     vk::UniqueDescriptorPool _descriptorPool;
     vk::UniqueDescriptorSetLayout _rtDescriptorSetLayout;
     vk::UniqueDescriptorSet _rtDescriptorSet;
     vk::UniqueShaderModule _raygenShaderModule;
     vk::UniqueShaderModule _missShaderModule;
+    vk::UniqueShaderModule _occlusionMissShaderModule;
     vk::UniqueShaderModule _closestHitShaderModule;
     vk::UniquePipelineLayout _rtPipelineLayout;
-    vk::UniqueHandle<vk::Pipeline, vk::DispatchLoaderDynamic> _rtPipeline;
-    VulkanBuffer _sbtBuffer;
+    VulkanRayTracingPipeline _rtPipeline;
+    vk::UniqueShaderModule _previewShaderModule;
+    vk::UniquePipelineLayout _previewPipelineLayout;
+    vk::UniquePipeline _previewPipeline;
+    vk::UniqueShaderModule _rayQueryShaderModule;
+    vk::UniquePipeline _rayQueryPipeline;
+    vk::UniqueShaderModule _adaptiveShaderModule;
+    vk::UniquePipeline _adaptivePipeline;
+    vk::UniqueShaderModule _reprojectShaderModule;
+    vk::UniquePipeline _reprojectPipeline;
+    vk::UniqueShaderModule _upsampleShaderModule;
+    vk::UniquePipeline _upsamplePipeline;
+    vk::UniqueShaderModule _restirTemporalShaderModule;
+    vk::UniquePipeline _restirTemporalPipeline;
+    vk::UniqueShaderModule _restirSpatialShaderModule;
+    vk::UniquePipeline _restirSpatialPipeline;
+    bool _restirHistoryValid;
+    uint32_t _frameIndex;
+    vk::UniqueShaderModule _pathGenerateShaderModule;
+    vk::UniquePipeline _pathGeneratePipeline;
+    vk::UniqueShaderModule _pathAdvanceShaderModule;
+    vk::UniquePipeline _pathAdvancePipeline;
+    vk::UniqueShaderModule _pathShadeShaderModule;
+    vk::UniquePipeline _pathShadePipeline;
+    vk::UniqueShaderModule _pathShadowShaderModule;
+    vk::UniquePipeline _pathShadowPipeline;
+    vk::UniqueShaderModule _pathSortShaderModule;
+    vk::UniquePipeline _pathSortPipeline;
+    vk::UniqueShaderModule _pathExtendShaderModule;
+    vk::UniquePipeline _pathExtendPipeline;
+    vk::UniqueShaderModule _pathResolveShaderModule;
+    vk::UniquePipeline _pathResolvePipeline;
+    VulkanBuffer _pathCountersBuffer;
+    VulkanBuffer _pathGeometryBuffer;
+    VulkanBuffer _pathStateBuffer;
+    VulkanBuffer _pathHitQueueBuffer;
+    VulkanBuffer _pathRayQueueBuffer;
+    VulkanBuffer _pathNextRayQueueBuffer;
+    VulkanBuffer _pathShadowQueueBuffer;
+    vk::Extent2D _pathBuffersExtent;
+    bool _mustTransitionPathRadiance;
+    bool _pathTraced;
+    uint64_t _pathsLaunched;
+    vk::UniqueShaderModule _radianceCacheResolveShaderModule;
+    vk::UniquePipeline _radianceCacheResolvePipeline;
+    VulkanBuffer _radianceCacheBuffer;
+    VulkanBuffer _environmentBuffer;
+    VulkanBuffer _drawGeometryBuffer;
+    bool _radianceCacheMustClear;
+    vk::UniqueShaderModule _aoBakeShaderModule;
+    vk::UniquePipelineLayout _aoBakePipelineLayout;
+    vk::UniquePipeline _aoBakePipeline;
+    std::unordered_map<HVRTMesh*, std::pair<uint64_t, pxr::GfRange3f>> _aoBakeMeshes;
+    float _aoBakeMaxDistance;
+    bool _aoBaking;
+    VulkanBuffer _unconvergedCountBuffer;
+    bool _adaptiveSampled;
+    bool _adaptiveConverged;
+    vk::UniqueQueryPool _rtTimestampQueryPool;
+    float _rtTimestampPeriod;
+    uint64_t _rtRaysLaunched;
+    Denoiser _denoiser;
+    Upscaler _upscaler;
+    vk::UniqueQueryPool _frameTimestampQueryPool;
+    uint32_t _numFrameTimestamps;
+    int32_t _budgetLevel;
+    int32_t _budgetMovingLevel;
+    int32_t _renderScaleLevel;
+    uint32_t _framesSinceCameraMoved;
+    uint32_t _framesSinceResize;
+
+    uint32_t _samplerStatsSamples;
 
 };
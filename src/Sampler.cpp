@@ -0,0 +1,133 @@
+#include <Common.h>
+
+#include <Sampler.h>
+
+
+static uint32_t hashu(uint32_t x) {
+    x ^= x >> 16u;
+    x *= 0x7feb352du;
+    x ^= x >> 15u;
+    x *= 0x846ca68bu;
+    x ^= x >> 16u;
+    return x;
+}
+
+static uint32_t hashCombine(uint32_t seed, uint32_t value) {
+    return seed ^ (hashu(value) + 0x9e3779b9u + (seed << 6u) + (seed >> 2u));
+}
+
+static uint32_t pcgStep(uint32_t state) {
+    return state * 747796405u + 2891336453u;
+}
+
+static float toUnitFloat(uint32_t x) {
+    return float(x >> 8u) * (1.0f / 16777216.0f);
+}
+
+static uint32_t bitfieldReverse(uint32_t x) {
+    x = ((x >> 1u) & 0x55555555u) | ((x & 0x55555555u) << 1u);
+    x = ((x >> 2u) & 0x33333333u) | ((x & 0x33333333u) << 2u);
+    x = ((x >> 4u) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4u);
+    x = ((x >> 8u) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8u);
+    return (x >> 16u) | (x << 16u);
+}
+
+static uint32_t sobol1(uint32_t index) {
+    uint32_t x = 0u;
+    uint32_t v = 0x80000000u;
+    for (; index != 0u; index >>= 1u) {
+        if ((index & 1u) != 0u) x ^= v;
+        v ^= v >> 1u;
+    }
+    return x;
+}
+
+static uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+    return bitfieldReverse(laineKarrasPermutation(bitfieldReverse(x), seed));
+}
+
+Sampler::Sampler(uint32_t type, uint32_t pixelX, uint32_t pixelY)
+    : _type(type),
+      _pixelX(pixelX),
+      _pixelY(pixelY),
+      _pixelSeed(hashCombine(hashu(pixelX), pixelY)),
+      _index(0),
+      _dimension(0),
+      _pcgState(0)
+{
+}
+
+void Sampler::start(uint32_t sampleIndex) {
+    _index = sampleIndex;
+    _dimension = 0;
+    _pcgState = pcgStep(hashCombine(_pixelSeed, sampleIndex));
+}
+
+void Sampler::startAt(uint32_t sampleIndex, uint32_t dimension) {
+    start(sampleIndex);
+    _dimension = dimension;
+    _pcgState = pcgStep(hashCombine(_pcgState, dimension));
+}
+
+uint32_t Sampler::randu() {
+    uint32_t oldState = _pcgState;
+    _pcgState = pcgStep(_pcgState);
+    uint32_t word = ((oldState >> ((oldState >> 28u) + 4u)) ^ oldState) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+std::pair<float, float> Sampler::sample2D() {
+
+    uint32_t dimension = _dimension++;
+
+    if (_type == SAMPLER_RANDOM) {
+        // Sequenced, since the order of evaluation of function arguments is unspecified.
+        float x = toUnitFloat(randu());
+        float y = toUnitFloat(randu());
+        return { x, y };
+    }
+
+    if (dimension == 0) {
+        uint32_t index = nestedUniformScramble(_index, _pixelSeed);
+        return {
+            toUnitFloat(nestedUniformScramble(bitfieldReverse(index), hashCombine(_pixelSeed, 1u))),
+            toUnitFloat(nestedUniformScramble(sobol1(index), hashCombine(_pixelSeed, 2u))),
+        };
+    }
+
+    const uint32_t R2X = 0xc13fa9a9u;
+    const uint32_t R2Y = 0x91e10da5u;
+    uint32_t offsetX = _pixelX * R2X + _pixelY * R2Y + dimension * R2X;
+    uint32_t offsetY = _pixelX * R2Y + _pixelY * R2X + dimension * R2Y;
+    return { toUnitFloat(offsetX + _index * R2X), toUnitFloat(offsetY + _index * R2Y) };
+}
+
+double measureSamplerRmse(uint32_t type, uint32_t dimension, uint32_t numSamples, uint32_t numPixels) {
+
+    const double radiusSquared = 0.5;
+    const double area = M_PI / 4.0 * radiusSquared;
+    const uint32_t width = 64;
+
+    double squaredErrorSum = 0.0;
+    for (uint32_t pixelI = 0; pixelI < numPixels; pixelI++) {
+        Sampler sampler(type, pixelI % width, pixelI / width);
+        uint32_t numInside = 0;
+        for (uint32_t sampleI = 0; sampleI < numSamples; sampleI++) {
+            sampler.startAt(sampleI, dimension);
+            auto [x, y] = sampler.sample2D();
+            if (double(x) * x + double(y) * y < radiusSquared) numInside++;
+        }
+        double error = double(numInside) / std::max(numSamples, 1u) - area;
+        squaredErrorSum += error * error;
+    }
+    return std::sqrt(squaredErrorSum / std::max(numPixels, 1u));
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <Common.h>
+
+
+// Must match the SAMPLER_ constants in sampler.glsl.
+const uint32_t SAMPLER_RANDOM = 0;
+const uint32_t SAMPLER_LOW_DISCREPANCY = 1;
+
+// A CPU copy of sampler.glsl, so the samplers' convergence can be measured without the GPU. Must
+// match sampler.glsl.
+class Sampler {
+public:
+    Sampler(uint32_t type, uint32_t pixelX, uint32_t pixelY);
+
+    // Starts drawing dimensions for the given sample.
+    void start(uint32_t sampleIndex);
+
+    // Like start(), but skipping to a later dimension.
+    void startAt(uint32_t sampleIndex, uint32_t dimension);
+
+    std::pair<float, float> sample2D();
+
+private:
+    uint32_t randu();
+
+    uint32_t _type;
+    uint32_t _pixelX;
+    uint32_t _pixelY;
+    uint32_t _pixelSeed;
+    uint32_t _index;
+    uint32_t _dimension;
+    uint32_t _pcgState;
+};
+
+// Estimates the area of a quarter disc, which like AO visibility is a step function, at numPixels
+// pixels with numSamples samples each taken from the given dimension pair. Returns the root mean
+// square error of the pixels' estimates.
+double measureSamplerRmse(uint32_t type, uint32_t dimension, uint32_t numSamples, uint32_t numPixels);
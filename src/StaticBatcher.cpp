@@ -0,0 +1,279 @@
+#include <Common.h>
+
+#include <StaticBatcher.h>
+
+
+// Only meshes with at most this many triangles are merged into static batches.
+const size_t STATIC_BATCH_MAX_MESH_TRIANGLES = 4096;
+
+const size_t STATIC_BATCH_MAX_GEOMETRIES = 64;
+const size_t STATIC_BATCH_MAX_TRIANGLES = 64 * 1024;
+
+// A mesh which changes after being batched has to stay unchanged for this many frames before it's
+// batched again, so animated meshes don't keep getting merged and split.
+const uint32_t STATIC_BATCH_MIN_UNCHANGED_FRAMES = 32;
+
+// Meshes are only grouped together if their centers fall into the same cell of a grid with
+// 2^STATIC_BATCH_GRID_BITS cells per axis, spanning all the meshes being grouped.
+const uint32_t STATIC_BATCH_GRID_BITS = 5;
+
+const uint32_t MORTON_BITS = 10;
+
+
+static uint32_t expandMortonBits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xff0000ffu;
+    v = (v * 0x00000101u) & 0x0f00f00fu;
+    v = (v * 0x00000011u) & 0xc30c30c3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+static uint32_t mortonCode(const pxr::GfVec3f& p, const pxr::GfRange3f& bounds) {
+    pxr::GfVec3f size = bounds.GetSize();
+    uint32_t code = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        float t = (size[axis] > 0.0f) ? (p[axis] - bounds.GetMin()[axis]) / size[axis] : 0.0f;
+        uint32_t q = std::min(uint32_t(t * (1u << MORTON_BITS)), (1u << MORTON_BITS) - 1);
+        code |= expandMortonBits(q) << (2 - axis);
+    }
+    return code;
+}
+
+
+StaticBatch::StaticBatch(const VulkanBasicInfo& vkbi, const std::vector<HVRTMesh*>& members)
+    : _vkbi(vkbi),
+      _members(members),
+      _transformBuffer(_vkbi),
+      _as(_vkbi)
+{
+}
+
+void StaticBatch::removeMember(HVRTMesh* mesh) {
+    _members.erase(std::remove(_members.begin(), _members.end(), mesh), _members.end());
+    _membersChanged = true;
+}
+
+void StaticBatch::commitResources() {
+
+    if (!_membersChanged) return;
+    _membersChanged = false;
+
+    // Members are placed in world space by per-geometry transforms rather than having their
+    // vertices copied into the batch.
+
+    size_t transformBufferSize = _members.size() * sizeof(vk::TransformMatrixKHR);
+    if (_transformBuffer.size() < transformBufferSize) {
+        _transformBuffer.allocate(
+            transformBufferSize,
+            true,
+            vk::BufferUsageFlagBits::eRayTracingKHR
+            | vk::BufferUsageFlagBits::eShaderDeviceAddress);
+    }
+    vk::TransformMatrixKHR* transforms =
+        reinterpret_cast<vk::TransformMatrixKHR*>(_transformBuffer.data());
+
+    _geometries.clear();
+    _numTriangles = 0;
+    for (size_t i = 0; i < _members.size(); i++) {
+        HVRTMesh* mesh = _members[i];
+
+        auto modelToWorldT = mesh->getModelToWorld().GetTranspose();
+        std::memcpy(&transforms[i].matrix[0][0], modelToWorldT.data(), 12 * sizeof(float));
+
+        _geometries.push_back({
+            .vertexBuffer = &mesh->getVertexBuffer(),
+            .indexBuffer = &mesh->getIndexBuffer(),
+            .transformBuffer = &_transformBuffer,
+            .numVertices = uint32_t(mesh->getNumVertices()),
+            .firstTriangle = 0,
+            .numTriangles = uint32_t(mesh->getNumTriangles()),
+            .transformOffset = uint32_t(i * sizeof(vk::TransformMatrixKHR)),
+        });
+        _numTriangles += mesh->getNumTriangles();
+    }
+
+    // Membership changes are rare, so just re-allocate for the new set of geometries.
+    _as.allocateStaticBottomLevel(
+        _geometries,
+        VulkanAccelerationStructure::preferHostBuild(_vkbi, _numTriangles));
+    _needsRebuild = true;
+    _reallocated = true;
+}
+
+void StaticBatch::getASBuildInfo(
+    bool* blasChanged,
+    bool* instanceChanged,
+    bool* blasReallocated,
+    vk::AccelerationStructureInstanceKHR* instance,
+    uint64_t* scratchMemorySize)
+{
+    *blasChanged = _needsRebuild;
+    *instanceChanged = _reallocated;
+    *blasReallocated = _reallocated;
+    _reallocated = false;
+
+    *instance = {
+        .transform = {},
+        .instanceCustomIndex = 0,
+        .mask = 0xff,
+        .instanceShaderBindingTableRecordOffset = 0,
+        .flags = vk::GeometryInstanceFlagsKHR(),
+        .accelerationStructureReference = _as.getDeviceAddress(),
+    };
+    const float identity[12] = {
+        1.0f, 0.0f, 0.0f, 0.0f,
+        0.0f, 1.0f, 0.0f, 0.0f,
+        0.0f, 0.0f, 1.0f, 0.0f,
+    };
+    std::memcpy(&instance->transform.matrix[0][0], identity, 12 * sizeof(float));
+
+    *scratchMemorySize = _as.getScratchMemorySize();
+}
+
+void StaticBatch::buildAS(VulkanAccelerationStructureBuildBatch& batch, vk::DeviceAddress scratchAddress) {
+    if (_needsRebuild) {
+        _as.buildBottomLevel(batch, scratchAddress, _geometries);
+        _needsRebuild = false;
+    }
+}
+
+
+StaticBatcher::StaticBatcher(const VulkanBasicInfo& vkbi) : _vkbi(vkbi)
+{
+}
+
+bool StaticBatcher::update(const std::unordered_set<HVRTMesh*>& meshes) {
+
+    bool changed = false;
+    bool hasNewCandidates = false;
+
+    // Remove deleted meshes from their batches.
+
+    for (auto it = _meshStates.begin(); it != _meshStates.end();) {
+        if (meshes.find(it->first) == meshes.end()) {
+            if (it->second.batch) {
+                it->second.batch->removeMember(it->first);
+                changed = true;
+            }
+            it = _meshStates.erase(it);
+        } else {
+            it++;
+        }
+    }
+
+    // Remove changed meshes from their batches. New meshes are assumed to be static until they
+    // change, so initial scene loads get batched right away.
+
+    for (HVRTMesh* mesh : meshes) {
+
+        auto [it, inserted] = _meshStates.try_emplace(
+            mesh,
+            MeshState{ mesh->getVersion(), STATIC_BATCH_MIN_UNCHANGED_FRAMES, nullptr });
+        MeshState& state = it->second;
+
+        if (inserted) {
+            hasNewCandidates = true;
+        } else if (state.version != mesh->getVersion()) {
+            state.version = mesh->getVersion();
+            state.framesUnchanged = 0;
+            if (state.batch) {
+                state.batch->removeMember(mesh);
+                state.batch = nullptr;
+                changed = true;
+            }
+        } else if (state.framesUnchanged < STATIC_BATCH_MIN_UNCHANGED_FRAMES) {
+            state.framesUnchanged++;
+            hasNewCandidates |= (state.framesUnchanged == STATIC_BATCH_MIN_UNCHANGED_FRAMES);
+        }
+    }
+
+    // Dissolve batches which have become too small to be worth keeping.
+
+    for (auto it = _batches.begin(); it != _batches.end();) {
+        if (it->getMembers().size() < 2) {
+            for (HVRTMesh* mesh : it->getMembers()) {
+                _meshStates[mesh].batch = nullptr;
+            }
+            it = _batches.erase(it);
+            changed = true;
+            hasNewCandidates = true;
+        } else {
+            it++;
+        }
+    }
+
+    // Group small static meshes which aren't batched yet. Existing batches are left alone.
+
+    if (hasNewCandidates) {
+
+        std::vector<HVRTMesh*> candidates;
+        for (auto& [mesh, state] : _meshStates) {
+            if (state.batch == nullptr
+                && state.framesUnchanged >= STATIC_BATCH_MIN_UNCHANGED_FRAMES
+                && mesh->getNumClusters() == 1
+                && mesh->getNumTriangles() > 0
+                && mesh->getNumTriangles() <= STATIC_BATCH_MAX_MESH_TRIANGLES)
+            {
+                candidates.push_back(mesh);
+            }
+        }
+
+        size_t numBatches = _batches.size();
+        _groupMeshes(candidates);
+        changed |= (_batches.size() != numBatches);
+    }
+
+    for (StaticBatch& batch : _batches) {
+        batch.commitResources();
+    }
+
+    return changed;
+}
+
+void StaticBatcher::_groupMeshes(std::vector<HVRTMesh*>& meshes) {
+
+    if (meshes.size() < 2) return;
+
+    // Sort meshes along a Morton curve over their centers so that nearby meshes end up next to
+    // each other, then cut the sorted list into batches.
+
+    pxr::GfRange3f bounds;
+    for (HVRTMesh* mesh : meshes) {
+        bounds.UnionWith(mesh->getWorldBounds().GetMidpoint());
+    }
+
+    std::vector<std::pair<uint32_t, HVRTMesh*>> sortedMeshes;
+    sortedMeshes.reserve(meshes.size());
+    for (HVRTMesh* mesh : meshes) {
+        sortedMeshes.emplace_back(mortonCode(mesh->getWorldBounds().GetMidpoint(), bounds), mesh);
+    }
+    std::sort(sortedMeshes.begin(), sortedMeshes.end());
+
+    const uint32_t cellShift = 3 * (MORTON_BITS - STATIC_BATCH_GRID_BITS);
+
+    size_t i = 0;
+    while (i < sortedMeshes.size()) {
+
+        uint32_t cell = sortedMeshes[i].first >> cellShift;
+        std::vector<HVRTMesh*> members;
+        size_t numTriangles = 0;
+        for (; i < sortedMeshes.size(); i++) {
+            HVRTMesh* mesh = sortedMeshes[i].second;
+            if ((sortedMeshes[i].first >> cellShift) != cell
+                || members.size() == STATIC_BATCH_MAX_GEOMETRIES
+                || numTriangles + mesh->getNumTriangles() > STATIC_BATCH_MAX_TRIANGLES)
+            {
+                break;
+            }
+            members.push_back(mesh);
+            numTriangles += mesh->getNumTriangles();
+        }
+
+        if (members.size() < 2) continue;
+
+        _batches.emplace_back(_vkbi, members);
+        for (HVRTMesh* mesh : members) {
+            _meshStates[mesh].batch = &_batches.back();
+        }
+    }
+}
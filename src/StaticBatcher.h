@@ -0,0 +1,157 @@
+#pragma once
+
+#include <Common.h>
+
+#include <VulkanUtils.h>
+#include <VulkanBuffer.h>
+#include <VulkanAccelerationStructure.h>
+#include <Mesh.h>
+
+
+// Several small static meshes merged into one multi-geometry BLAS. Each member keeps its own vertex
+// and index buffers, and is placed in world space by a per-geometry transform, so the batch's TLAS
+// instance uses the identity transform.
+class StaticBatch {
+
+public:
+
+    StaticBatch(const VulkanBasicInfo& vkbi, const std::vector<HVRTMesh*>& members);
+
+    const std::vector<HVRTMesh*>& getMembers() {
+        return _members;
+    }
+
+    // Maps a hit's geometry index (gl_GeometryIndexEXT) back to the mesh it belongs to.
+    HVRTMesh* getGeometryMesh(uint32_t geometryIndex) {
+        return _members[geometryIndex];
+    }
+
+    size_t getNumTriangles() {
+        return _numTriangles;
+    }
+
+    void removeMember(HVRTMesh* mesh);
+
+    void commitResources();
+
+    void getASBuildInfo(
+        bool* blasChanged,
+        bool* instanceChanged,
+        bool* blasReallocated,
+        vk::AccelerationStructureInstanceKHR* instance,
+        uint64_t* scratchMemorySize);
+
+    void buildAS(VulkanAccelerationStructureBuildBatch& batch, vk::DeviceAddress scratchAddress);
+
+private:
+
+    const VulkanBasicInfo& _vkbi;
+
+    std::vector<HVRTMesh*> _members;
+    size_t _numTriangles = 0;
+
+    bool _membersChanged = true;
+    bool _needsRebuild = false;
+    bool _reallocated = false;
+    std::vector<VulkanAccelerationStructure::Geometry> _geometries;
+    VulkanBuffer _transformBuffer;
+    VulkanAccelerationStructure _as;
+
+};
+
+
+// Contributes one BLAS and one TLAS instance: either a cluster of a standalone mesh, or a whole
+// static batch.
+struct BlasInstance {
+
+    HVRTMesh* mesh;
+    size_t cluster;
+    StaticBatch* batch;
+
+    size_t getNumTriangles() const {
+        return batch ? batch->getNumTriangles() : mesh->getClusterNumTriangles(cluster);
+    }
+
+    HVRTMesh* getGeometryMesh(uint32_t geometryIndex) const {
+        return batch ? batch->getGeometryMesh(geometryIndex) : mesh;
+    }
+
+    size_t getNumGeometries() const {
+        return batch ? batch->getMembers().size() : 1;
+    }
+
+    void getASBuildInfo(
+        bool* blasChanged,
+        bool* instanceChanged,
+        bool* blasReallocated,
+        vk::AccelerationStructureInstanceKHR* instance,
+        uint64_t* scratchMemorySize) const
+    {
+        if (batch) {
+            batch->getASBuildInfo(
+                blasChanged,
+                instanceChanged,
+                blasReallocated,
+                instance,
+                scratchMemorySize);
+        } else {
+            mesh->getASBuildInfo(
+                cluster,
+                blasChanged,
+                instanceChanged,
+                blasReallocated,
+                instance,
+                scratchMemorySize);
+        }
+    }
+
+    void buildAS(VulkanAccelerationStructureBuildBatch& asBatch, vk::DeviceAddress scratchAddress) const {
+        if (batch) {
+            batch->buildAS(asBatch, scratchAddress);
+        } else {
+            mesh->buildAS(cluster, asBatch, scratchAddress);
+        }
+    }
+
+};
+
+
+// Groups small meshes which haven't changed in a while into static batches, so scenes with huge
+// numbers of tiny props don't end up with a huge TLAS full of overlapping instances. Regrouping is
+// incremental: a member which changes is just removed from its batch, and only meshes which aren't
+// batched yet are grouped into new batches.
+class StaticBatcher {
+
+public:
+
+    StaticBatcher(const VulkanBasicInfo& vkbi);
+
+    // Returns whether any batch membership changed, in which case the TLAS instances must be
+    // re-assigned.
+    bool update(const std::unordered_set<HVRTMesh*>& meshes);
+
+    bool isBatched(HVRTMesh* mesh) {
+        auto it = _meshStates.find(mesh);
+        return it != _meshStates.end() && it->second.batch != nullptr;
+    }
+
+    std::list<StaticBatch>& getBatches() {
+        return _batches;
+    }
+
+private:
+
+    struct MeshState {
+        uint64_t version;
+        uint32_t framesUnchanged;
+        StaticBatch* batch;
+    };
+
+    void _groupMeshes(std::vector<HVRTMesh*>& meshes);
+
+    const VulkanBasicInfo& _vkbi;
+
+    std::unordered_map<HVRTMesh*, MeshState> _meshStates;
+    std::list<StaticBatch> _batches;
+
+};
@@ -0,0 +1,171 @@
+#include <Common.h>
+
+#include <Upscaler.h>
+
+
+// Must match local_size in upscale.comp.
+const uint32_t UPSCALE_TILE_SIZE = 8;
+
+
+Upscaler::Upscaler(const VulkanBasicInfo& vkbi)
+    : _vkbi(vkbi),
+      _mustTransitionImages(false)
+{
+    _depthSampler = _vkbi.device.createSamplerUnique({
+        .magFilter = vk::Filter::eNearest,
+        .minFilter = vk::Filter::eNearest,
+        .mipmapMode = vk::SamplerMipmapMode::eNearest,
+        .addressModeU = vk::SamplerAddressMode::eClampToEdge,
+        .addressModeV = vk::SamplerAddressMode::eClampToEdge,
+        .addressModeW = vk::SamplerAddressMode::eClampToEdge,
+    });
+
+    vk::DescriptorPoolSize descriptorPoolSizes[] = {
+        {
+            .type = vk::DescriptorType::eStorageImage,
+            .descriptorCount = 3,
+        },
+        {
+            .type = vk::DescriptorType::eCombinedImageSampler,
+            .descriptorCount = 1,
+        },
+    };
+    _descriptorPool = _vkbi.device.createDescriptorPoolUnique({
+        vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet,
+        1,
+        2,
+        descriptorPoolSizes,
+    });
+
+    vk::DescriptorSetLayoutBinding bindings[] = {
+        { 0, vk::DescriptorType::eStorageImage, 1, vk::ShaderStageFlagBits::eCompute },
+        { 1, vk::DescriptorType::eCombinedImageSampler, 1, vk::ShaderStageFlagBits::eCompute },
+        { 2, vk::DescriptorType::eStorageImage, 1, vk::ShaderStageFlagBits::eCompute },
+        { 3, vk::DescriptorType::eStorageImage, 1, vk::ShaderStageFlagBits::eCompute },
+    };
+    _descriptorSetLayout = _vkbi.device.createDescriptorSetLayoutUnique(
+        vk::DescriptorSetLayoutCreateInfo({}, bindings));
+
+    std::vector<vk::UniqueDescriptorSet> descriptorSets = _vkbi.device.allocateDescriptorSetsUnique({
+        _descriptorPool.get(),
+        1,
+        &_descriptorSetLayout.get(),
+    });
+    _descriptorSet = std::move(descriptorSets[0]);
+
+    _pipelineLayout = _vkbi.device.createPipelineLayoutUnique({
+        {},
+        1,
+        &_descriptorSetLayout.get(),
+        0,
+        nullptr,
+    });
+
+    _shaderModule = loadShaderModule(_vkbi, "upscale.comp");
+
+    _pipeline = _vkbi.device.createComputePipelineUnique(
+        {},
+        vk::ComputePipelineCreateInfo(
+            {},
+            { {}, vk::ShaderStageFlagBits::eCompute, _shaderModule.get(), "main" },
+            _pipelineLayout.get()));
+}
+
+void Upscaler::setImages(
+    VulkanImage& colorImg,
+    VulkanImage& depthImg,
+    vk::Extent2D displayExtent,
+    VulkanImage& displayColorImg,
+    VulkanImage& displayDepthImg)
+{
+    _displayExtent = displayExtent;
+    _depthImage = depthImg.getImage();
+    _displayColorImage = displayColorImg.getImage();
+    _displayDepthImage = displayDepthImg.getImage();
+
+    // The display images are entirely overwritten every frame, so even if they're the same images
+    // as before, transitioning them again from eUndefined is harmless.
+    _mustTransitionImages = true;
+
+    vk::DescriptorImageInfo imageInfos[] = {
+        { {}, colorImg.getImageView(), vk::ImageLayout::eGeneral },
+        { _depthSampler.get(), depthImg.getImageView(), vk::ImageLayout::eShaderReadOnlyOptimal },
+        { {}, displayColorImg.getImageView(), vk::ImageLayout::eGeneral },
+        { {}, displayDepthImg.getImageView(), vk::ImageLayout::eGeneral },
+    };
+    vk::WriteDescriptorSet writeDescriptorSets[4];
+    for (uint32_t i = 0; i < 4; i++) {
+        writeDescriptorSets[i] = {
+            _descriptorSet.get(),
+            i,
+            0,
+            1,
+            i == 1 ? vk::DescriptorType::eCombinedImageSampler : vk::DescriptorType::eStorageImage,
+            &imageInfos[i],
+            nullptr,
+            nullptr,
+        };
+    }
+    _vkbi.device.updateDescriptorSets(4, writeDescriptorSets, 0, nullptr);
+}
+
+void Upscaler::upscale(vk::UniqueCommandBuffer& commandBuffer) {
+
+    std::vector<vk::ImageMemoryBarrier> imageBarriers;
+
+    if (_mustTransitionImages) {
+
+        // Transition the display images from eUndefined to eGeneral so we can store to them.
+        for (vk::Image image : { _displayColorImage, _displayDepthImage }) {
+            imageBarriers.push_back({
+                .srcAccessMask = vk::AccessFlags(),
+                .dstAccessMask = vk::AccessFlagBits::eShaderWrite,
+                .oldLayout = vk::ImageLayout::eUndefined,
+                .newLayout = vk::ImageLayout::eGeneral,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image = image,
+                .subresourceRange = { vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 },
+            });
+        }
+        _mustTransitionImages = false;
+    }
+
+    // Wait for the finished frame, and make the depth image sampleable.
+    imageBarriers.push_back({
+        .srcAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+        .dstAccessMask = vk::AccessFlagBits::eShaderRead,
+        .oldLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal,
+        .newLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = _depthImage,
+        .subresourceRange = { vk::ImageAspectFlagBits::eDepth, 0, 1, 0, 1 },
+    });
+    vk::MemoryBarrier colorBarrier = {
+        .srcAccessMask = vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eShaderWrite,
+        .dstAccessMask = vk::AccessFlagBits::eShaderRead,
+    };
+    commandBuffer->pipelineBarrier(
+        vk::PipelineStageFlagBits::eColorAttachmentOutput
+        | vk::PipelineStageFlagBits::eLateFragmentTests
+        | vk::PipelineStageFlagBits::eRayTracingShaderKHR
+        | vk::PipelineStageFlagBits::eComputeShader,
+        vk::PipelineStageFlagBits::eComputeShader,
+        vk::DependencyFlags(),
+        1, &colorBarrier,
+        0, nullptr,
+        imageBarriers.size(), imageBarriers.data());
+
+    commandBuffer->bindPipeline(vk::PipelineBindPoint::eCompute, _pipeline.get());
+    commandBuffer->bindDescriptorSets(
+        vk::PipelineBindPoint::eCompute,
+        _pipelineLayout.get(),
+        0,
+        { _descriptorSet.get() },
+        {});
+    commandBuffer->dispatch(
+        (_displayExtent.width + UPSCALE_TILE_SIZE - 1) / UPSCALE_TILE_SIZE,
+        (_displayExtent.height + UPSCALE_TILE_SIZE - 1) / UPSCALE_TILE_SIZE,
+        1);
+}
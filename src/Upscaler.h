@@ -0,0 +1,49 @@
+#pragma once
+
+#include <Common.h>
+
+#include <VulkanUtils.h>
+#include <VulkanImage.h>
+
+
+// Resizes the rendered frame from the internal render resolution to the viewport's, into the images
+// shared with GL for the blit. Color is filtered bilinearly, and depth takes the nearest pixel.
+class Upscaler {
+
+public:
+
+    Upscaler(const VulkanBasicInfo& vkbi);
+
+    // The images must stay alive until the next call to setImages(). The depth image must have been
+    // created for sampling, and the display images for storage.
+    void setImages(
+        VulkanImage& colorImg,
+        VulkanImage& depthImg,
+        vk::Extent2D displayExtent,
+        VulkanImage& displayColorImg,
+        VulkanImage& displayDepthImg);
+
+    // Records the pass. The color image must hold the finished frame, written either as a color
+    // attachment or by the ray tracing or compute shader stages, and the depth image must have just
+    // been rendered to in eDepthStencilAttachmentOptimal. It's left in eShaderReadOnlyOptimal.
+    void upscale(vk::UniqueCommandBuffer& commandBuffer);
+
+private:
+
+    const VulkanBasicInfo& _vkbi;
+
+    vk::Extent2D _displayExtent;
+    vk::Image _depthImage;
+    vk::Image _displayColorImage;
+    vk::Image _displayDepthImage;
+    bool _mustTransitionImages;
+
+    vk::UniqueSampler _depthSampler;
+    vk::UniqueDescriptorPool _descriptorPool;
+    vk::UniqueDescriptorSetLayout _descriptorSetLayout;
+    vk::UniqueDescriptorSet _descriptorSet;
+    vk::UniquePipelineLayout _pipelineLayout;
+    vk::UniqueShaderModule _shaderModule;
+    vk::UniquePipeline _pipeline;
+
+};
@@ -1,16 +1,134 @@
 #include <Common.h>
 
+#include <Blackboard.h>
+#include <ASCache.h>
+
 #include <VulkanAccelerationStructure.h>
 
 
 const vk::BuildAccelerationStructureFlagsKHR TOP_LEVEL_BUILD_FLAGS =
-    vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
+    vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace
+    | vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate;
 
 const vk::BuildAccelerationStructureFlagsKHR BOTTOM_LEVEL_BUILD_FLAGS =
     vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild
     // | vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction // TODO
     | vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate;
 
+const vk::BuildAccelerationStructureFlagsKHR STATIC_BOTTOM_LEVEL_BUILD_FLAGS =
+    vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
+
+// Serialized ASes start with the driver and compatibility UUIDs, then the serialized size, then the
+// size needed to deserialize them.
+const size_t SERIALIZED_DESERIALIZED_SIZE_OFFSET = 2 * VK_UUID_SIZE + sizeof(uint64_t);
+
+
+// The same geometry built with different settings gives a different AS, so include them in the key.
+static uint64_t getCacheKey(
+    uint64_t geometryKey,
+    vk::AccelerationStructureTypeKHR type,
+    vk::BuildAccelerationStructureFlagsKHR flags)
+{
+    uint64_t buildKey[2] = {
+        uint64_t(type),
+        uint64_t(VkBuildAccelerationStructureFlagsKHR(flags)),
+    };
+    return ASCache::hash(buildKey, sizeof(buildKey), geometryKey);
+}
+
+
+VulkanAccelerationStructureBuildBatch::VulkanAccelerationStructureBuildBatch(
+    const VulkanBasicInfo& vkbi)
+    : _vkbi(vkbi)
+{
+}
+
+void VulkanAccelerationStructureBuildBatch::clear() {
+    _builds.clear();
+    _hostBuilds.clear();
+    _deserializations.clear();
+}
+
+void VulkanAccelerationStructureBuildBatch::buildOnHost() {
+
+    if (_hostBuilds.empty()) return;
+
+    // Each build gets its own deferred operation, and every operation is joined by as many TBB
+    // tasks as it can use, so big builds are split over several threads while small ones just run
+    // alongside each other.
+
+    std::vector<vk::UniqueHandle<vk::DeferredOperationKHR, vk::DispatchLoaderDynamic>> operations;
+    for (Build& build : _hostBuilds) {
+
+        operations.push_back(_vkbi.device.createDeferredOperationKHRUnique(nullptr, _vkbi.dispatchLoader));
+        vk::DeferredOperationInfoKHR deferredOperationInfo = {
+            .operationHandle = operations.back().get(),
+        };
+
+        vk::AccelerationStructureBuildGeometryInfoKHR buildGeometryInfo = build.buildGeometryInfo;
+        buildGeometryInfo.scratchData = vk::DeviceOrHostAddressKHR(build.hostScratch.data());
+        buildGeometryInfo.setPNext(&deferredOperationInfo);
+        vk::AccelerationStructureBuildOffsetInfoKHR* offsets = build.offsets.data();
+
+        _vkbi.device.buildAccelerationStructureKHR(1, &buildGeometryInfo, &offsets, _vkbi.dispatchLoader);
+    }
+
+    tbb::task_group taskGroup;
+    for (auto& operation : operations) {
+
+        vk::DeferredOperationKHR operationHandle = operation.get();
+        uint32_t concurrency = std::max(
+            std::min(
+                _vkbi.device.getDeferredOperationMaxConcurrencyKHR(operationHandle, _vkbi.dispatchLoader),
+                std::thread::hardware_concurrency()),
+            1u);
+
+        for (uint32_t i = 0; i < concurrency; i++) {
+            taskGroup.run([this, operationHandle]() {
+                vk::Result result;
+                do {
+                    result = _vkbi.device.deferredOperationJoinKHR(operationHandle, _vkbi.dispatchLoader);
+                } while (result == vk::Result::eThreadIdleKHR);
+            });
+        }
+    }
+    taskGroup.wait();
+
+    for (auto& operation : operations) {
+        if (_vkbi.device.getDeferredOperationResultKHR(operation.get(), _vkbi.dispatchLoader)
+            != vk::Result::eSuccess)
+        {
+            throw std::runtime_error("Host acceleration structure build failed.");
+        }
+    }
+
+    _hostBuilds.clear();
+}
+
+void VulkanAccelerationStructureBuildBatch::record(vk::CommandBuffer& commandBuffer) {
+
+    for (const vk::CopyMemoryToAccelerationStructureInfoKHR& deserialization : _deserializations) {
+        commandBuffer.copyMemoryToAccelerationStructureKHR(deserialization, _vkbi.dispatchLoader);
+    }
+
+    if (_builds.empty()) return;
+
+    std::vector<vk::AccelerationStructureBuildGeometryInfoKHR> asBuildGeometryInfos;
+    std::vector<vk::AccelerationStructureBuildOffsetInfoKHR*> offsets;
+    asBuildGeometryInfos.reserve(_builds.size());
+    offsets.reserve(_builds.size());
+    for (Build& build : _builds) {
+        asBuildGeometryInfos.push_back(build.buildGeometryInfo);
+        offsets.push_back(build.offsets.data());
+    }
+
+    commandBuffer.buildAccelerationStructureKHR(
+        asBuildGeometryInfos.size(),
+        asBuildGeometryInfos.data(),
+        offsets.data(),
+        _vkbi.dispatchLoader);
+}
+
 
 VulkanAccelerationStructure::VulkanAccelerationStructure(const VulkanBasicInfo& vkbi)
     : _vkbi(vkbi),
@@ -18,6 +136,23 @@ VulkanAccelerationStructure::VulkanAccelerationStructure(const VulkanBasicInfo&
 {
 }
 
+VulkanAccelerationStructure::~VulkanAccelerationStructure() {
+    _cancelCacheStore();
+}
+
+void VulkanAccelerationStructure::_cancelCacheStore() {
+    if (_pendingStoreCache) {
+        _pendingStoreCache->cancelStore(*this);
+    }
+}
+
+bool VulkanAccelerationStructure::preferHostBuild(const VulkanBasicInfo& vkbi, size_t numTriangles) {
+    return
+        vkbi.hostAccelerationStructureCommands
+        && getInt("hostASBuilds", 0) != 0
+        && numTriangles <= size_t(std::max(getInt("hostASBuildMaxTriangles", 64 * 1024), 0));
+}
+
 uint64_t VulkanAccelerationStructure::_getRequiredMemorySize(
     vk::AccelerationStructureMemoryRequirementsTypeKHR type)
 {
@@ -25,7 +160,10 @@ uint64_t VulkanAccelerationStructure::_getRequiredMemorySize(
         _vkbi.device.getAccelerationStructureMemoryRequirementsKHR(
             {
                 .type = type,
-                .buildType = vk::AccelerationStructureBuildTypeKHR::eDevice,
+                .buildType =
+                    _hostBuild
+                    ? vk::AccelerationStructureBuildTypeKHR::eHost
+                    : vk::AccelerationStructureBuildTypeKHR::eDevice,
                 .accelerationStructure = _as.get(),
             },
             _vkbi.dispatchLoader).memoryRequirements;
@@ -33,21 +171,38 @@ uint64_t VulkanAccelerationStructure::_getRequiredMemorySize(
 }
 
 void VulkanAccelerationStructure::_allocate(
-    const vk::AccelerationStructureCreateGeometryTypeInfoKHR& asCreateGeometryTypeInfo,
+    const std::vector<vk::AccelerationStructureCreateGeometryTypeInfoKHR>& asCreateGeometryTypeInfos,
     vk::AccelerationStructureTypeKHR asType,
-    vk::BuildAccelerationStructureFlagsKHR asFlags)
+    vk::BuildAccelerationStructureFlagsKHR asFlags,
+    bool hostBuild)
 {
-    _as.reset();
-
-    _as = _vkbi.device.createAccelerationStructureKHRUnique(
+    _create(
         {
             .compactedSize = 0,
             .type = asType,
             .flags = asFlags,
-            .maxGeometryCount = 1,
-            .pGeometryInfos = &asCreateGeometryTypeInfo,
+            .maxGeometryCount = uint32_t(asCreateGeometryTypeInfos.size()),
+            .pGeometryInfos = asCreateGeometryTypeInfos.data(),
             .deviceAddress = 0,
         },
+        hostBuild);
+}
+
+void VulkanAccelerationStructure::_create(
+    const vk::AccelerationStructureCreateInfoKHR& asCreateInfo,
+    bool hostBuild)
+{
+    _cancelCacheStore();
+    _deserialized = false;
+    _serializedBuffer.reset();
+
+    _as.reset();
+
+    _type = asCreateInfo.type;
+    _flags = asCreateInfo.flags;
+    _hostBuild = hostBuild;
+    _as = _vkbi.device.createAccelerationStructureKHRUnique(
+        asCreateInfo,
         nullptr,
         _vkbi.dispatchLoader);
 
@@ -64,9 +219,10 @@ void VulkanAccelerationStructure::_allocate(
         scratchUpdateMemorySize);
 
     // TODO: Don't reallocate if size is sufficient.
+    // Host builds write the AS directly, so it has to be host-visible.
     _buffer.allocate(
         _getRequiredMemorySize(vk::AccelerationStructureMemoryRequirementsTypeKHR::eObject),
-        false,
+        _hostBuild,
         vk::BufferUsageFlagBits::eRayTracingKHR);
 
     vk::BindAccelerationStructureMemoryInfoKHR bindASMemoryInfo = {
@@ -77,129 +233,254 @@ void VulkanAccelerationStructure::_allocate(
         .pDeviceIndices = nullptr,
     };
     _vkbi.device.bindAccelerationStructureMemoryKHR(1, &bindASMemoryInfo, _vkbi.dispatchLoader);
+
+    // The address only changes when the AS is re-allocated, so cache it rather than querying it
+    // for every instance on every frame.
+    _deviceAddress = _vkbi.device.getAccelerationStructureAddressKHR({
+            .accelerationStructure = _as.get(),
+        },
+        _vkbi.dispatchLoader);
 }
 
 void VulkanAccelerationStructure::allocateTopLevel(uint32_t maxInstances) {
 
     _allocate(
         {
-            .geometryType = vk::GeometryTypeKHR::eInstances,
-            .maxPrimitiveCount = maxInstances,
-            .indexType = vk::IndexType::eNoneKHR,
-            .maxVertexCount = 0,
-            .vertexFormat = vk::Format::eUndefined,
-            .allowsTransforms = true,
+            {
+                .geometryType = vk::GeometryTypeKHR::eInstances,
+                .maxPrimitiveCount = maxInstances,
+                .indexType = vk::IndexType::eNoneKHR,
+                .maxVertexCount = 0,
+                .vertexFormat = vk::Format::eUndefined,
+                .allowsTransforms = true,
+            },
         },
         vk::AccelerationStructureTypeKHR::eTopLevel,
         TOP_LEVEL_BUILD_FLAGS);
 }
 
-void VulkanAccelerationStructure::allocateBottomLevel(uint32_t maxVertices, uint32_t maxTriangles) {
+void VulkanAccelerationStructure::allocateBottomLevel(
+    uint32_t maxVertices,
+    uint32_t maxTriangles,
+    bool hostBuild)
+{
 
     _allocate(
         {
+            {
+                .geometryType = vk::GeometryTypeKHR::eTriangles,
+                .maxPrimitiveCount = maxTriangles,
+                .indexType = vk::IndexType::eUint32,
+                .maxVertexCount = maxVertices,
+                .vertexFormat = vk::Format::eR32G32B32Sfloat,
+                .allowsTransforms = false,
+            },
+        },
+        vk::AccelerationStructureTypeKHR::eBottomLevel,
+        BOTTOM_LEVEL_BUILD_FLAGS,
+        hostBuild);
+}
+
+void VulkanAccelerationStructure::allocateStaticBottomLevel(
+    const std::vector<Geometry>& geometries,
+    bool hostBuild)
+{
+
+    std::vector<vk::AccelerationStructureCreateGeometryTypeInfoKHR> asCreateGeometryTypeInfos;
+    for (const Geometry& geometry : geometries) {
+        asCreateGeometryTypeInfos.push_back({
             .geometryType = vk::GeometryTypeKHR::eTriangles,
-            .maxPrimitiveCount = maxTriangles,
+            .maxPrimitiveCount = geometry.numTriangles,
             .indexType = vk::IndexType::eUint32,
-            .maxVertexCount = maxVertices,
+            .maxVertexCount = geometry.numVertices,
             .vertexFormat = vk::Format::eR32G32B32Sfloat,
-            .allowsTransforms = false,
-        },
+            .allowsTransforms = (geometry.transformBuffer != nullptr),
+        });
+    }
+
+    _allocate(
+        asCreateGeometryTypeInfos,
         vk::AccelerationStructureTypeKHR::eBottomLevel,
-        BOTTOM_LEVEL_BUILD_FLAGS);
+        STATIC_BOTTOM_LEVEL_BUILD_FLAGS,
+        hostBuild);
+}
+
+bool VulkanAccelerationStructure::allocateBottomLevelFromCache(ASCache& cache, uint64_t key) {
+
+    std::unique_ptr<VulkanBuffer> serializedBuffer = cache.load(
+        getCacheKey(key, vk::AccelerationStructureTypeKHR::eBottomLevel, BOTTOM_LEVEL_BUILD_FLAGS));
+    if (!serializedBuffer) return false;
+
+    uint64_t deserializedSize;
+    std::memcpy(
+        &deserializedSize,
+        reinterpret_cast<const uint8_t*>(serializedBuffer->data()) + SERIALIZED_DESERIALIZED_SIZE_OFFSET,
+        sizeof(uint64_t));
+
+    _create({
+        .compactedSize = deserializedSize,
+        .type = vk::AccelerationStructureTypeKHR::eBottomLevel,
+        .flags = BOTTOM_LEVEL_BUILD_FLAGS,
+        .maxGeometryCount = 0,
+        .pGeometryInfos = nullptr,
+        .deviceAddress = 0,
+    });
+    _deserialized = true;
+    _deserializeCache = &cache;
+    _serializedBuffer = std::move(serializedBuffer);
+
+    return true;
+}
+
+void VulkanAccelerationStructure::deserialize(VulkanAccelerationStructureBuildBatch& batch) {
+
+    if (!_serializedBuffer) return;
+
+    batch._deserializations.push_back({
+        .src = vk::DeviceOrHostAddressConstKHR(_serializedBuffer->getDeviceAddress()),
+        .dst = _as.get(),
+        .mode = vk::CopyAccelerationStructureModeKHR::eDeserialize,
+    });
+
+    // The upload must stay alive until the batch has executed.
+    _deserializeCache->retireBuffer(std::move(_serializedBuffer));
+}
+
+void VulkanAccelerationStructure::queueCacheStore(ASCache& cache, uint64_t key) {
+    cache.queueStore(*this, getCacheKey(key, _type, _flags));
 }
 
 void VulkanAccelerationStructure::_build(
-    vk::CommandBuffer& commandBuffer,
-    VulkanBuffer& scratchBuffer,
-    vk::AccelerationStructureGeometryKHR& asGeometry,
-    vk::AccelerationStructureTypeKHR asType,
-    vk::BuildAccelerationStructureFlagsKHR asFlags,
-    uint32_t numPrimitives,
+    VulkanAccelerationStructureBuildBatch& batch,
+    vk::DeviceAddress scratchAddress,
+    const std::vector<vk::AccelerationStructureGeometryKHR>& asGeometries,
+    const std::vector<vk::AccelerationStructureBuildOffsetInfoKHR>& offsets,
     bool update)
 {
-    vk::AccelerationStructureGeometryKHR* asGeometries = &asGeometry;
-    vk::AccelerationStructureBuildGeometryInfoKHR asBuildGeometryInfo = {
-        .type = asType,
-        .flags = asFlags,
+    // Any pending cache store would pick up the result of this build instead.
+    _cancelCacheStore();
+
+    std::deque<VulkanAccelerationStructureBuildBatch::Build>& builds =
+        _hostBuild ? batch._hostBuilds : batch._builds;
+    builds.emplace_back();
+    VulkanAccelerationStructureBuildBatch::Build& build = builds.back();
+
+    build.geometries = asGeometries;
+    build.geometriesPointer = build.geometries.data();
+    build.buildGeometryInfo = {
+        .type = _type,
+        .flags = _flags,
         .update = update,
         .srcAccelerationStructure = _as.get(),
         .dstAccelerationStructure = _as.get(),
         .geometryArrayOfPointers = false,
-        .geometryCount = 1,
-        .ppGeometries = &asGeometries,
-        .scratchData =
-            _vkbi.device.getBufferAddressKHR( // Plain getBufferAddress fails for some reason...
-                vk::BufferDeviceAddressInfo(scratchBuffer.getBuffer()),
-                _vkbi.dispatchLoader),
-    };
-    vk::AccelerationStructureBuildOffsetInfoKHR offset = {
-        .primitiveCount = numPrimitives,
-        .primitiveOffset = 0,
-        .firstVertex = 0,
-        .transformOffset = 0,
+        .geometryCount = uint32_t(build.geometries.size()),
+        .ppGeometries = &build.geometriesPointer,
+        .scratchData = scratchAddress,
     };
-    vk::AccelerationStructureBuildOffsetInfoKHR* offsets = &offset;
-    commandBuffer.buildAccelerationStructureKHR(1, &asBuildGeometryInfo, &offsets, _vkbi.dispatchLoader);
+    build.offsets = offsets;
+
+    if (_hostBuild) {
+        build.hostScratch.resize(_scratchMemorySize);
+    }
 }
 
 void VulkanAccelerationStructure::buildTopLevel(
     vk::CommandBuffer& commandBuffer,
     VulkanBuffer& scratchBuffer,
     uint32_t numInstances,
-    VulkanBuffer& instanceBuffer)
+    VulkanBuffer& instanceBuffer,
+    bool update)
 {
     vk::AccelerationStructureGeometryKHR asGeometry = {
         .geometryType = vk::GeometryTypeKHR::eInstances,
         .geometry = {
             vk::AccelerationStructureGeometryInstancesDataKHR(
                 false,
-                _vkbi.device.getBufferAddressKHR(
-                    vk::BufferDeviceAddressInfo(instanceBuffer.getBuffer()),
-                    _vkbi.dispatchLoader)),
+                instanceBuffer.getDeviceAddress()),
         },
         .flags = vk::GeometryFlagBitsKHR::eOpaque,
     };
-    _build(
-        commandBuffer,
-        scratchBuffer,
-        asGeometry,
-        vk::AccelerationStructureTypeKHR::eTopLevel,
-        TOP_LEVEL_BUILD_FLAGS,
-        numInstances);
+    vk::AccelerationStructureBuildOffsetInfoKHR offset = {
+        .primitiveCount = numInstances,
+        .primitiveOffset = 0,
+        .firstVertex = 0,
+        .transformOffset = 0,
+    };
+    VulkanAccelerationStructureBuildBatch batch(_vkbi);
+    _build(batch, scratchBuffer.getDeviceAddress(), { asGeometry }, { offset }, update);
+    batch.record(commandBuffer);
 }
 
 void VulkanAccelerationStructure::buildBottomLevel(
-    vk::CommandBuffer& commandBuffer,
-    VulkanBuffer& scratchBuffer,
+    VulkanAccelerationStructureBuildBatch& batch,
+    vk::DeviceAddress scratchAddress,
+    uint32_t firstTriangle,
     uint32_t numTriangles,
     VulkanBuffer& vertexBuffer,
     VulkanBuffer& indexBuffer,
     bool update)
 {
-    vk::AccelerationStructureGeometryKHR asGeometry = {
-        .geometryType = vk::GeometryTypeKHR::eTriangles,
-        .geometry = {
-            vk::AccelerationStructureGeometryTrianglesDataKHR(
+    buildBottomLevel(
+        batch,
+        scratchAddress,
+        {
+            {
+                .vertexBuffer = &vertexBuffer,
+                .indexBuffer = &indexBuffer,
+                .transformBuffer = nullptr,
+                .numVertices = 0,
+                .firstTriangle = firstTriangle,
+                .numTriangles = numTriangles,
+                .transformOffset = 0,
+            },
+        },
+        update);
+}
+
+void VulkanAccelerationStructure::buildBottomLevel(
+    VulkanAccelerationStructureBuildBatch& batch,
+    vk::DeviceAddress scratchAddress,
+    const std::vector<Geometry>& geometries,
+    bool update)
+{
+    std::vector<vk::AccelerationStructureGeometryKHR> asGeometries;
+    std::vector<vk::AccelerationStructureBuildOffsetInfoKHR> offsets;
+    for (const Geometry& geometry : geometries) {
+
+        // Host builds read the geometry straight from the buffers' mappings.
+        vk::AccelerationStructureGeometryTrianglesDataKHR trianglesData;
+        if (_hostBuild) {
+            trianglesData = vk::AccelerationStructureGeometryTrianglesDataKHR(
                 vk::Format::eR32G32B32Sfloat,
-                _vkbi.device.getBufferAddressKHR(
-                    vk::BufferDeviceAddressInfo(vertexBuffer.getBuffer()),
-                    _vkbi.dispatchLoader),
+                vk::DeviceOrHostAddressConstKHR(geometry.vertexBuffer->data()),
                 sizeof(pxr::GfVec3f),
                 vk::IndexType::eUint32,
-                _vkbi.device.getBufferAddressKHR(
-                    vk::BufferDeviceAddressInfo(indexBuffer.getBuffer()),
-                    _vkbi.dispatchLoader),
-                nullptr)
-        },
-        .flags = vk::GeometryFlagBitsKHR::eOpaque,
-    };
-    _build(
-        commandBuffer,
-        scratchBuffer,
-        asGeometry,
-        vk::AccelerationStructureTypeKHR::eBottomLevel,
-        BOTTOM_LEVEL_BUILD_FLAGS,
-        numTriangles,
-        update);
+                vk::DeviceOrHostAddressConstKHR(geometry.indexBuffer->data()),
+                geometry.transformBuffer
+                    ? vk::DeviceOrHostAddressConstKHR(geometry.transformBuffer->data())
+                    : vk::DeviceOrHostAddressConstKHR(vk::DeviceAddress(0)));
+        } else {
+            trianglesData = vk::AccelerationStructureGeometryTrianglesDataKHR(
+                vk::Format::eR32G32B32Sfloat,
+                geometry.vertexBuffer->getDeviceAddress(),
+                sizeof(pxr::GfVec3f),
+                vk::IndexType::eUint32,
+                geometry.indexBuffer->getDeviceAddress(),
+                geometry.transformBuffer ? geometry.transformBuffer->getDeviceAddress() : 0);
+        }
+
+        asGeometries.push_back({
+            .geometryType = vk::GeometryTypeKHR::eTriangles,
+            .geometry = { trianglesData },
+            .flags = vk::GeometryFlagBitsKHR::eOpaque,
+        });
+        offsets.push_back({
+            .primitiveCount = geometry.numTriangles,
+            .primitiveOffset = uint32_t(geometry.firstTriangle * sizeof(pxr::GfVec3i)),
+            .firstVertex = 0,
+            .transformOffset = geometry.transformOffset,
+        });
+    }
+    _build(batch, scratchAddress, asGeometries, offsets, update);
 }
@@ -6,60 +6,176 @@
 #include <VulkanBuffer.h>
 
 
+class ASCache;
+
+
+// Collects several AS builds so they can be recorded with a single build command. Builds within a
+// batch may execute concurrently, so each one must be given its own range of scratch memory.
+class VulkanAccelerationStructureBuildBatch {
+
+public:
+
+    VulkanAccelerationStructureBuildBatch(const VulkanBasicInfo& vkbi);
+
+    bool empty() {
+        return _builds.empty() && _hostBuilds.empty() && _deserializations.empty();
+    }
+
+    void clear();
+
+    // Runs all host builds in the batch, spreading them over TBB's worker threads, and returns
+    // once they've finished.
+    void buildOnHost();
+
+    void record(vk::CommandBuffer& commandBuffer);
+
+private:
+
+    friend class VulkanAccelerationStructure;
+
+    struct Build {
+        std::vector<vk::AccelerationStructureGeometryKHR> geometries;
+        vk::AccelerationStructureGeometryKHR* geometriesPointer;
+        vk::AccelerationStructureBuildGeometryInfoKHR buildGeometryInfo;
+        std::vector<vk::AccelerationStructureBuildOffsetInfoKHR> offsets;
+        std::vector<uint8_t> hostScratch;
+    };
+
+    const VulkanBasicInfo& _vkbi;
+
+    // Builds point into themselves, so use a deque to keep their addresses stable as more are added.
+    std::deque<Build> _builds;
+    std::deque<Build> _hostBuilds;
+    std::vector<vk::CopyMemoryToAccelerationStructureInfoKHR> _deserializations;
+
+};
+
+
 class VulkanAccelerationStructure {
 
 public:
 
+    // One triangle geometry of a BLAS. A BLAS can hold several, each optionally transformed by a
+    // VkTransformMatrixKHR stored at transformOffset in transformBuffer.
+    struct Geometry {
+        VulkanBuffer* vertexBuffer;
+        VulkanBuffer* indexBuffer;
+        VulkanBuffer* transformBuffer;
+        uint32_t numVertices;
+        uint32_t firstTriangle;
+        uint32_t numTriangles;
+        uint32_t transformOffset;
+    };
+
+    // Whether a BLAS with this many triangles should be built on the host rather than the device.
+    static bool preferHostBuild(const VulkanBasicInfo& vkbi, size_t numTriangles);
+
     VulkanAccelerationStructure(const VulkanBasicInfo& vkbi);
 
+    ~VulkanAccelerationStructure();
+
     const vk::AccelerationStructureKHR& getAccelerationStructure() {
         return _as.get();
     }
 
+    uint64_t getDeviceAddress() {
+        return _deviceAddress;
+    }
+
+    // Host builds allocate their own scratch memory, so they need no device scratch memory.
     uint64_t getScratchMemorySize() {
-        return _scratchMemorySize;
+        return _hostBuild ? 0 : _scratchMemorySize;
+    }
+
+    bool isHostBuild() {
+        return _hostBuild;
+    }
+
+    // Deserialized ASes are allocated at exactly the size of their contents, so they can be refit
+    // but not rebuilt.
+    bool isDeserialized() {
+        return _deserialized;
     }
 
     void allocateTopLevel(uint32_t maxInstances);
 
-    void allocateBottomLevel(uint32_t maxVertices, uint32_t maxTriangles);
+    // BLASes allocated for host builds live in host-visible memory, and all of their builds are
+    // run on the host by VulkanAccelerationStructureBuildBatch::buildOnHost().
+    void allocateBottomLevel(uint32_t maxVertices, uint32_t maxTriangles, bool hostBuild = false);
+
+    // Allocates a BLAS for static geometry which is never refit, so it's optimized for tracing
+    // rather than build speed.
+    void allocateStaticBottomLevel(const std::vector<Geometry>& geometries, bool hostBuild = false);
+
+    // Allocates a BLAS from a serialized copy in the cache, if there is a compatible one. The copy is
+    // only uploaded by a later call to deserialize().
+    bool allocateBottomLevelFromCache(ASCache& cache, uint64_t key);
 
     void buildTopLevel(
         vk::CommandBuffer& commandBuffer,
         VulkanBuffer& scratchBuffer,
         uint32_t numInstances,
-        VulkanBuffer& instanceBuffer);
+        VulkanBuffer& instanceBuffer,
+        bool update = false);
 
     void buildBottomLevel(
-        vk::CommandBuffer& commandBuffer,
-        VulkanBuffer& scratchBuffer,
+        VulkanAccelerationStructureBuildBatch& batch,
+        vk::DeviceAddress scratchAddress,
+        uint32_t firstTriangle,
         uint32_t numTriangles,
         VulkanBuffer& vertexBuffer,
         VulkanBuffer& indexBuffer,
         bool update = false);
 
+    void buildBottomLevel(
+        VulkanAccelerationStructureBuildBatch& batch,
+        vk::DeviceAddress scratchAddress,
+        const std::vector<Geometry>& geometries,
+        bool update = false);
+
+    void deserialize(VulkanAccelerationStructureBuildBatch& batch);
+
+    // Serializes this AS into the cache once the build which was just recorded has finished.
+    void queueCacheStore(ASCache& cache, uint64_t key);
+
 private:
 
+    friend class ASCache;
+
     uint64_t _getRequiredMemorySize(vk::AccelerationStructureMemoryRequirementsTypeKHR type);
 
     void _allocate(
-        const vk::AccelerationStructureCreateGeometryTypeInfoKHR& asCreateGeometryTypeInfo,
+        const std::vector<vk::AccelerationStructureCreateGeometryTypeInfoKHR>& asCreateGeometryTypeInfos,
         vk::AccelerationStructureTypeKHR asType,
-        vk::BuildAccelerationStructureFlagsKHR asFlags);
+        vk::BuildAccelerationStructureFlagsKHR asFlags,
+        bool hostBuild = false);
+
+    void _create(const vk::AccelerationStructureCreateInfoKHR& asCreateInfo, bool hostBuild = false);
+
+    void _cancelCacheStore();
 
     void _build(
-        vk::CommandBuffer& commandBuffer,
-        VulkanBuffer& scratchBuffer,
-        vk::AccelerationStructureGeometryKHR& asGeometry,
-        vk::AccelerationStructureTypeKHR asType,
-        vk::BuildAccelerationStructureFlagsKHR asFlags,
-        uint32_t numPrimitives,
+        VulkanAccelerationStructureBuildBatch& batch,
+        vk::DeviceAddress scratchAddress,
+        const std::vector<vk::AccelerationStructureGeometryKHR>& asGeometries,
+        const std::vector<vk::AccelerationStructureBuildOffsetInfoKHR>& offsets,
         bool update = false);
 
     const VulkanBasicInfo& _vkbi;
 
     vk::UniqueHandle<vk::AccelerationStructureKHR, vk::DispatchLoaderDynamic> _as;
+    vk::AccelerationStructureTypeKHR _type;
+    vk::BuildAccelerationStructureFlagsKHR _flags;
     VulkanBuffer _buffer;
-    uint64_t _scratchMemorySize;
+    uint64_t _deviceAddress = 0;
+    uint64_t _scratchMemorySize = 0;
+    bool _hostBuild = false;
+
+    bool _deserialized = false;
+    ASCache* _deserializeCache = nullptr;
+    std::unique_ptr<VulkanBuffer> _serializedBuffer;
+
+    // Set while this AS is waiting to be serialized into a cache.
+    ASCache* _pendingStoreCache = nullptr;
 
 };
@@ -57,3 +57,9 @@ void VulkanBuffer::allocate(uint64_t size, bool host, vk::BufferUsageFlags usage
             {});
     }
 }
+
+vk::DeviceAddress VulkanBuffer::getDeviceAddress() {
+    return _vkbi.device.getBufferAddressKHR( // Plain getBufferAddress fails for some reason...
+        vk::BufferDeviceAddressInfo(_buffer.get()),
+        _vkbi.dispatchLoader);
+}
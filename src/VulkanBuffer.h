@@ -21,6 +21,8 @@ public:
         return _buffer.get();
     }
 
+    vk::DeviceAddress getDeviceAddress();
+
     uint64_t size() {
         return _size;
     }
@@ -7,6 +7,12 @@ VulkanImage::VulkanImage(const VulkanBasicInfo& vkbi) : _vkbi(vkbi)
 {
 }
 
+void VulkanImage::free() {
+    _imageView.reset();
+    _image.reset();
+    _memory.reset();
+}
+
 void VulkanImage::allocate(
     vk::Format format,
     vk::Extent2D extent,
@@ -14,9 +20,7 @@ void VulkanImage::allocate(
     vk::ImageAspectFlags aspects,
     bool externalUse)
 {
-    _imageView.reset();
-    _image.reset();
-    _memory.reset();
+    free();
 
     uint32_t queueFamilyIndices[] = {
         _vkbi.graphicsQueueFamilyIndex,
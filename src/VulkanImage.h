@@ -18,6 +18,8 @@ public:
         vk::ImageAspectFlags aspects,
         bool externalUse = false);
 
+    void free();
+
     const vk::DeviceMemory& getMemory() {
         return _memory.get();
     }
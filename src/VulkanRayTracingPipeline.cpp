@@ -0,0 +1,265 @@
+#include <Common.h>
+
+#include <VulkanRayTracingPipeline.h>
+
+
+// Triangle hit attributes are just the barycentrics.
+static const uint32_t MAX_ATTRIBUTE_SIZE = 2 * sizeof(float);
+
+
+VulkanRayTracingPipeline::VulkanRayTracingPipeline(const VulkanBasicInfo& vkbi)
+    : _vkbi(vkbi),
+      _sbtBuffer(_vkbi)
+{
+}
+
+VulkanRayTracingPipeline::~VulkanRayTracingPipeline() {
+
+    // The joining tasks finish the operations, so just let them run to completion.
+    _compileTasks.wait();
+
+    if (_pipeline) {
+        _vkbi.device.destroyPipeline(_pipeline, nullptr, _vkbi.dispatchLoader);
+    }
+    _clearLibraries();
+}
+
+void VulkanRayTracingPipeline::compile(
+    const std::vector<vk::PipelineShaderStageCreateInfo>& stages,
+    const std::vector<vk::RayTracingShaderGroupCreateInfoKHR>& groups,
+    uint32_t maxRecursionDepth,
+    uint32_t maxPayloadSize,
+    vk::PipelineLayout layout)
+{
+    _compileTasks.wait();
+    if (_pipeline) {
+        _vkbi.device.destroyPipeline(_pipeline, nullptr, _vkbi.dispatchLoader);
+        _pipeline = vk::Pipeline();
+    }
+    _ready = false;
+
+    // Libraries have to agree with the pipeline they're linked into, so anything built for a
+    // different layout or interface can't be reused.
+    if (layout != _layout
+        || maxRecursionDepth != _maxRecursionDepth
+        || maxPayloadSize != _libraryInterface.maxPayloadSize)
+    {
+        _clearLibraries();
+        _layout = layout;
+        _maxRecursionDepth = maxRecursionDepth;
+        _libraryInterface = {
+            .maxPayloadSize = maxPayloadSize,
+            .maxAttributeSize = MAX_ATTRIBUTE_SIZE,
+            .maxCallableSize = 0,
+        };
+    }
+
+    _linkedLibraries.clear();
+    for (const vk::RayTracingShaderGroupCreateInfoKHR& group : groups) {
+        _linkedLibraries.push_back(&_getLibrary(stages, group));
+    }
+}
+
+VulkanRayTracingPipeline::Library& VulkanRayTracingPipeline::_getLibrary(
+    const std::vector<vk::PipelineShaderStageCreateInfo>& stages,
+    const vk::RayTracingShaderGroupCreateInfoKHR& group)
+{
+    // Pull out just the stages this group uses, and point the group at its own copies of them.
+
+    auto library = std::make_unique<Library>();
+    library->group = group;
+
+    LibraryKey key = { .type = group.type };
+    for (uint32_t* shader : {
+        &library->group.generalShader,
+        &library->group.closestHitShader,
+        &library->group.anyHitShader,
+        &library->group.intersectionShader})
+    {
+        if (*shader == VK_SHADER_UNUSED_KHR) continue;
+        const vk::PipelineShaderStageCreateInfo& stage = stages[*shader];
+        key.stages.emplace_back(VkShaderStageFlags(stage.stage), VkShaderModule(stage.module), stage.pName);
+        *shader = library->stages.size();
+        library->stages.push_back(stage);
+    }
+
+    auto it = _libraries.find(key);
+    if (it != _libraries.end()) return *it->second;
+
+    // The entry point names have to outlive the compile, so use the copies in the key.
+    it = _libraries.emplace(std::move(key), std::move(library)).first;
+    Library& newLibrary = *it->second;
+    for (uint32_t i = 0; i < newLibrary.stages.size(); i++) {
+        newLibrary.stages[i].pName = std::get<2>(it->first.stages[i]).c_str();
+    }
+
+    newLibrary.operation = _vkbi.device.createDeferredOperationKHRUnique(nullptr, _vkbi.dispatchLoader);
+    newLibrary.deferredOperationInfo = {
+        .operationHandle = newLibrary.operation.get(),
+    };
+
+    newLibrary.createInfo = {
+        .flags = vk::PipelineCreateFlagBits::eLibraryKHR,
+        .stageCount = uint32_t(newLibrary.stages.size()),
+        .stages = newLibrary.stages.data(),
+        .groupCount = 1,
+        .groups = &newLibrary.group,
+        .maxRecursionDepth = _maxRecursionDepth,
+        .libraries = {},
+        .pLibraryInterface = &_libraryInterface,
+        .layout = _layout,
+    };
+    newLibrary.createInfo.setPNext(&newLibrary.deferredOperationInfo);
+
+    vk::Result result = _vkbi.device.createRayTracingPipelinesKHR(
+        vk::PipelineCache(),
+        1,
+        &newLibrary.createInfo,
+        nullptr,
+        &newLibrary.pipeline,
+        _vkbi.dispatchLoader);
+
+    if (result == vk::Result::eOperationDeferredKHR) {
+
+        vk::DeferredOperationKHR operation = newLibrary.operation.get();
+        uint32_t concurrency = std::max(
+            std::min(
+                _vkbi.device.getDeferredOperationMaxConcurrencyKHR(operation, _vkbi.dispatchLoader),
+                std::thread::hardware_concurrency()),
+            1u);
+
+        for (uint32_t i = 0; i < concurrency; i++) {
+            _compileTasks.run([this, operation]() {
+                vk::Result joinResult;
+                do {
+                    joinResult = _vkbi.device.deferredOperationJoinKHR(operation, _vkbi.dispatchLoader);
+                } while (joinResult == vk::Result::eThreadIdleKHR);
+            });
+        }
+
+    } else if (result == vk::Result::eSuccess || result == vk::Result::eOperationNotDeferredKHR) {
+
+        // The implementation compiled it right away.
+        newLibrary.operation.reset();
+
+    } else {
+        _libraries.erase(it);
+        throw std::runtime_error("Failed to compile ray tracing pipeline library.");
+    }
+
+    return newLibrary;
+}
+
+void VulkanRayTracingPipeline::_clearLibraries() {
+    _linkedLibraries.clear();
+    for (auto& [key, library] : _libraries) {
+        if (library->pipeline) {
+            _vkbi.device.destroyPipeline(library->pipeline, nullptr, _vkbi.dispatchLoader);
+        }
+    }
+    _libraries.clear();
+}
+
+bool VulkanRayTracingPipeline::isReady() {
+
+    if (_ready || _linkedLibraries.empty()) return _ready;
+
+    for (Library* library : _linkedLibraries) {
+        if (library->operation
+            && _vkbi.device.getDeferredOperationResultKHR(library->operation.get(), _vkbi.dispatchLoader)
+                == vk::Result::eNotReady)
+        {
+            return false;
+        }
+    }
+
+    _compileTasks.wait();
+    for (Library* library : _linkedLibraries) {
+        if (!library->operation) continue;
+        if (_vkbi.device.getDeferredOperationResultKHR(library->operation.get(), _vkbi.dispatchLoader)
+            != vk::Result::eSuccess)
+        {
+            throw std::runtime_error("Failed to compile ray tracing pipeline library.");
+        }
+        library->operation.reset();
+    }
+
+    _link();
+    _createShaderBindingTable();
+    _ready = true;
+    return true;
+}
+
+void VulkanRayTracingPipeline::_link() {
+
+    // Linking is cheap next to compiling the libraries, so it's just done here. Groups from the
+    // libraries come after the pipeline's own (of which there are none), in library order.
+
+    std::vector<vk::Pipeline> libraryPipelines;
+    for (Library* library : _linkedLibraries) {
+        libraryPipelines.push_back(library->pipeline);
+    }
+
+    vk::RayTracingPipelineCreateInfoKHR createInfo = {
+        .flags = vk::PipelineCreateFlags(),
+        .stageCount = 0,
+        .stages = nullptr,
+        .groupCount = 0,
+        .groups = nullptr,
+        .maxRecursionDepth = _maxRecursionDepth,
+        .libraries = {
+            .libraryCount = uint32_t(libraryPipelines.size()),
+            .pLibraries = libraryPipelines.data(),
+        },
+        .pLibraryInterface = &_libraryInterface,
+        .layout = _layout,
+    };
+
+    vk::Result result = _vkbi.device.createRayTracingPipelinesKHR(
+        vk::PipelineCache(),
+        1,
+        &createInfo,
+        nullptr,
+        &_pipeline,
+        _vkbi.dispatchLoader);
+    if (result != vk::Result::eSuccess) {
+        throw std::runtime_error("Failed to link ray tracing pipeline.");
+    }
+}
+
+void VulkanRayTracingPipeline::_createShaderBindingTable() {
+
+    vk::PhysicalDeviceProperties2 properties;
+    vk::PhysicalDeviceRayTracingPropertiesKHR rtProperties;
+    properties.pNext = &rtProperties;
+    _vkbi.physicalDevice.getProperties2(&properties);
+
+    uint32_t numGroups = _linkedLibraries.size();
+    std::vector<uint8_t> shaderGroupHandles(numGroups * rtProperties.shaderGroupHandleSize);
+    _vkbi.device.getRayTracingShaderGroupHandlesKHR(
+        _pipeline,
+        0,
+        numGroups,
+        shaderGroupHandles.size() * sizeof(uint8_t),
+        shaderGroupHandles.data(),
+        _vkbi.dispatchLoader);
+
+    _sbtRecordSize = rtProperties.shaderGroupBaseAlignment;
+    _sbtBuffer.allocate(
+        numGroups * _sbtRecordSize,
+        true,
+        vk::BufferUsageFlagBits::eRayTracingKHR);
+    for (uint32_t i = 0; i < numGroups; i++) {
+        std::memcpy(
+            reinterpret_cast<uint8_t*>(_sbtBuffer.data()) + i * _sbtRecordSize,
+            shaderGroupHandles.data() + i * rtProperties.shaderGroupHandleSize,
+            rtProperties.shaderGroupHandleSize);
+    }
+}
+
+vk::StridedBufferRegionKHR VulkanRayTracingPipeline::getShaderBindingTableRegion(
+    uint32_t firstGroupI,
+    uint32_t numGroups)
+{
+    return { _sbtBuffer.getBuffer(), firstGroupI * _sbtRecordSize, _sbtRecordSize, numGroups * _sbtRecordSize };
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <Common.h>
+
+#include <VulkanUtils.h>
+#include <VulkanBuffer.h>
+
+
+// A ray tracing pipeline and its shader binding table. Each shader group is compiled into its own
+// pipeline library, which is kept around and reused by later compiles, so changing one stage only
+// recompiles that stage before everything is linked together again. Compiling can take a long
+// time, so it's done in the background by deferred host operations which are joined by TBB worker
+// threads, and the pipeline can't be used until isReady() returns true.
+class VulkanRayTracingPipeline {
+
+public:
+
+    VulkanRayTracingPipeline(const VulkanBasicInfo& vkbi);
+
+    ~VulkanRayTracingPipeline();
+
+    // Starts compiling the pipeline. The layout must stay alive until it's ready, and the device
+    // must not be using the previous pipeline. The shader binding table holds one record per group,
+    // in order.
+    void compile(
+        const std::vector<vk::PipelineShaderStageCreateInfo>& stages,
+        const std::vector<vk::RayTracingShaderGroupCreateInfoKHR>& groups,
+        uint32_t maxRecursionDepth,
+        uint32_t maxPayloadSize,
+        vk::PipelineLayout layout);
+
+    bool isReady();
+
+    const vk::Pipeline& getPipeline() {
+        return _pipeline;
+    }
+
+    // A region covering numGroups consecutive records, e.g. one for each miss shader.
+    vk::StridedBufferRegionKHR getShaderBindingTableRegion(uint32_t firstGroupI, uint32_t numGroups = 1);
+
+private:
+
+    // Identifies a library by its group type and the shaders in it.
+    struct LibraryKey {
+
+        vk::RayTracingShaderGroupTypeKHR type;
+        std::vector<std::tuple<VkShaderStageFlags, VkShaderModule, std::string>> stages;
+
+        bool operator<(const LibraryKey& other) const {
+            return std::tie(type, stages) < std::tie(other.type, other.stages);
+        }
+    };
+
+    // Everything the deferred operation reads has to stay alive until it's finished.
+    struct Library {
+        std::vector<vk::PipelineShaderStageCreateInfo> stages;
+        vk::RayTracingShaderGroupCreateInfoKHR group;
+        vk::DeferredOperationInfoKHR deferredOperationInfo;
+        vk::RayTracingPipelineCreateInfoKHR createInfo;
+        vk::UniqueHandle<vk::DeferredOperationKHR, vk::DispatchLoaderDynamic> operation;
+        vk::Pipeline pipeline;
+    };
+
+    Library& _getLibrary(
+        const std::vector<vk::PipelineShaderStageCreateInfo>& stages,
+        const vk::RayTracingShaderGroupCreateInfoKHR& group);
+
+    void _clearLibraries();
+
+    void _link();
+
+    void _createShaderBindingTable();
+
+    const VulkanBasicInfo& _vkbi;
+
+    vk::PipelineLayout _layout;
+    uint32_t _maxRecursionDepth = 0;
+    vk::RayTracingPipelineInterfaceCreateInfoKHR _libraryInterface;
+    std::map<LibraryKey, std::unique_ptr<Library>> _libraries;
+    std::vector<Library*> _linkedLibraries;
+    tbb::task_group _compileTasks;
+
+    bool _ready = false;
+    vk::Pipeline _pipeline;
+
+    VulkanBuffer _sbtBuffer;
+    vk::DeviceSize _sbtRecordSize = 0;
+
+};
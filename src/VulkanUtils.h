@@ -25,7 +25,10 @@ struct VulkanBasicInfo {
     uint32_t computeQueueFamilyIndex;
     vk::Queue graphicsQueue;
     vk::Queue transferQueue;
-    vk::Queue computeQueues[3];
+    std::vector<vk::Queue> computeQueues;
+    bool rayTracingPipeline;
+    bool rayQuery;
+    bool hostAccelerationStructureCommands;
 
 };
 